@@ -31,13 +31,34 @@
  *
  */
 
+/* memfd_create() for FTPD_SFIFO_MIRROR is a GNU extension, which has to
+   be selected before the first system header. */
+#if defined(FTPD_SFIFO_MIRROR) && FTPD_SFIFO_MIRROR && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+/*
+ * Run on Linux sockets through tcp_epoll.c instead of lwIP; see
+ * tcp_epoll.h. The process then drives everything by calling
+ * tcp_epoll_poll() in a loop after ftpd_init().
+ */
+#ifndef FTPD_EPOLL
+#define FTPD_EPOLL 0
+#endif
+
+#if FTPD_EPOLL
+#include "tcp_epoll.h"
+#else
 #include "lwip/debug.h"
 
 #include "lwip/stats.h"
+#endif
 
 #include "ftpd.h"
 
+#if !FTPD_EPOLL
 #include "lwip/tcp.h"
+#endif
 
 #include <stdio.h>
 #include <stdarg.h>
@@ -46,6 +67,364 @@
 
 #include "vfs.h"
 
+/* Port of the control connection */
+#ifndef FTPD_PORT
+#define FTPD_PORT 21
+#endif
+
+/* Size of the FIFO that buffers a data connection. */
+#ifndef FTPD_DATA_FIFO_SIZE
+#define FTPD_DATA_FIFO_SIZE 2000
+#endif
+
+/*
+ * RETR grows the FIFO of its data connection to hold two of the reads the
+ * backend prefers (vfs_io_hints), up to this size. Set it to
+ * FTPD_DATA_FIFO_SIZE to keep every FIFO at that size.
+ */
+#ifndef FTPD_DATA_FIFO_MAX
+#define FTPD_DATA_FIFO_MAX 16384
+#endif
+
+/* Size of the FIFO that buffers replies on the control connection. */
+#ifndef FTPD_MSG_FIFO_SIZE
+#define FTPD_MSG_FIFO_SIZE 2000
+#endif
+
+/*
+ * Data connections a session may have at once. With more than one, a
+ * client can fetch several ranges of a file in parallel by following each
+ * PASV with REST or RANG and RETR, and collect the 226 replies as the
+ * transfers end.
+ */
+#ifndef FTPD_DATA_CONNS
+#define FTPD_DATA_CONNS 1
+#endif
+
+/* Maximum number of pbufs passed to a single vfs_writev() call. */
+#ifndef FTPD_WRITEV_MAX
+#define FTPD_WRITEV_MAX 16
+#endif
+
+/*
+ * Write-back cache for STOR. Received data is queued in RAM and written to
+ * the VFS in whole FTPD_WB_BLOCK_SIZE blocks by ftpd_wb_flush().
+ */
+#ifndef FTPD_WRITEBACK
+#define FTPD_WRITEBACK 0
+#endif
+
+#if FTPD_WRITEBACK
+/* Smallest storage write unit; a power of 2 that divides FTPD_WB_FIFO_SIZE.
+   Larger units are used if vfs_io_hints() asks for them. */
+#ifndef FTPD_WB_BLOCK_SIZE
+#define FTPD_WB_BLOCK_SIZE 512
+#endif
+
+/* Cache per upload; a power of 2. */
+#ifndef FTPD_WB_FIFO_SIZE
+#define FTPD_WB_FIFO_SIZE 8192
+#endif
+
+/* Number of uploads that can be cached at the same time. Others are
+   written through as before. */
+#ifndef FTPD_WB_MAX_FILES
+#define FTPD_WB_MAX_FILES 2
+#endif
+
+/* Cached bytes not yet written, over all uploads. Beyond this, received
+   data is held back unacknowledged, which closes the TCP window of the
+   sender. */
+#ifndef FTPD_WB_DIRTY_LIMIT
+#define FTPD_WB_DIRTY_LIMIT 8192
+#endif
+
+/* Most bytes written per upload in one ftpd_wb_flush() call. */
+#ifndef FTPD_WB_FLUSH_MAX
+#define FTPD_WB_FLUSH_MAX 2048
+#endif
+
+/* 1: send 226 only after the upload has been written and closed.
+   0: send 226 as soon as the cache has accepted all data. */
+#ifndef FTPD_WB_DURABLE
+#define FTPD_WB_DURABLE 1
+#endif
+
+/* 1: flush from the tcpip thread after each received segment and on poll.
+   0: the application calls ftpd_wb_flush() from its own storage task,
+   which needs FTPD_SFIFO_ATOMIC. Whenever that writes something, the
+   tcpip thread is woken to refill the cache and send the replies: with
+   tcpip_try_callback() (lwIP 2.1 or later, not NO_SYS), or through an
+   eventfd with FTPD_EPOLL. The storage task only calls vfs_write(), which
+   the backend has to allow next to the tcpip thread's calls (FatFs:
+   _FS_REENTRANT); files are closed in the tcpip thread, since closing
+   updates backend state such as the FatFs name index. */
+#ifndef FTPD_WB_FLUSH_INLINE
+#define FTPD_WB_FLUSH_INLINE 1
+#endif
+#endif
+
+/*
+ * Keep up to this many files open after RETR for the next download of the
+ * same file. 0 disables the cache.
+ */
+#ifndef FTPD_FILE_CACHE
+#define FTPD_FILE_CACHE 0
+#endif
+
+/*
+ * Keep whole files of up to FTPD_CONTENT_CACHE_MAX_FILE bytes in RAM after
+ * RETR, within FTPD_CONTENT_CACHE bytes in total, and send them to TCP by
+ * reference. 0 disables the cache.
+ */
+#ifndef FTPD_CONTENT_CACHE
+#define FTPD_CONTENT_CACHE 0
+#endif
+
+#if FTPD_CONTENT_CACHE
+#ifndef FTPD_CONTENT_CACHE_MAX_FILE
+#define FTPD_CONTENT_CACHE_MAX_FILE 4096
+#endif
+
+/* Allocator for file contents, e.g. one that uses PSRAM. */
+#ifndef FTPD_CC_MALLOC
+#define FTPD_CC_MALLOC(size) ftpd_alloc(NULL, size)
+#define FTPD_CC_FREE(ptr) ftpd_free(NULL, ptr)
+#endif
+#endif
+
+/*
+ * Let concurrent downloads of the same file share one reader with a ring of
+ * FTPD_SHARED_READ bytes, a power of 2. 0 disables sharing.
+ */
+#ifndef FTPD_SHARED_READ
+#define FTPD_SHARED_READ 0
+#endif
+
+#if FTPD_SHARED_READ
+/* Bytes per read; a power of 2 that divides FTPD_SHARED_READ. */
+#ifndef FTPD_SR_BLOCK_SIZE
+#define FTPD_SR_BLOCK_SIZE 2048
+#endif
+
+/* Number of files that can be shared at the same time. */
+#ifndef FTPD_SR_MAX_FILES
+#define FTPD_SR_MAX_FILES 2
+#endif
+#endif
+
+/*
+ * Storage I/O through io_uring (vfs_uring.c) for the Linux build with
+ * FTPD_EPOLL and vfs_posix.h. RETR reads ahead into the FIFO, and STOR
+ * writes and the stat calls of LIST are queued, submitted together once
+ * per round of the event loop and carry their transfers on as they
+ * complete, so that a slow disk doesn't hold up the other sessions. The
+ * value is the size of the ring; 0 disables it.
+ */
+#ifndef FTPD_URING
+#define FTPD_URING 0
+#endif
+
+#if FTPD_URING
+#if !FTPD_EPOLL || !defined(vfs_fileno)
+#error "FTPD_URING needs FTPD_EPOLL and vfs_posix.h"
+#endif
+#include "vfs_uring.h"
+
+/* Directory entries that LIST stats at the same time. */
+#ifndef FTPD_URING_LIST_BATCH
+#define FTPD_URING_LIST_BATCH 16
+#endif
+#endif
+
+/*
+ * Zero-copy transfers for the Linux build with FTPD_EPOLL and
+ * vfs_posix.h: RETR sends the file with sendfile() and STOR moves the
+ * data from the socket to the file with splice(), so that it is never
+ * copied through the FIFO. Transfers whose data has to be looked at or
+ * changed on the way stay on the buffered path (see ftpd_zc_ok()).
+ */
+#ifndef FTPD_ZEROCOPY
+#define FTPD_ZEROCOPY 0
+#endif
+
+#if FTPD_ZEROCOPY && (!FTPD_EPOLL || !defined(vfs_fileno))
+#error "FTPD_ZEROCOPY needs FTPD_EPOLL and vfs_posix.h"
+#endif
+
+/*
+ * Checksum commands for the Linux build with FTPD_EPOLL and vfs_posix.h:
+ * XCRC and HASH, both CRC32 of a whole file or of the range from REST or
+ * RANG. The file is read and checksummed by this many threads at the
+ * same time (vfs_hash.c), and the reply follows once they are done, with
+ * progress lines every FTPD_HASH_PROGRESS_MS until then. 0 disables the
+ * commands.
+ */
+#ifndef FTPD_HASH_THREADS
+#define FTPD_HASH_THREADS 0
+#endif
+
+#if FTPD_HASH_THREADS
+#if !FTPD_EPOLL || !defined(vfs_fileno)
+#error "FTPD_HASH_THREADS needs FTPD_EPOLL and vfs_posix.h"
+#endif
+#include "vfs_hash.h"
+
+#ifndef FTPD_HASH_PROGRESS_MS
+#define FTPD_HASH_PROGRESS_MS 2000
+#endif
+#endif
+
+/*
+ * Transfers that convert their data, such as TYPE A, run it through a
+ * pipeline of at most FTPD_PIPE_MAX stages, each buffering FTPD_PIPE_BUF
+ * bytes of its input.
+ */
+#ifndef FTPD_PIPE_BUF
+#define FTPD_PIPE_BUF 1024
+#endif
+
+#ifndef FTPD_PIPE_MAX
+#define FTPD_PIPE_MAX 4
+#endif
+
+/*
+ * Latency mode for the control connection: disable Nagle on control PCBs
+ * and push each command's replies out with tcp_output() as soon as the
+ * command has been handled. Data connections keep Nagle for bulk sends.
+ */
+#ifndef FTPD_MSG_NODELAY
+#define FTPD_MSG_NODELAY 0
+#endif
+
+/*
+ * Per-command latency histograms, queried with ftpd_latency() or
+ * SITE LATENCY. FTPD_LAT_CLOCK() returns a free-running microsecond
+ * count; the default only has the millisecond resolution of sys_now().
+ */
+#ifndef FTPD_LATENCY
+#define FTPD_LATENCY 0
+#endif
+#if FTPD_LATENCY
+#ifndef FTPD_LAT_CLOCK
+#if !FTPD_EPOLL
+#include "lwip/sys.h"
+#endif
+#define FTPD_LAT_CLOCK() ((u32_t) sys_now() * 1000)
+#endif
+/* Log2 buckets; the last one collects everything from 2^(n-1) us up. */
+#ifndef FTPD_LAT_BUCKETS
+#define FTPD_LAT_BUCKETS 24
+#endif
+#endif
+
+/*
+ * Tracepoints on session, state and data connection changes, FIFO
+ * stalls, failed tcp_write() calls and every VFS call, recorded into a
+ * ring of FTPD_TRACE events (a power of 2). ftpd_trace_dump() writes the
+ * ring as Chrome trace JSON, which Perfetto also reads. With 0 the
+ * tracepoints compile to nothing.
+ */
+#ifndef FTPD_TRACE
+#define FTPD_TRACE 0
+#endif
+#if FTPD_TRACE
+#ifndef FTPD_TRACE_CLOCK
+#if !FTPD_EPOLL
+#include "lwip/sys.h"
+#endif
+#define FTPD_TRACE_CLOCK() ((u32_t) sys_now() * 1000)
+#endif
+#if FTPD_TRACE & (FTPD_TRACE - 1)
+#error "FTPD_TRACE must be a power of 2"
+#endif
+#endif
+
+/*
+ * Allocator hook. FTPD_MALLOC and FTPD_FREE get the account an
+ * allocation is charged to: a session's, or NULL for shared state such
+ * as the caches. With FTPD_MEM_STATS every allocation carries a small
+ * header so that current and peak use can be tracked per session and in
+ * total, and FTPD_SESSION_MEM_LIMIT and FTPD_MEM_LIMIT (bytes, 0 for no
+ * limit) can be enforced.
+ */
+#ifndef FTPD_MALLOC
+#define FTPD_MALLOC(ctx, size) malloc(size)
+#define FTPD_FREE(ctx, ptr) free(ptr)
+#endif
+#ifndef FTPD_MEM_STATS
+#define FTPD_MEM_STATS 0
+#endif
+#ifndef FTPD_MEM_LIMIT
+#define FTPD_MEM_LIMIT 0
+#endif
+#ifndef FTPD_SESSION_MEM_LIMIT
+#define FTPD_SESSION_MEM_LIMIT 0
+#endif
+#if (FTPD_MEM_LIMIT || FTPD_SESSION_MEM_LIMIT) && !FTPD_MEM_STATS
+#error "Memory limits need FTPD_MEM_STATS"
+#endif
+
+/*
+ * Give each session a slab of FTPD_SESSION_ARENA bytes to allocate from.
+ * Blocks are sized in powers of two from 16 bytes up to
+ * 16 << (FTPD_ARENA_CLASSES - 1), and freed blocks are kept on a list per
+ * size for the next data state, buffer or path of the same session. The
+ * slab goes back to the heap in one piece when the session ends. Larger
+ * allocations, and those that don't fit anymore, come from the heap.
+ */
+#ifndef FTPD_SESSION_ARENA
+#define FTPD_SESSION_ARENA 0
+#endif
+#ifndef FTPD_ARENA_CLASSES
+#define FTPD_ARENA_CLASSES 9
+#endif
+#if FTPD_SESSION_ARENA && !FTPD_MEM_STATS
+#error "FTPD_SESSION_ARENA needs FTPD_MEM_STATS"
+#endif
+
+/* RETR can pass file data to TCP by reference. */
+#if defined(VFS_HAVE_MAP) || FTPD_CONTENT_CACHE || FTPD_SHARED_READ
+#define FTPD_SEND_BYREF
+#endif
+
+/*
+ * Map the FIFO buffers twice, back to back, so that any span up to the
+ * buffer size is contiguous. This needs mmap and memfd_create, i.e. the
+ * Linux host build, and rounds each FIFO up to a whole number of pages.
+ * Define it on the compiler command line, as it also selects _GNU_SOURCE.
+ */
+#ifndef FTPD_SFIFO_MIRROR
+#define FTPD_SFIFO_MIRROR 0
+#endif
+
+/*
+ * Use C11 atomics with acquire/release ordering for the FIFO indices.
+ * This is only needed if a FIFO is filled and drained by different
+ * threads, e.g. a storage thread feeding the tcpip thread.
+ */
+#ifndef FTPD_SFIFO_ATOMIC
+#define FTPD_SFIFO_ATOMIC 0
+#endif
+
+#if FTPD_WRITEBACK && !FTPD_WB_FLUSH_INLINE && !FTPD_SFIFO_ATOMIC
+#error "A separate flusher task needs FTPD_SFIFO_ATOMIC"
+#endif
+
+#if FTPD_WRITEBACK && !FTPD_WB_FLUSH_INLINE
+#if FTPD_EPOLL
+#include <sys/eventfd.h>
+#include <unistd.h>
+#else
+#include "lwip/tcpip.h"
+#endif
+#endif
+
+#if FTPD_SFIFO_MIRROR
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #ifdef FTPD_DEBUG
 int dbg_printf(const char *fmt, ...);
 #else
@@ -86,8 +465,8 @@ int dbg_printf(const char *fmt, ...);
 #define msg120 "120 Service ready in nnn minutes."
 #define msg125 "125 Data connection already open; transfer starting."
 #define msg150 "150 File status okay; about to open data connection."
-#define msg150recv "150 Opening BINARY mode data connection for %s (%i bytes)."
-#define msg150stor "150 Opening BINARY mode data connection for %s."
+#define msg150recv "150 Opening %s mode data connection for %s (%i bytes)."
+#define msg150stor "150 Opening %s mode data connection for %s."
 #define msg200 "200 Command okay."
 #define msg202 "202 Command not implemented, superfluous at this site."
 #define msg211 "211 System status, or system help reply."
@@ -135,6 +514,9 @@ int dbg_printf(const char *fmt, ...);
 #define msg331 "331 User name okay, need password."
 #define msg332 "332 Need account for login."
 #define msg350 "350 Requested file action pending further information."
+#define msg350rest "350 Restarting at %lu. Only RETRIEVE can be restarted."
+#define msg350rang "350 Restarting at %lu. End byte range at %lu."
+#define msg350rang0 "350 Restarting at 0. End byte range at EOF."
 #define msg421 "421 Service not available, closing control connection."
 /*
              This may be a reply to any command if the service knows it
@@ -175,6 +557,7 @@ int dbg_printf(const char *fmt, ...);
 /*
              File name not allowed.
 */
+#define msg554 "554 Requested action not taken: invalid REST parameter."
 
 enum ftpd_state_e {
 	FTPD_USER,
@@ -203,6 +586,213 @@ static const char *month_table[12] = {
 	"Dec"
 };
 
+#if FTPD_MEM_STATS
+#if FTPD_SFIFO_ATOMIC
+/* The storage task frees what it closes, so counters can be shared. */
+#include <stdatomic.h>
+typedef atomic_size_t ftpd_memcount_t;
+#define FTPD_MEM_ADD(x, v) (atomic_fetch_add_explicit(&(x), (v), memory_order_relaxed) + (v))
+#define FTPD_MEM_SUB(x, v) (atomic_fetch_sub_explicit(&(x), (v), memory_order_acq_rel) - (v))
+#else
+typedef size_t ftpd_memcount_t;
+#define FTPD_MEM_ADD(x, v) ((x) += (v))
+#define FTPD_MEM_SUB(x, v) ((x) -= (v))
+#endif
+
+/*
+ * An account lives until the session has ended and everything charged
+ * to it has been freed. Anything that may be handed to shared state is
+ * charged to NULL instead, so that normally happens at the end of the
+ * session.
+ */
+struct ftpd_mem {
+	ftpd_memcount_t current;
+	ftpd_memcount_t peak;
+	ftpd_memcount_t refs;	/* live allocations, plus one for the session */
+	size_t limit;
+#if FTPD_SESSION_ARENA
+	char *slab;
+	size_t slabused;
+	union ftpd_memhdr *freelist[FTPD_ARENA_CLASSES];
+#endif
+};
+
+union ftpd_memhdr {
+	struct {
+		struct ftpd_mem *ctx;
+		size_t size;
+#if FTPD_SESSION_ARENA
+		int cls;	/* arena size class, or -1 for the heap */
+#endif
+	} h;
+	long long align_ll;
+	double align_d;
+	void *align_p;
+};
+
+static struct ftpd_mem ftpd_mem_all = { .limit = FTPD_MEM_LIMIT };
+
+static void ftpd_mem_charge(struct ftpd_mem *m, size_t size)
+{
+	size_t cur = FTPD_MEM_ADD(m->current, size);
+
+	if (cur > m->peak)
+		m->peak = cur;
+}
+
+static struct ftpd_mem *ftpd_mem_new(size_t limit)
+{
+	struct ftpd_mem *m = FTPD_MALLOC(NULL, sizeof(struct ftpd_mem));
+
+	if (m) {
+		memset(m, 0, sizeof(struct ftpd_mem));
+		m->refs = 1;
+		m->limit = limit;
+#if FTPD_SESSION_ARENA
+		m->slab = FTPD_MALLOC(m, FTPD_SESSION_ARENA);
+		if (!m->slab) {
+			FTPD_FREE(NULL, m);
+			return NULL;
+		}
+#endif
+	}
+	return m;
+}
+
+static void ftpd_mem_put(struct ftpd_mem *m)
+{
+	if (m && FTPD_MEM_SUB(m->refs, 1) == 0) {
+#if FTPD_SESSION_ARENA
+		FTPD_FREE(m, m->slab);
+#endif
+		FTPD_FREE(NULL, m);
+	}
+}
+
+#if FTPD_SESSION_ARENA
+/* Take a block from the session's slab, or return NULL to use the heap. */
+static union ftpd_memhdr *ftpd_arena_alloc(struct ftpd_mem *m, size_t size)
+{
+	union ftpd_memhdr *hdr;
+	size_t need;
+	int cls;
+
+	for (cls = 0; cls < FTPD_ARENA_CLASSES && ((size_t) 16 << cls) < size; cls++)
+		;
+	if (cls == FTPD_ARENA_CLASSES)
+		return NULL;
+	hdr = m->freelist[cls];
+	if (hdr) {
+		m->freelist[cls] = *(union ftpd_memhdr **) (hdr + 1);
+	} else {
+		need = sizeof(union ftpd_memhdr) + ((size_t) 16 << cls);
+		if (m->slabused + need > FTPD_SESSION_ARENA)
+			return NULL;
+		hdr = (union ftpd_memhdr *) (m->slab + m->slabused);
+		m->slabused += need;
+	}
+	hdr->h.cls = cls;
+	return hdr;
+}
+
+static void ftpd_arena_free(struct ftpd_mem *m, union ftpd_memhdr *hdr)
+{
+	*(union ftpd_memhdr **) (hdr + 1) = m->freelist[hdr->h.cls];
+	m->freelist[hdr->h.cls] = hdr;
+}
+#endif
+#else
+#define ftpd_mem_new(limit) NULL
+#define ftpd_mem_put(m)
+#endif
+
+/* The account VFS backends charge; set while serving a session. */
+struct ftpd_mem *ftpd_mem_owner;
+
+void *ftpd_alloc(struct ftpd_mem *ctx, size_t size)
+{
+#if FTPD_MEM_STATS
+	union ftpd_memhdr *hdr;
+
+	if (ftpd_mem_all.limit && ftpd_mem_all.current + size > ftpd_mem_all.limit)
+		return NULL;
+	if (ctx && ctx->limit && ctx->current + size > ctx->limit)
+		return NULL;
+#if FTPD_SESSION_ARENA
+	hdr = ctx ? ftpd_arena_alloc(ctx, size) : NULL;
+	if (!hdr) {
+		hdr = FTPD_MALLOC(ctx, sizeof(union ftpd_memhdr) + size);
+		if (!hdr)
+			return NULL;
+		hdr->h.cls = -1;
+	}
+#else
+	hdr = FTPD_MALLOC(ctx, sizeof(union ftpd_memhdr) + size);
+	if (!hdr)
+		return NULL;
+#endif
+	hdr->h.ctx = ctx;
+	hdr->h.size = size;
+	ftpd_mem_charge(&ftpd_mem_all, size);
+	if (ctx) {
+		ftpd_mem_charge(ctx, size);
+		(void) FTPD_MEM_ADD(ctx->refs, 1);
+	}
+	return hdr + 1;
+#else
+	return FTPD_MALLOC(ctx, size);
+#endif
+}
+
+void ftpd_free(struct ftpd_mem *ctx, void *ptr)
+{
+#if FTPD_MEM_STATS
+	union ftpd_memhdr *hdr;
+
+	if (!ptr)
+		return;
+	/* Charge back whoever paid, whatever the caller thinks. */
+	hdr = (union ftpd_memhdr *) ptr - 1;
+	ctx = hdr->h.ctx;
+	(void) FTPD_MEM_SUB(ftpd_mem_all.current, hdr->h.size);
+	if (ctx)
+		(void) FTPD_MEM_SUB(ctx->current, hdr->h.size);
+#if FTPD_SESSION_ARENA
+	if (hdr->h.cls >= 0)
+		ftpd_arena_free(ctx, hdr);
+	else
+#endif
+	FTPD_FREE(ctx, hdr);
+	ftpd_mem_put(ctx);
+#else
+	if (ptr)
+		FTPD_FREE(ctx, ptr);
+#endif
+}
+
+char *ftpd_strdup(struct ftpd_mem *ctx, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy = ftpd_alloc(ctx, len);
+
+	if (copy)
+		memcpy(copy, str, len);
+	return copy;
+}
+
+int ftpd_mem_usage(const struct ftpd_mem *ctx, struct ftpd_mem_usage *usage)
+{
+#if FTPD_MEM_STATS
+	if (!ctx)
+		ctx = &ftpd_mem_all;
+	usage->current = ctx->current;
+	usage->peak = ctx->peak;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
 /*
 ------------------------------------------------------------
 	SFIFO 1.3
@@ -243,7 +833,25 @@ static const char *month_table[12] = {
  *	A safe type should be used, and  sfifo should limit the
  *	maximum buffer size accordingly.
  */
+#if FTPD_SFIFO_ATOMIC
+/*
+ * Single producer, single consumer: each side only ever stores its own
+ * index. Stores are releases and loads of the other side's index are
+ * acquires, so the bytes published by one side are visible to the other
+ * before the index that covers them.
+ */
+#include <stdatomic.h>
+typedef atomic_int sfifo_atomic_t;
+#	define	SFIFO_LOAD_ACQUIRE(x)	atomic_load_explicit(&(x), memory_order_acquire)
+#	define	SFIFO_LOAD_RELAXED(x)	atomic_load_explicit(&(x), memory_order_relaxed)
+#	define	SFIFO_STORE_RELEASE(x, v)	atomic_store_explicit(&(x), (v), memory_order_release)
+#	define	SFIFO_CACHELINE		64
+#else
 typedef int sfifo_atomic_t;
+#	define	SFIFO_LOAD_ACQUIRE(x)	(x)
+#	define	SFIFO_LOAD_RELAXED(x)	(x)
+#	define	SFIFO_STORE_RELEASE(x, v)	((x) = (v))
+#endif
 #ifdef __TURBOC__
 #	define	SFIFO_MAX_BUFFER_SIZE	0x7fff
 #else /* Kludge: Assume 32 bit platform */
@@ -254,23 +862,76 @@ typedef struct sfifo_t
 {
 	char *buffer;
 	int size;			/* Number of bytes */
+	struct ftpd_mem *mem;		/* Account the buffer is charged to */
 	sfifo_atomic_t readpos;		/* Read position */
+#if FTPD_SFIFO_ATOMIC
+	/* Keep the indices on separate cache lines to avoid false sharing
+	   between the producer and the consumer. */
+	char pad1[SFIFO_CACHELINE - sizeof(sfifo_atomic_t)];
+#endif
 	sfifo_atomic_t writepos;	/* Write position */
+#if FTPD_SFIFO_ATOMIC
+	char pad2[SFIFO_CACHELINE - sizeof(sfifo_atomic_t)];
+#endif
 } sfifo_t;
 
 #define SFIFO_SIZEMASK(x)	((x)->size - 1)
 
-#define sfifo_used(x)	(((x)->writepos - (x)->readpos) & SFIFO_SIZEMASK(x))
+#define sfifo_used(x)	((SFIFO_LOAD_ACQUIRE((x)->writepos) - SFIFO_LOAD_ACQUIRE((x)->readpos)) & SFIFO_SIZEMASK(x))
 #define sfifo_space(x)	((x)->size - 1 - sfifo_used(x))
 
 #define DBG(x)
 
+#if FTPD_SFIFO_MIRROR
+/*
+ * Map a memfd twice into one reserved region. A write that runs past
+ * the end of the first mapping lands at the start of the buffer, so
+ * readers and writers never have to split at the wrap-around.
+ */
+static int sfifo_mirror_alloc(sfifo_t *f)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	char *base;
+	int fd;
+
+	/* Pages are a power of 2 as well, so this keeps the size mask valid. */
+	if(page > 0 && f->size < page)
+		f->size = page;
+
+	fd = memfd_create("sfifo", MFD_CLOEXEC);
+	if(fd < 0)
+		return -ENOMEM;
+	if(ftruncate(fd, f->size) != 0) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	base = mmap(NULL, 2 * (size_t)f->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED) {
+		close(fd);
+		return -ENOMEM;
+	}
+	if(mmap(base, f->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+	   || mmap(base + f->size, f->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(base, 2 * (size_t)f->size);
+		close(fd);
+		return -ENOMEM;
+	}
+
+	/* The mappings keep the memory alive. */
+	close(fd);
+	f->buffer = base;
+	return 0;
+}
+#endif
+
 /*
  * Alloc buffer, init FIFO etc...
  */
-static int sfifo_init(sfifo_t *f, int size)
+static int sfifo_init(sfifo_t *f, int size, struct ftpd_mem *mem)
 {
 	memset(f, 0, sizeof(sfifo_t));
+	f->mem = mem;
 
 	if(size > SFIFO_MAX_BUFFER_SIZE)
 		return -EINVAL;
@@ -290,8 +951,14 @@ static int sfifo_init(sfifo_t *f, int size)
 		;
 
 	/* Get buffer */
-	if( 0 == (f->buffer = (void *)malloc(f->size)) )
+#if FTPD_SFIFO_MIRROR
+	if(f->size > SFIFO_MAX_BUFFER_SIZE / 2)
+		return -EINVAL;
+	return sfifo_mirror_alloc(f);
+#else
+	if( 0 == (f->buffer = (void *)ftpd_alloc(f->mem, f->size)) )
 		return -ENOMEM;
+#endif
 
 	return 0;
 }
@@ -302,7 +969,11 @@ static int sfifo_init(sfifo_t *f, int size)
 static void sfifo_close(sfifo_t *f)
 {
 	if(f->buffer)
-		free(f->buffer);
+#if FTPD_SFIFO_MIRROR
+		munmap(f->buffer, 2 * (size_t)f->size);
+#else
+		ftpd_free(f->mem, f->buffer);
+#endif
 }
 
 /*
@@ -326,8 +997,8 @@ static int sfifo_write(sfifo_t *f, const void *_buf, int len)
 	else
 		total = len;
 
-	i = f->writepos;
-	if(i + len > f->size)
+	i = SFIFO_LOAD_RELAXED(f->writepos);
+	if(!FTPD_SFIFO_MIRROR && i + len > f->size)
 	{
 		memcpy(f->buffer + i, buf, f->size - i);
 		buf += f->size - i;
@@ -335,35 +1006,1562 @@ static int sfifo_write(sfifo_t *f, const void *_buf, int len)
 		i = 0;
 	}
 	memcpy(f->buffer + i, buf, len);
-	f->writepos = i + len;
+	SFIFO_STORE_RELEASE(f->writepos, (i + len) & SFIFO_SIZEMASK(f));
 
 	return total;
 }
 
-struct ftpd_datastate {
-	int connected;
-	vfs_dir_t *vfs_dir;
-	vfs_dirent_t *vfs_dirent;
-	vfs_file_t *vfs_file;
-	sfifo_t fifo;
-	struct tcp_pcb *msgpcb;
-	struct ftpd_msgstate *msgfs;
-};
-
+/*
+ * Get the longest run of queued bytes that can be read
+ * without wrapping around the end of the buffer.
+ * Return number of bytes available at *buf
+ */
+static int sfifo_peek_contiguous(sfifo_t *f, char **buf)
+{
+	int len;
+	int i;
+
+	*buf = f->buffer;
+	if(!f->buffer)
+		return 0;
+
+	len = sfifo_used(f);
+	i = SFIFO_LOAD_RELAXED(f->readpos);
+	if(!FTPD_SFIFO_MIRROR && len > f->size - i)
+		len = f->size - i;
+	*buf = f->buffer + i;
+
+	return len;
+}
+
+/*
+ * Drop bytes from the FIFO after they have been consumed
+ * from a span returned by sfifo_peek_contiguous()
+ */
+static void sfifo_commit_read(sfifo_t *f, int len)
+{
+	SFIFO_STORE_RELEASE(f->readpos, (SFIFO_LOAD_RELAXED(f->readpos) + len) & SFIFO_SIZEMASK(f));
+}
+
+/*
+ * Get the longest run of free space that can be filled
+ * without wrapping around the end of the buffer.
+ * Return number of bytes that may be written to *buf
+ */
+static int sfifo_reserve_write(sfifo_t *f, char **buf)
+{
+	int len;
+	int i;
+
+	*buf = f->buffer;
+	if(!f->buffer)
+		return 0;
+
+	len = sfifo_space(f);
+	i = SFIFO_LOAD_RELAXED(f->writepos);
+	if(!FTPD_SFIFO_MIRROR && len > f->size - i)
+		len = f->size - i;
+	*buf = f->buffer + i;
+
+	return len;
+}
+
+/*
+ * Publish bytes that have been written into a span
+ * returned by sfifo_reserve_write()
+ */
+static void sfifo_commit_write(sfifo_t *f, int len)
+{
+	SFIFO_STORE_RELEASE(f->writepos, (SFIFO_LOAD_RELAXED(f->writepos) + len) & SFIFO_SIZEMASK(f));
+}
+
+struct ftpd_datastate {
+	enum ftpd_state_e state;	/* transfer, or FTPD_IDLE until one claims it */
+	int connected;
+	struct tcp_pcb *pcb;
+	struct tcp_pcb *listenpcb;	/* PASV listener, until it has accepted */
+	struct ftpd_datastate *next;	/* next data connection of the session */
+	vfs_dir_t *vfs_dir;
+	vfs_dirent_t *vfs_dirent;
+	vfs_file_t *vfs_file;
+	int chunk;		/* bytes per vfs_read, from vfs_io_hints */
+	int align;		/* file offsets of reads are multiples of this */
+	size_t readpos;		/* file offset of the next vfs_read */
+	size_t readend;		/* end of the range to send, or 0 for EOF */
+	struct ftpd_pipe *pipe;	/* stages the data goes through, or NULL */
+#ifdef FTPD_SEND_BYREF
+	const char *map;	/* mapped or cached file, passed to TCP by reference */
+	size_t maplen;
+	size_t mappos;		/* bytes handed to TCP so far */
+	size_t mapend;		/* where sending stops */
+	size_t unacked;		/* bytes TCP may still reference */
+#endif
+	sfifo_t fifo;
+#if FTPD_WRITEBACK
+	struct ftpd_wbfile *wb;
+#endif
+#if FTPD_FILE_CACHE
+	struct ftpd_fcfile *fc;	/* cache entry that vfs_file belongs to */
+#endif
+#if FTPD_CONTENT_CACHE
+	struct ftpd_ccfile *cc;	/* cache entry that map belongs to */
+#endif
+#if FTPD_SHARED_READ
+	struct ftpd_sreader *sr;	/* reader that this download is attached to */
+	struct ftpd_datastate *srnext;	/* next download attached to sr */
+	size_t srpos;		/* bytes handed to TCP so far */
+#endif
+#if FTPD_URING
+	struct ftpd_aio *aio;	/* storage requests in flight */
+	struct ftpd_lsbatch *ls;	/* LIST entries being stat'ed */
+	size_t writepos;	/* file offset of the next STOR write */
+	int stordone;		/* STOR has all data, the writes are in flight */
+#endif
+#if FTPD_ZEROCOPY
+	int zc;			/* 0 undecided, -1 buffered, 1 zero-copy, 2 file queued */
+#endif
+	struct tcp_pcb *msgpcb;
+	struct ftpd_msgstate *msgfs;
+};
+
 struct ftpd_msgstate {
 	enum ftpd_state_e state;
 	sfifo_t fifo;
 	vfs_t *vfs;
 	struct ip4_addr dataip;
 	u16_t dataport;
-	struct tcp_pcb *datalistenpcb;
-	struct tcp_pcb *datapcb;
-	struct ftpd_datastate *datafs;
+	struct ftpd_datastate *data;	/* all data connections */
+	struct ftpd_datastate *datafs;	/* the one the next transfer uses */
 	int passive;
+	size_t restart;		/* from REST or RANG, for the next transfer */
+	size_t rangeend;	/* from RANG, 0 for none */
+	int ascii;		/* TYPE A rather than I */
 	char *renamefrom;
+	struct ftpd_mem *mem;
+#if FTPD_MSG_NODELAY
+	int batching;
+#endif
+#if FTPD_HASH_THREADS
+	struct ftpd_hash *hash;	/* checksum being computed */
+#endif
+#if FTPD_LATENCY
+	int latverb;		/* command being timed, or -1 */
+	int latnested;		/* replies belong to a command that isn't timed */
+	u32_t latstart;
+	u32_t latvfs;
+	u32_t latwait;
+	u32_t latidle;		/* when the last callback for it returned */
+	u32_t latvfsstart;
+#endif
+#if FTPD_TRACE
+	u16_t traceid;
+#endif
+};
+
+#if FTPD_TRACE || FTPD_LATENCY || FTPD_MEM_STATS
+enum ftpd_vfsop_e {
+	FTPD_VOP_OPENFS,
+	FTPD_VOP_CLOSEFS,
+	FTPD_VOP_OPEN,
+	FTPD_VOP_CLOSE,
+	FTPD_VOP_READ,
+	FTPD_VOP_WRITE,
+	FTPD_VOP_EOF,
+	FTPD_VOP_REWIND,
+	FTPD_VOP_SEEK,
+	FTPD_VOP_STAT,
+	FTPD_VOP_OPENDIR,
+	FTPD_VOP_READDIR,
+	FTPD_VOP_CLOSEDIR,
+	FTPD_VOP_CHDIR,
+	FTPD_VOP_GETCWD,
+	FTPD_VOP_RENAME,
+	FTPD_VOP_MKDIR,
+	FTPD_VOP_RMDIR,
+	FTPD_VOP_REMOVE,
+	FTPD_VOP_IO_HINTS,
+	FTPD_VOP_MAP,
+	FTPD_VOP_UNMAP
+};
+#endif
+
+#if FTPD_TRACE
+enum ftpd_event_e {
+	FTPD_EV_ACCEPT,		/* control connection accepted */
+	FTPD_EV_CLOSE,		/* control connection closed, a = error */
+	FTPD_EV_STATE,		/* a = old state, b = new state */
+	FTPD_EV_DATA_CONNECT,	/* active data connection established */
+	FTPD_EV_DATA_ACCEPT,	/* passive data connection accepted */
+	FTPD_EV_DATA_CLOSE,
+	FTPD_EV_FIFO_FULL,	/* a = bytes queued */
+	FTPD_EV_FIFO_EMPTY,
+	FTPD_EV_WRITE_ERR,	/* a = err, b = length */
+	FTPD_EV_VFS_BEGIN,	/* a = operation */
+	FTPD_EV_VFS_END		/* a = operation, b = result */
+};
+
+struct ftpd_trace_event {
+	u32_t ts;
+	u16_t session;
+	u8_t event;
+	u32_t a;
+	u32_t b;
+};
+
+/*
+ * Any thread may record: a slot is claimed by incrementing the head.
+ * Slots that are being written while the ring is dumped can come out
+ * torn, so dump once things have gone quiet.
+ */
+static struct ftpd_trace_event ftpd_trace_ring[FTPD_TRACE];
+#if FTPD_SFIFO_ATOMIC
+static atomic_uint ftpd_trace_head;
+#define FTPD_TRACE_CLAIM() atomic_fetch_add_explicit(&ftpd_trace_head, 1, memory_order_relaxed)
+#else
+static unsigned int ftpd_trace_head;
+#define FTPD_TRACE_CLAIM() (ftpd_trace_head++)
+#endif
+static u16_t ftpd_trace_sessions;
+
+static void ftpd_trace(struct ftpd_msgstate *fsm, int event, u32_t a, u32_t b)
+{
+	struct ftpd_trace_event *ev = &ftpd_trace_ring[FTPD_TRACE_CLAIM() & (FTPD_TRACE - 1)];
+
+	ev->ts = FTPD_TRACE_CLOCK();
+	ev->session = fsm ? fsm->traceid : 0;
+	ev->event = event;
+	ev->a = a;
+	ev->b = b;
+}
+
+#define FTPD_TRACE_EVENT(fsm, event, a, b) ftpd_trace(fsm, event, (u32_t) (a), (u32_t) (b))
+#else
+#define FTPD_TRACE_EVENT(fsm, event, a, b) do { (void) (fsm); } while (0)
+#endif
+
+#if FTPD_TRACE || FTPD_LATENCY || FTPD_MEM_STATS
+/*
+ * FTPD_VFS() wraps a VFS call that returns an integer, FTPD_VFSP() one
+ * that returns a pointer and FTPD_VFSV() one whose result is unused. The
+ * session may be NULL for calls that don't belong to one.
+ */
+static void ftpd_vfs_begin(struct ftpd_msgstate *fsm, int op)
+{
+	/* Only the tcpip thread passes a session. */
+	if (fsm)
+		ftpd_mem_owner = fsm->mem;
+#if FTPD_LATENCY
+	if (fsm)
+		fsm->latvfsstart = FTPD_LAT_CLOCK();
+#endif
+	FTPD_TRACE_EVENT(fsm, FTPD_EV_VFS_BEGIN, op, 0);
+}
+
+static int ftpd_vfs_end(struct ftpd_msgstate *fsm, int op, int ret)
+{
+	if (fsm)
+		ftpd_mem_owner = NULL;
+#if FTPD_LATENCY
+	if (fsm)
+		fsm->latvfs += FTPD_LAT_CLOCK() - fsm->latvfsstart;
+#endif
+	FTPD_TRACE_EVENT(fsm, FTPD_EV_VFS_END, op, ret);
+	return ret;
+}
+
+static void *ftpd_vfs_endp(struct ftpd_msgstate *fsm, int op, const void *ret)
+{
+	ftpd_vfs_end(fsm, op, ret != NULL);
+	return (void *) ret;
+}
+
+#define FTPD_VFS(fsm, op, call) ftpd_vfs_end(fsm, op, (ftpd_vfs_begin(fsm, op), (int) (call)))
+#define FTPD_VFSP(fsm, op, call) ftpd_vfs_endp(fsm, op, (ftpd_vfs_begin(fsm, op), (call)))
+/* For handles that are shared with other sessions, charge them to no one */
+#define FTPD_VFSP_SHARED(fsm, op, call) \
+	ftpd_vfs_endp(fsm, op, (ftpd_vfs_begin(fsm, op), ftpd_mem_owner = NULL, (call)))
+#define FTPD_VFSV(fsm, op, call) do { \
+		ftpd_vfs_begin(fsm, op); \
+		call; \
+		ftpd_vfs_end(fsm, op, 0); \
+	} while (0)
+#else
+#define FTPD_VFS(fsm, op, call) (call)
+#define FTPD_VFSP(fsm, op, call) (call)
+#define FTPD_VFSP_SHARED(fsm, op, call) (call)
+#define FTPD_VFSV(fsm, op, call) do { call; } while (0)
+#endif
+
+static void ftpd_set_state(struct ftpd_msgstate *fsm, enum ftpd_state_e state)
+{
+	FTPD_TRACE_EVENT(fsm, FTPD_EV_STATE, fsm->state, state);
+	fsm->state = state;
+}
+
+#if FTPD_LATENCY
+/*
+ * A timed command counts time spent in VFS calls as VFS time, and the
+ * gaps between the callbacks that carry a transfer as waiting, mostly
+ * for the network.
+ */
+static void ftpd_lat_resume(struct ftpd_msgstate *fsm)
+{
+	if (fsm->latverb >= 0)
+		fsm->latwait += FTPD_LAT_CLOCK() - fsm->latidle;
+}
+
+static void ftpd_lat_yield(struct ftpd_msgstate *fsm)
+{
+	fsm->latidle = FTPD_LAT_CLOCK();
+}
+#else
+#define ftpd_lat_resume(fsm) ((void) (fsm))
+#define ftpd_lat_yield(fsm) ((void) (fsm))
+#endif
+
+static void send_msg(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm, char *msg, ...);
+#if FTPD_LATENCY || FTPD_MEM_STATS
+static void cmd_site(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm);
+#endif
+
+#if FTPD_WRITEBACK
+/*
+ * Uploads in the write-back cache. Each one is a FIFO that is filled by
+ * ftpd_datarecv() and drained to storage by ftpd_wb_flush(), possibly
+ * from another thread. Only the tcpip thread claims and releases slots;
+ * the flusher only touches slots that are WB_ACTIVE or WB_CLOSING.
+ * With a separate flusher, the tcpip thread also closes the files.
+ */
+enum ftpd_wbstate_e {
+	WB_FREE,
+	WB_ACTIVE,	/* receiving */
+	WB_CLOSING,	/* all data received, flush and close */
+	WB_DONE		/* drained, waiting to be released */
+};
+
+struct ftpd_wbfile {
+	sfifo_atomic_t state;
+	sfifo_t fifo;
+	int block;		/* storage write unit, a power of 2 */
+	vfs_file_t *vfs_file;
+	int error;
+	/* Received data that didn't fit into the FIFO yet, tcpip thread only.
+	   It is acknowledged to TCP once it has been moved over, so what is
+	   left of it is bounded by TCP_WND. The chain as a whole is not: the
+	   head still counts the part already moved, and its tot_len can wrap,
+	   which is why the rest is counted in pending_len. */
+	struct pbuf *pending;
+	u32_t pending_off;
+	u32_t pending_len;
+	struct tcp_pcb *datapcb;
+	int eof;
+	/* Where to send 226 when done, if anywhere */
+	struct ftpd_msgstate *fsm;
+	struct tcp_pcb *msgpcb;
+};
+
+static struct ftpd_wbfile ftpd_wbfiles[FTPD_WB_MAX_FILES];
+
+#if !FTPD_WB_FLUSH_INLINE
+/* A wakeup of the tcpip thread has been posted and not yet run. */
+static sfifo_atomic_t ftpd_wb_waking;
+#if FTPD_EPOLL
+static int ftpd_wb_eventfd = -1;
+#endif
+
+static void ftpd_wb_wake(void);
+#endif
+
+static int ftpd_wb_dirty(void)
+{
+	int i;
+	int dirty = 0;
+
+	for (i = 0; i < FTPD_WB_MAX_FILES; i++) {
+		int state = SFIFO_LOAD_ACQUIRE(ftpd_wbfiles[i].state);
+		if (state == WB_ACTIVE || state == WB_CLOSING)
+			dirty += sfifo_used(&ftpd_wbfiles[i].fifo);
+	}
+	return dirty;
+}
+
+static struct ftpd_wbfile *ftpd_wb_open(vfs_file_t *vfs_file, const vfs_io_hints_t *hints)
+{
+	int i;
+	int block = FTPD_WB_BLOCK_SIZE;
+
+	/* Use the backend's preferred size if it is a larger power of 2
+	   that leaves room for at least two blocks in the FIFO, and for a
+	   whole block per upload under the dirty limit. */
+	while ((size_t) block * 2 <= hints->optimal_size && block * 2 <= FTPD_WB_FIFO_SIZE / 2
+	       && block * 2 <= FTPD_WB_DIRTY_LIMIT / FTPD_WB_MAX_FILES)
+		block *= 2;
+
+	for (i = 0; i < FTPD_WB_MAX_FILES; i++) {
+		struct ftpd_wbfile *wb = &ftpd_wbfiles[i];
+
+		if (SFIFO_LOAD_ACQUIRE(wb->state) != WB_FREE)
+			continue;
+		/* sfifo_init() rounds up to hold one byte more than asked for. */
+		if (sfifo_init(&wb->fifo, FTPD_WB_FIFO_SIZE - 1, NULL) != 0)
+			return NULL;
+		wb->vfs_file = vfs_file;
+		wb->block = block;
+		wb->error = 0;
+		wb->pending = NULL;
+		wb->pending_off = 0;
+		wb->pending_len = 0;
+		wb->datapcb = NULL;
+		wb->eof = 0;
+		wb->fsm = NULL;
+		wb->msgpcb = NULL;
+		SFIFO_STORE_RELEASE(wb->state, WB_ACTIVE);
+		return wb;
+	}
+	return NULL;
+}
+
+/*
+ * Write cached data to storage: up to FTPD_WB_FLUSH_MAX bytes for each
+ * upload, in whole blocks unless the upload is complete. Uploads that
+ * have been drained are closed here, or by the tcpip thread with a
+ * separate flusher.
+ * Return nonzero if anything was done.
+ */
+int ftpd_wb_flush(void)
+{
+	int i;
+	int progress = 0;
+
+	for (i = 0; i < FTPD_WB_MAX_FILES; i++) {
+		struct ftpd_wbfile *wb = &ftpd_wbfiles[i];
+		int state = SFIFO_LOAD_ACQUIRE(wb->state);
+		char *buf;
+		int len;
+		int max;
+
+		if (state != WB_ACTIVE && state != WB_CLOSING)
+			continue;
+
+		max = FTPD_WB_FLUSH_MAX > wb->block ? FTPD_WB_FLUSH_MAX : wb->block;
+		len = sfifo_peek_contiguous(&wb->fifo, &buf);
+		if (len > max)
+			len = max;
+		/* The FIFO size is a multiple of the block size, so whole blocks
+		   never straddle the wrap-around and every write stays aligned. */
+		if (state == WB_ACTIVE || len == max)
+			len &= ~(wb->block - 1);
+
+		if (len > 0) {
+			if (!wb->error && FTPD_VFS(NULL, FTPD_VOP_WRITE, vfs_write(buf, 1, len, wb->vfs_file)) != len) {
+				ftpd_loge("ftpd_wb_flush: error writing!");
+				wb->error = 1;
+			}
+			sfifo_commit_read(&wb->fifo, len);
+			progress = 1;
+		} else if (state == WB_CLOSING && sfifo_used(&wb->fifo) == 0) {
+#if FTPD_WB_FLUSH_INLINE
+			FTPD_VFSV(NULL, FTPD_VOP_CLOSE, vfs_close_file(wb->vfs_file));
+			wb->vfs_file = NULL;
+#endif
+			SFIFO_STORE_RELEASE(wb->state, WB_DONE);
+			progress = 1;
+		}
+	}
+#if !FTPD_WB_FLUSH_INLINE
+	if (progress)
+		ftpd_wb_wake();
+#endif
+	return progress;
+}
+
+/*
+ * Release uploads that the flusher has finished, closing their files if
+ * it hasn't, and send the replies that were held back for them. Runs in
+ * the tcpip thread.
+ */
+static void ftpd_wb_reap(void)
+{
+	int i;
+
+	for (i = 0; i < FTPD_WB_MAX_FILES; i++) {
+		struct ftpd_wbfile *wb = &ftpd_wbfiles[i];
+
+		if (SFIFO_LOAD_ACQUIRE(wb->state) != WB_DONE)
+			continue;
+		if (wb->vfs_file) {
+			FTPD_VFSV(NULL, FTPD_VOP_CLOSE, vfs_close_file(wb->vfs_file));
+			wb->vfs_file = NULL;
+		}
+		if (wb->fsm)
+			send_msg(wb->msgpcb, wb->fsm, wb->error ? msg451 : msg226);
+		sfifo_close(&wb->fifo);
+		SFIFO_STORE_RELEASE(wb->state, WB_FREE);
+	}
+}
+
+/*
+ * Move pending data into the FIFO as far as its space and the dirty limit
+ * allow, and open the TCP window by as much. Once all data has been
+ * received and moved, hand the upload over to the flusher for closing.
+ */
+static void ftpd_wb_fill(struct ftpd_wbfile *wb)
+{
+	while (wb->pending) {
+		struct pbuf *q;
+		char *buf;
+		int len = sfifo_reserve_write(&wb->fifo, &buf);
+		int room = FTPD_WB_DIRTY_LIMIT - ftpd_wb_dirty();
+
+		if (len > room)
+			len = room;
+		if ((u32_t) len > wb->pending_len)
+			len = (int) wb->pending_len;
+		if (len <= 0)
+			break;
+
+		pbuf_copy_partial(wb->pending, buf, (u16_t) len, (u16_t) wb->pending_off);
+		sfifo_commit_write(&wb->fifo, len);
+		wb->pending_off += len;
+		wb->pending_len -= len;
+		if (wb->datapcb)
+			tcp_recved(wb->datapcb, (u16_t) len);
+
+		/* Drop the pbufs that have been copied completely. */
+		while (wb->pending && wb->pending_off >= wb->pending->len) {
+			q = wb->pending;
+			wb->pending = q->next;
+			wb->pending_off -= q->len;
+			q->next = NULL;
+			q->tot_len = q->len;
+			pbuf_free(q);
+		}
+	}
+
+	if (wb->eof && wb->pending == NULL && SFIFO_LOAD_RELAXED(wb->state) == WB_ACTIVE)
+		SFIFO_STORE_RELEASE(wb->state, WB_CLOSING);
+}
+
+static void ftpd_wb_fill_all(void)
+{
+	int i;
+
+	for (i = 0; i < FTPD_WB_MAX_FILES; i++) {
+		if (SFIFO_LOAD_RELAXED(ftpd_wbfiles[i].state) == WB_ACTIVE)
+			ftpd_wb_fill(&ftpd_wbfiles[i]);
+	}
+}
+
+#if !FTPD_WB_FLUSH_INLINE
+/*
+ * The flusher has made room or finished uploads: move held-back data into
+ * the cache, which opens the TCP windows again, and send the replies. Runs
+ * in the tcpip thread. The flag is cleared first, so that whatever the
+ * flusher does from here on wakes it again.
+ */
+static void ftpd_wb_woken(void *arg)
+{
+	atomic_store_explicit(&ftpd_wb_waking, 0, memory_order_release);
+	ftpd_wb_fill_all();
+	ftpd_wb_reap();
+}
+
+#if FTPD_EPOLL
+static void ftpd_wb_ready(void *arg)
+{
+	u64_t count;
+
+	if (read(ftpd_wb_eventfd, &count, sizeof(count)) < 0)
+		return;
+	ftpd_wb_woken(NULL);
+}
+#endif
+
+/*
+ * Have the tcpip thread run ftpd_wb_woken() soon; called by the flusher.
+ * If that can't be arranged, the next poll does the same, only later.
+ */
+static void ftpd_wb_wake(void)
+{
+	if (atomic_exchange_explicit(&ftpd_wb_waking, 1, memory_order_acq_rel))
+		return;
+#if FTPD_EPOLL
+	{
+		u64_t one = 1;
+
+		if (ftpd_wb_eventfd >= 0 && write(ftpd_wb_eventfd, &one, sizeof(one)) == sizeof(one))
+			return;
+	}
+#else
+	if (tcpip_try_callback(ftpd_wb_woken, NULL) == ERR_OK)
+		return;
+#endif
+	atomic_store_explicit(&ftpd_wb_waking, 0, memory_order_release);
+}
+#endif
+
+/*
+ * Take a received chain. It is always accepted, so that lwIP never has to
+ * hold on to refused data, but only acknowledged as it enters the cache.
+ */
+static void ftpd_wb_queue(struct ftpd_wbfile *wb, struct tcp_pcb *pcb, struct pbuf *p)
+{
+	wb->datapcb = pcb;
+	wb->pending_len += p->tot_len;
+	if (wb->pending)
+		pbuf_cat(wb->pending, p);
+	else
+		wb->pending = p;
+	ftpd_wb_fill(wb);
+}
+
+/*
+ * No more data will arrive for this upload. If fsm is not NULL, it gets
+ * the final reply once the upload has been written.
+ */
+static void ftpd_wb_close(struct ftpd_wbfile *wb, struct ftpd_msgstate *fsm, struct tcp_pcb *msgpcb)
+{
+	wb->fsm = fsm;
+	wb->msgpcb = msgpcb;
+	/* The data connection is closing, nothing left to acknowledge. */
+	wb->datapcb = NULL;
+	wb->eof = 1;
+	ftpd_wb_fill(wb);
+#if FTPD_WB_FLUSH_INLINE
+	if (fsm) {
+		do {
+			ftpd_wb_fill_all();
+		} while (ftpd_wb_flush());
+		ftpd_wb_reap();
+	}
+#endif
+}
+
+/* The control connection is going away; don't reply on it. */
+static void ftpd_wb_forget(struct ftpd_msgstate *fsm)
+{
+	int i;
+
+	for (i = 0; i < FTPD_WB_MAX_FILES; i++) {
+		if (ftpd_wbfiles[i].fsm == fsm)
+			ftpd_wbfiles[i].fsm = NULL;
+	}
+}
+#endif
+
+#if FTPD_FILE_CACHE || FTPD_CONTENT_CACHE || FTPD_SHARED_READ
+/*
+ * Absolute form of a path with "." and ".." resolved, so that different
+ * spellings of the same path find the same entries. Returns NULL, or
+ * memory that the caller frees with ftpd_free(fsm->mem, ...).
+ */
+static char *ftpd_abspath(struct ftpd_msgstate *fsm, const char *arg)
+{
+	char *cwd = NULL;
+	const char *base = "";
+	char *path;
+	char *in;
+	char *out;
+
+	if (*arg != '/') {
+		cwd = FTPD_VFSP(fsm, FTPD_VOP_GETCWD, vfs_getcwd(fsm->vfs, NULL, 0));
+		if (!cwd)
+			return NULL;
+		/* Drop a drive prefix like "0:". */
+		base = strchr(cwd, ':') ? strchr(cwd, ':') + 1 : cwd;
+	}
+	path = ftpd_alloc(fsm->mem, strlen(base) + strlen(arg) + 3);
+	if (path) {
+		sprintf(path, "/%s/%s", base, arg);
+		in = out = path;
+		while (*in) {
+			char *end;
+			size_t len;
+
+			while (*in == '/')
+				in++;
+			end = strchr(in, '/');
+			len = end ? (size_t) (end - in) : strlen(in);
+			if (len == 2 && in[0] == '.' && in[1] == '.') {
+				while (out > path && *--out != '/')
+					;
+			} else if (len > 0 && !(len == 1 && in[0] == '.')) {
+				*out++ = '/';
+				memmove(out, in, len);
+				out += len;
+			}
+			in += len;
+		}
+		if (out == path)
+			*out++ = '/';
+		*out = '\0';
+	}
+	ftpd_free(fsm->mem, cwd);
+	return path;
+}
+
+/* Whether path is prefix or below it. NULL and "/" cover everything. */
+static int ftpd_path_within(const char *path, const char *prefix)
+{
+	size_t len = prefix ? strlen(prefix) : 0;
+
+	if (len <= 1)
+		return 1;
+	return strncmp(path, prefix, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+static int ftpd_stat_unchanged(const vfs_stat_t *a, const vfs_stat_t *b)
+{
+	return a->st_size == b->st_size
+		&& memcmp(&a->st_mtime, &b->st_mtime, sizeof(a->st_mtime)) == 0;
+}
+#endif
+
+#if FTPD_FILE_CACHE
+/*
+ * Files kept open after RETR, so that downloading the same file again
+ * doesn't have to look it up and open it. An entry serves one transfer at
+ * a time and only while the file has the size and modification time it
+ * was opened with. Commands that change a path drop its entries.
+ */
+struct ftpd_fcfile {
+	char *path;		/* absolute; NULL if the slot is free */
+	vfs_file_t *vfs_file;
+	vfs_stat_t st;
+	u32_t used;		/* ftpd_fc_clock when last handed out */
+	int busy;
+	int stale;		/* drop once the transfer is done */
+};
+
+static struct ftpd_fcfile ftpd_fcfiles[FTPD_FILE_CACHE];
+static u32_t ftpd_fc_clock;
+
+static void ftpd_fc_drop(struct ftpd_fcfile *fc)
+{
+	FTPD_VFSV(NULL, FTPD_VOP_CLOSE, vfs_close_file(fc->vfs_file));
+	fc->vfs_file = NULL;
+	ftpd_free(NULL, fc->path);
+	fc->path = NULL;
+}
+
+/* Find an idle entry for path that is still valid, rewound and ready. */
+static struct ftpd_fcfile *ftpd_fc_get(const char *path, const vfs_stat_t *st)
+{
+	int i;
+
+	for (i = 0; i < FTPD_FILE_CACHE; i++) {
+		struct ftpd_fcfile *fc = &ftpd_fcfiles[i];
+
+		if (!fc->path || fc->busy || strcmp(fc->path, path) != 0)
+			continue;
+		if (!ftpd_stat_unchanged(&fc->st, st) || FTPD_VFS(NULL, FTPD_VOP_REWIND, vfs_rewind(fc->vfs_file)) != 0) {
+			ftpd_fc_drop(fc);
+			continue;
+		}
+		fc->busy = 1;
+		fc->used = ++ftpd_fc_clock;
+		return fc;
+	}
+	return NULL;
+}
+
+/*
+ * Add a freshly opened file, replacing the least recently used idle entry
+ * if necessary. Returns NULL if all entries are busy; the file is then
+ * used uncached.
+ */
+static struct ftpd_fcfile *ftpd_fc_put(const char *path, vfs_file_t *vfs_file, const vfs_stat_t *st)
+{
+	struct ftpd_fcfile *fc = NULL;
+	char *copy;
+	int i;
+
+	for (i = 0; i < FTPD_FILE_CACHE; i++) {
+		struct ftpd_fcfile *e = &ftpd_fcfiles[i];
+
+		if (!e->path) {
+			fc = e;
+			break;
+		}
+		if (!e->busy && (!fc || (s32_t) (e->used - fc->used) < 0))
+			fc = e;
+	}
+	if (!fc)
+		return NULL;
+	copy = ftpd_alloc(NULL, strlen(path) + 1);
+	if (!copy)
+		return NULL;
+	strcpy(copy, path);
+	if (fc->path)
+		ftpd_fc_drop(fc);
+	fc->path = copy;
+	fc->vfs_file = vfs_file;
+	fc->st = *st;
+	fc->busy = 1;
+	fc->stale = 0;
+	fc->used = ++ftpd_fc_clock;
+	return fc;
+}
+
+static void ftpd_fc_release(struct ftpd_fcfile *fc)
+{
+	fc->busy = 0;
+	if (fc->stale) {
+		fc->stale = 0;
+		ftpd_fc_drop(fc);
+	}
+}
+
+void ftpd_fc_invalidate(const char *path)
+{
+	int i;
+
+	for (i = 0; i < FTPD_FILE_CACHE; i++) {
+		struct ftpd_fcfile *fc = &ftpd_fcfiles[i];
+
+		if (!fc->path || !ftpd_path_within(fc->path, path))
+			continue;
+		if (fc->busy)
+			fc->stale = 1;
+		else
+			ftpd_fc_drop(fc);
+	}
+}
+
+#endif
+
+#if FTPD_CONTENT_CACHE
+/*
+ * Contents of small files that have been downloaded, kept in RAM and sent
+ * by reference. Entries are checked against size and modification time
+ * before use. The least recently used ones that aren't being sent make
+ * room for new ones.
+ */
+struct ftpd_ccfile {
+	struct ftpd_ccfile *next;
+	char *path;		/* absolute */
+	char *data;
+	size_t size;
+	vfs_stat_t st;
+	u32_t used;		/* ftpd_cc_clock when last handed out */
+	int refs;		/* transfers sending from data */
+	int stale;		/* drop once refs is 0 */
+};
+
+static struct ftpd_ccfile *ftpd_ccfiles;
+static size_t ftpd_cc_bytes;
+static u32_t ftpd_cc_clock;
+
+static size_t ftpd_cc_cost(size_t pathlen, size_t size)
+{
+	return sizeof(struct ftpd_ccfile) + pathlen + 1 + size;
+}
+
+static void ftpd_cc_drop(struct ftpd_ccfile *cc)
+{
+	struct ftpd_ccfile **p = &ftpd_ccfiles;
+
+	while (*p != cc)
+		p = &(*p)->next;
+	*p = cc->next;
+	ftpd_cc_bytes -= ftpd_cc_cost(strlen(cc->path), cc->size);
+	FTPD_CC_FREE(cc->data);
+	ftpd_free(NULL, cc->path);
+	ftpd_free(NULL, cc);
+}
+
+/* Drop idle entries, least recently used first, until size more bytes fit. */
+static int ftpd_cc_reserve(size_t size)
+{
+	while (ftpd_cc_bytes + size > FTPD_CONTENT_CACHE) {
+		struct ftpd_ccfile *cc;
+		struct ftpd_ccfile *lru = NULL;
+
+		for (cc = ftpd_ccfiles; cc; cc = cc->next) {
+			if (cc->refs == 0 && (!lru || (s32_t) (cc->used - lru->used) < 0))
+				lru = cc;
+		}
+		if (!lru)
+			return 1;
+		ftpd_cc_drop(lru);
+	}
+	return 0;
+}
+
+/* Find a valid entry for path and take a reference to it. */
+static struct ftpd_ccfile *ftpd_cc_get(const char *path, const vfs_stat_t *st)
+{
+	struct ftpd_ccfile *cc;
+
+	for (cc = ftpd_ccfiles; cc; cc = cc->next) {
+		if (cc->stale || strcmp(cc->path, path) != 0)
+			continue;
+		if (!ftpd_stat_unchanged(&cc->st, st)) {
+			if (cc->refs)
+				cc->stale = 1;
+			else
+				ftpd_cc_drop(cc);
+			return NULL;
+		}
+		cc->refs++;
+		cc->used = ++ftpd_cc_clock;
+		return cc;
+	}
+	return NULL;
+}
+
+/*
+ * Read a small file that was just opened into a new entry and take a
+ * reference to it. Returns NULL if the file isn't cached; it is then
+ * rewound for reading as usual.
+ */
+static struct ftpd_ccfile *ftpd_cc_fill(const char *path, vfs_file_t *vfs_file, const vfs_stat_t *st)
+{
+	struct ftpd_ccfile *cc;
+	size_t pathlen = strlen(path);
+	size_t size = st->st_size;
+	size_t got = 0;
+	char extra;
+
+	if (st->st_size <= 0 || st->st_size > FTPD_CONTENT_CACHE_MAX_FILE)
+		return NULL;
+	if (ftpd_cc_reserve(ftpd_cc_cost(pathlen, size)) != 0)
+		return NULL;
+	cc = ftpd_alloc(NULL, sizeof(struct ftpd_ccfile));
+	if (!cc)
+		return NULL;
+	cc->path = ftpd_alloc(NULL, pathlen + 1);
+	cc->data = FTPD_CC_MALLOC(size);
+	if (!cc->path || !cc->data)
+		goto fail;
+
+	while (got < size) {
+		int len = FTPD_VFS(NULL, FTPD_VOP_READ, vfs_read(cc->data + got, 1, size - got, vfs_file));
+
+		if (len <= 0)
+			break;
+		got += len;
+	}
+	/* The file changed since it was looked at. */
+	if (got != size || FTPD_VFS(NULL, FTPD_VOP_READ, vfs_read(&extra, 1, 1, vfs_file)) != 0) {
+		FTPD_VFSV(NULL, FTPD_VOP_REWIND, vfs_rewind(vfs_file));
+		goto fail;
+	}
+
+	strcpy(cc->path, path);
+	cc->size = size;
+	cc->st = *st;
+	cc->used = ++ftpd_cc_clock;
+	cc->refs = 1;
+	cc->stale = 0;
+	cc->next = ftpd_ccfiles;
+	ftpd_ccfiles = cc;
+	ftpd_cc_bytes += ftpd_cc_cost(pathlen, size);
+	return cc;
+
+fail:
+	if (cc->data)
+		FTPD_CC_FREE(cc->data);
+	ftpd_free(NULL, cc->path);
+	ftpd_free(NULL, cc);
+	return NULL;
+}
+
+static void ftpd_cc_release(struct ftpd_ccfile *cc)
+{
+	if (--cc->refs == 0 && cc->stale)
+		ftpd_cc_drop(cc);
+}
+
+void ftpd_cc_invalidate(const char *path)
+{
+	struct ftpd_ccfile *cc = ftpd_ccfiles;
+
+	while (cc) {
+		struct ftpd_ccfile *next = cc->next;
+
+		if (ftpd_path_within(cc->path, path)) {
+			if (cc->refs)
+				cc->stale = 1;
+			else
+				ftpd_cc_drop(cc);
+		}
+		cc = next;
+	}
+}
+#endif
+
+#if FTPD_SHARED_READ
+/*
+ * Downloads of the same file at the same time share one reader. Each block
+ * is read once into a ring that the data connections send from by
+ * reference, each at its own pace. Ring space is only reused once every
+ * connection has had the data in it acknowledged, so the fastest one can
+ * be at most FTPD_SHARED_READ bytes ahead of the slowest. A download can
+ * join as long as the ring still holds the start of the file.
+ */
+struct ftpd_sreader {
+	struct ftpd_sreader *next;
+	char *path;		/* absolute */
+	vfs_stat_t st;
+	vfs_file_t *vfs_file;	/* NULL once the whole file has been read */
+	char *ring;
+	size_t filled;		/* bytes read so far */
+	int kicking;
+	struct ftpd_datastate *clients;
+};
+
+static struct ftpd_sreader *ftpd_sreaders;
+static int ftpd_sr_count;
+
+/*
+ * Find a reader that a new download of path can join, or start one.
+ * Returns NULL if the file should be read as usual.
+ */
+static struct ftpd_sreader *ftpd_sr_open(struct ftpd_msgstate *fsm, const char *arg, const char *path,
+					 const vfs_stat_t *st)
+{
+	struct ftpd_sreader *sr;
+
+#if FTPD_CONTENT_CACHE
+	/* Small files are better off in the content cache. */
+	if (st->st_size <= FTPD_CONTENT_CACHE_MAX_FILE)
+		return NULL;
+#endif
+	for (sr = ftpd_sreaders; sr; sr = sr->next) {
+		if (strcmp(sr->path, path) == 0 && sr->filled <= FTPD_SHARED_READ
+		    && ftpd_stat_unchanged(&sr->st, st))
+			return sr;
+	}
+	if (ftpd_sr_count >= FTPD_SR_MAX_FILES)
+		return NULL;
+
+	sr = ftpd_alloc(NULL, sizeof(struct ftpd_sreader));
+	if (!sr)
+		return NULL;
+	sr->path = ftpd_alloc(NULL, strlen(path) + 1);
+	sr->ring = ftpd_alloc(NULL, FTPD_SHARED_READ);
+	sr->vfs_file = FTPD_VFSP_SHARED(fsm, FTPD_VOP_OPEN, vfs_open(fsm->vfs, arg, "rb"));
+	if (!sr->path || !sr->ring || !sr->vfs_file) {
+		if (sr->vfs_file)
+			FTPD_VFSV(fsm, FTPD_VOP_CLOSE, vfs_close_file(sr->vfs_file));
+		ftpd_free(NULL, sr->ring);
+		ftpd_free(NULL, sr->path);
+		ftpd_free(NULL, sr);
+		return NULL;
+	}
+	strcpy(sr->path, path);
+	sr->st = *st;
+	sr->filled = 0;
+	sr->kicking = 0;
+	sr->clients = NULL;
+	sr->next = ftpd_sreaders;
+	ftpd_sreaders = sr;
+	ftpd_sr_count++;
+	return sr;
+}
+
+/* Free a reader that nobody uses. */
+static void ftpd_sr_put(struct ftpd_sreader *sr)
+{
+	struct ftpd_sreader **p = &ftpd_sreaders;
+
+	if (sr->clients)
+		return;
+	while (*p != sr)
+		p = &(*p)->next;
+	*p = sr->next;
+	ftpd_sr_count--;
+	if (sr->vfs_file)
+		FTPD_VFSV(NULL, FTPD_VOP_CLOSE, vfs_close_file(sr->vfs_file));
+	ftpd_free(NULL, sr->ring);
+	ftpd_free(NULL, sr->path);
+	ftpd_free(NULL, sr);
+}
+
+/* Downloads that are under way finish, but new ones don't join. */
+static void ftpd_sr_invalidate(const char *path)
+{
+	struct ftpd_sreader *sr;
+
+	for (sr = ftpd_sreaders; sr; sr = sr->next) {
+		if (ftpd_path_within(sr->path, path))
+			sr->path[0] = '\0';
+	}
+}
+
+static void ftpd_sr_add(struct ftpd_sreader *sr, struct ftpd_datastate *fsd)
+{
+	fsd->sr = sr;
+	fsd->srpos = 0;
+	fsd->srnext = sr->clients;
+	sr->clients = fsd;
+}
+
+static void ftpd_sr_remove(struct ftpd_datastate *fsd)
+{
+	struct ftpd_sreader *sr = fsd->sr;
+	struct ftpd_datastate **p = &sr->clients;
+
+	while (*p != fsd)
+		p = &(*p)->srnext;
+	*p = fsd->srnext;
+	fsd->sr = NULL;
+	ftpd_sr_put(sr);
+}
+
+/*
+ * Read the next block if no connection still needs the ring space it
+ * goes to. Return nonzero if there is news: data or the end of the file.
+ */
+static int ftpd_sr_read(struct ftpd_sreader *sr)
+{
+	struct ftpd_datastate *c;
+	size_t oldest = sr->filled;
+	size_t off = sr->filled & (FTPD_SHARED_READ - 1);
+	size_t len = FTPD_SR_BLOCK_SIZE;
+	int got;
+
+	if (!sr->vfs_file)
+		return 0;
+	for (c = sr->clients; c; c = c->srnext) {
+		if (c->srpos - c->unacked < oldest)
+			oldest = c->srpos - c->unacked;
+	}
+	if (len > FTPD_SHARED_READ - off)
+		len = FTPD_SHARED_READ - off;
+	if (sr->filled + len - oldest > FTPD_SHARED_READ)
+		return 0;
+
+	got = FTPD_VFS(NULL, FTPD_VOP_READ, vfs_read(sr->ring + off, 1, len, sr->vfs_file));
+	if (got > 0)
+		sr->filled += got;
+	/* Stop at the size that RETR announced, so that the last download
+	   doesn't have to wait for ring space just to find out. */
+	if (got <= 0 || sr->filled >= (size_t) sr->st.st_size) {
+		FTPD_VFSV(NULL, FTPD_VOP_CLOSE, vfs_close_file(sr->vfs_file));
+		sr->vfs_file = NULL;
+	}
+	return 1;
+}
+#endif
+
+#if FTPD_FILE_CACHE || FTPD_CONTENT_CACHE || FTPD_SHARED_READ
+/* A command is about to change arg, or whatever is below it. */
+static void ftpd_path_changing(struct ftpd_msgstate *fsm, const char *arg)
+{
+	char *path = ftpd_abspath(fsm, arg);
+
+	/* Without the path, play it safe and drop everything. */
+#if FTPD_FILE_CACHE
+	ftpd_fc_invalidate(path);
+#endif
+#if FTPD_CONTENT_CACHE
+	ftpd_cc_invalidate(path);
+#endif
+#if FTPD_SHARED_READ
+	ftpd_sr_invalidate(path);
+#endif
+	ftpd_free(fsm->mem, path);
+}
+#endif
+
+/* Done reading a RETR file: close it or give it back to the cache. */
+static void close_retr_file(struct ftpd_datastate *fsd)
+{
+#if FTPD_FILE_CACHE
+	if (fsd->fc) {
+		ftpd_fc_release(fsd->fc);
+		fsd->fc = NULL;
+		fsd->vfs_file = NULL;
+		return;
+	}
+#endif
+	if (fsd->vfs_file)
+		FTPD_VFSV(fsd->msgfs, FTPD_VOP_CLOSE, vfs_close_file(fsd->vfs_file));
+	fsd->vfs_file = NULL;
+}
+
+#ifdef FTPD_SEND_BYREF
+/* TCP no longer references the data that RETR sent by reference. */
+static void release_map(struct ftpd_datastate *fsd)
+{
+#if FTPD_CONTENT_CACHE
+	if (fsd->cc) {
+		ftpd_cc_release(fsd->cc);
+		fsd->cc = NULL;
+		fsd->map = NULL;
+		return;
+	}
+#endif
+#ifdef VFS_HAVE_MAP
+	FTPD_VFSV(fsd->msgfs, FTPD_VOP_UNMAP, vfs_unmap(fsd->vfs_file, fsd->map, fsd->maplen));
+#endif
+	fsd->map = NULL;
+}
+#endif
+
+/* Stop listening for the connection of a PASV that hasn't been used. */
+static void ftpd_data_unlisten(struct ftpd_datastate *fsd)
+{
+	if (fsd->listenpcb) {
+		tcp_arg(fsd->listenpcb, NULL);
+		tcp_accept(fsd->listenpcb, NULL);
+		tcp_close(fsd->listenpcb);
+		fsd->listenpcb = NULL;
+	}
+}
+
+/* Take fsd off the session's list of data connections. */
+static void ftpd_data_unlink(struct ftpd_datastate *fsd)
+{
+	struct ftpd_msgstate *fsm = fsd->msgfs;
+	struct ftpd_datastate **p;
+
+	for (p = &fsm->data; *p; p = &(*p)->next) {
+		if (*p == fsd) {
+			*p = fsd->next;
+			break;
+		}
+	}
+	if (fsm->datafs == fsd)
+		fsm->datafs = NULL;
+}
+
+/* A transfer has ended. The session is idle once the last one has. */
+static void ftpd_data_done(struct ftpd_msgstate *fsm)
+{
+	struct ftpd_datastate *fsd;
+
+	for (fsd = fsm->data; fsd; fsd = fsd->next) {
+		if (fsd->state != FTPD_IDLE)
+			return;
+	}
+	ftpd_set_state(fsm, FTPD_IDLE);
+}
+
+#if FTPD_URING
+/*
+ * A read or write in flight for a transfer. If the transfer ends first,
+ * fsd is cleared and the request keeps what the kernel still writes to
+ * or reads from until it completes.
+ */
+struct ftpd_aio {
+	struct vfs_uring_req req;
+	struct ftpd_datastate *fsd;
+	struct ftpd_aio *next;	/* next request of the transfer */
+	struct ftpd_mem *mem;
+	sfifo_t fifo;		/* the FIFO of a read that was orphaned */
+	struct pbuf *p;		/* data of a write */
+	int len;
+	struct iovec iov[];
+};
+
+struct ftpd_lsentry {
+	struct vfs_uring_req req;
+	struct ftpd_lsbatch *batch;
+	char fname[NAME_MAX + 1];
+	struct statx stx;
+	vfs_stat_t st;
+};
+
+/* A batch of LIST entries, stat'ed together */
+struct ftpd_lsbatch {
+	struct ftpd_datastate *fsd;	/* NULL once the transfer has ended */
+	struct ftpd_mem *mem;
+	int count;		/* entries in e[] */
+	int next;		/* the next one to list */
+	int pending;		/* stat calls in flight */
+	struct ftpd_lsentry e[FTPD_URING_LIST_BATCH];
+};
+
+static void ftpd_aio_unlink(struct ftpd_datastate *fsd, struct ftpd_aio *aio)
+{
+	struct ftpd_aio **p;
+
+	for (p = &fsd->aio; *p; p = &(*p)->next) {
+		if (*p == aio) {
+			*p = aio->next;
+			break;
+		}
+	}
+}
+
+/* The transfer is going away with storage requests still in flight. */
+static void ftpd_aio_detach(struct ftpd_datastate *fsd)
+{
+	struct ftpd_aio *aio;
+
+	/* Its file and directory are closed next, so the kernel must have
+	   taken the requests that refer to them. */
+	if (fsd->aio || (fsd->ls && fsd->ls->pending))
+		vfs_uring_submit();
+	for (aio = fsd->aio; aio; aio = aio->next) {
+		aio->fsd = NULL;
+		if (aio->p == NULL) {
+			/* A read into the FIFO, which it takes over. */
+			aio->fifo = fsd->fifo;
+			fsd->fifo.buffer = NULL;
+		}
+	}
+	fsd->aio = NULL;
+	if (fsd->ls) {
+		if (fsd->ls->pending)
+			fsd->ls->fsd = NULL;
+		else
+			ftpd_free(fsd->ls->mem, fsd->ls);
+		fsd->ls = NULL;
+	}
+}
+#endif
+
+/*
+ * The data path of RETR and STOR can run through a pipeline of stages
+ * that look at or change the data on its way between the file and the
+ * connection: file -> stages -> FIFO -> TCP for RETR, and pbufs -> stages
+ * -> FIFO -> file for STOR. Each stage has an input buffer of
+ * FTPD_PIPE_BUF bytes. The first one is filled by the transfer (push), and
+ * each stage converts from its own input into the next one's, or, for the
+ * last, into what the transfer asks for (pull). A stage only runs while
+ * there is room downstream, so a full FIFO or a full buffer holds back
+ * everything before it.
+ *
+ * A stage is a run function, which has to make progress whenever it gets
+ * input and room for output, and may keep some private state. Stages
+ * don't know about files or connections, so they can be tried and
+ * benchmarked on their own.
+ */
+struct ftpd_stage_ops {
+	/* Convert from in to out. Returns the bytes written to out, and
+	   how much of in was used in *inused. eof says that in holds the
+	   last of the input; everything held back has to be written out
+	   then, and less than outlen means that this is done. */
+	int (*run)(void *priv, const char *in, int inlen, int *inused, char *out, int outlen, int eof);
+	size_t privsize;
 };
 
-static void send_msg(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm, char *msg, ...);
+struct ftpd_stage {
+	const struct ftpd_stage_ops *ops;
+	void *priv;
+	char *buf;		/* input, FTPD_PIPE_BUF bytes */
+	int len;
+	int done;		/* all output has been written */
+};
+
+struct ftpd_pipe {
+	int count;
+	struct ftpd_stage stage[FTPD_PIPE_MAX];
+};
+
+/*
+ * TYPE A. Files are stored with LF line ends and sent with CRLF. Line
+ * ends are found with memchr(), which the C libraries implement with
+ * SIMD or a word at a time, so text without them is moved in bulk.
+ */
+struct ftpd_ascii {
+	int cr;			/* the last byte seen was a CR */
+};
+
+/* LF to CRLF, leaving LFs that already follow a CR alone */
+static int ftpd_ascii_out(void *priv, const char *in, int inlen, int *inused, char *out, int outlen, int eof)
+{
+	struct ftpd_ascii *a = priv;
+	int i = 0;
+	int o = 0;
+
+	while (i < inlen && o < outlen) {
+		const char *lf = memchr(in + i, '\n', inlen - i);
+		int run = (lf ? lf - in : inlen) - i;
+
+		if (run > outlen - o)
+			run = outlen - o;
+		if (run > 0) {
+			memcpy(out + o, in + i, run);
+			a->cr = in[i + run - 1] == '\r';
+			i += run;
+			o += run;
+			continue;
+		}
+		if (!a->cr) {
+			if (outlen - o < 2)
+				break;
+			out[o++] = '\r';
+		}
+		out[o++] = '\n';
+		a->cr = 0;
+		i++;
+	}
+	*inused = i;
+	return o;
+}
+
+/*
+ * CRLF to LF. A CR at the end of the input is held back, as only the
+ * next byte tells whether it ends a line.
+ */
+static int ftpd_ascii_in(void *priv, const char *in, int inlen, int *inused, char *out, int outlen, int eof)
+{
+	struct ftpd_ascii *a = priv;
+	int i = 0;
+	int o = 0;
+
+	while (o < outlen) {
+		const char *r;
+		int run;
+
+		if (a->cr) {
+			if (i == inlen && !eof)
+				break;
+			/* A CR that doesn't end a line is just data. */
+			if (i == inlen || in[i] != '\n')
+				out[o++] = '\r';
+			a->cr = 0;
+			continue;
+		}
+		if (i == inlen)
+			break;
+		r = memchr(in + i, '\r', inlen - i);
+		run = (r ? r - in : inlen) - i;
+		if (run > outlen - o) {
+			memcpy(out + o, in + i, outlen - o);
+			i += outlen - o;
+			o = outlen;
+			break;
+		}
+		memcpy(out + o, in + i, run);
+		i += run;
+		o += run;
+		if (r) {
+			a->cr = 1;
+			i++;
+		}
+	}
+	*inused = i;
+	return o;
+}
+
+static const struct ftpd_stage_ops ftpd_ascii_out_ops = { ftpd_ascii_out, sizeof(struct ftpd_ascii) };
+static const struct ftpd_stage_ops ftpd_ascii_in_ops = { ftpd_ascii_in, sizeof(struct ftpd_ascii) };
+
+/* Whether the session's settings put stages into its transfers */
+static int ftpd_pipe_wanted(struct ftpd_msgstate *fsm)
+{
+	return fsm->ascii;
+}
+
+static int ftpd_pipe_add(struct ftpd_pipe *pipe, struct ftpd_mem *mem, const struct ftpd_stage_ops *ops)
+{
+	struct ftpd_stage *st;
+
+	if (pipe->count == FTPD_PIPE_MAX)
+		return -1;
+	st = &pipe->stage[pipe->count];
+	st->buf = ftpd_alloc(mem, FTPD_PIPE_BUF + ops->privsize);
+	if (st->buf == NULL)
+		return -1;
+	st->ops = ops;
+	st->priv = st->buf + FTPD_PIPE_BUF;
+	memset(st->priv, 0, ops->privsize);
+	st->len = 0;
+	st->done = 0;
+	pipe->count++;
+	return 0;
+}
+
+static void ftpd_pipe_free(struct ftpd_datastate *fsd)
+{
+	struct ftpd_mem *mem = fsd->msgfs->mem;
+	int i;
+
+	if (fsd->pipe == NULL)
+		return;
+	for (i = 0; i < fsd->pipe->count; i++)
+		ftpd_free(mem, fsd->pipe->stage[i].buf);
+	ftpd_free(mem, fsd->pipe);
+	fsd->pipe = NULL;
+}
+
+/* Build the stages of a transfer from the session's settings. */
+static int ftpd_pipe_setup(struct ftpd_msgstate *fsm, struct ftpd_datastate *fsd, int sending)
+{
+	if (!ftpd_pipe_wanted(fsm))
+		return 0;
+	fsd->pipe = ftpd_alloc(fsm->mem, sizeof(struct ftpd_pipe));
+	if (fsd->pipe == NULL)
+		return -1;
+	fsd->pipe->count = 0;
+	if (fsm->ascii
+	    && ftpd_pipe_add(fsd->pipe, fsm->mem, sending ? &ftpd_ascii_out_ops : &ftpd_ascii_in_ops) != 0) {
+		ftpd_pipe_free(fsd);
+		return -1;
+	}
+	return 0;
+}
+
+/* Room in the input of the pipeline, to be filled and committed. */
+static int ftpd_pipe_space(struct ftpd_pipe *pipe, char **buf)
+{
+	struct ftpd_stage *st = &pipe->stage[0];
+
+	*buf = st->buf + st->len;
+	return FTPD_PIPE_BUF - st->len;
+}
+
+static void ftpd_pipe_commit(struct ftpd_pipe *pipe, int len)
+{
+	pipe->stage[0].len += len;
+}
+
+/* Copy into the input of the pipeline, as much as fits. */
+static int ftpd_pipe_push(struct ftpd_pipe *pipe, const void *data, int len)
+{
+	char *buf;
+	int space = ftpd_pipe_space(pipe, &buf);
+
+	if (len > space)
+		len = space;
+	memcpy(buf, data, len);
+	ftpd_pipe_commit(pipe, len);
+	return len;
+}
+
+/*
+ * Move data along the pipeline and take up to outlen bytes out of its end.
+ * eof says that nothing more will be pushed.
+ */
+static int ftpd_pipe_pull(struct ftpd_pipe *pipe, char *out, int outlen, int eof)
+{
+	int n = 0;
+	int i;
+
+	for (i = 0; i < pipe->count; i++) {
+		struct ftpd_stage *st = &pipe->stage[i];
+		struct ftpd_stage *next = i + 1 < pipe->count ? &pipe->stage[i + 1] : NULL;
+		int upeof = i == 0 ? eof : pipe->stage[i - 1].done;
+		char *dst = next ? next->buf + next->len : out;
+		int room = next ? FTPD_PIPE_BUF - next->len : outlen;
+		int used = 0;
+
+		if (st->done || room == 0)
+			continue;
+		n = st->ops->run(st->priv, st->buf, st->len, &used, dst, room, upeof);
+		st->len -= used;
+		memmove(st->buf, st->buf + used, st->len);
+		if (upeof && st->len == 0 && n < room)
+			st->done = 1;
+		if (next) {
+			next->len += n;
+			n = 0;
+		}
+	}
+	return n;
+}
+
+/* Everything has come out of the end of the pipeline. */
+static int ftpd_pipe_done(struct ftpd_pipe *pipe)
+{
+	return pipe->stage[pipe->count - 1].done;
+}
 
 static void ftpd_dataerr(void *arg, err_t err)
 {
@@ -372,107 +2570,516 @@ static void ftpd_dataerr(void *arg, err_t err)
 	ftpd_loge("ftpd_dataerr: %s (%i)", lwip_strerr(err), err);
 	if (fsd == NULL)
 		return;
-	fsd->msgfs->datafs = NULL;
-	fsd->msgfs->state = FTPD_IDLE;
-	free(fsd);
+	ftpd_data_unlisten(fsd);
+	ftpd_data_unlink(fsd);
+	ftpd_data_done(fsd->msgfs);
+#if FTPD_WRITEBACK
+	if (fsd->wb)
+		ftpd_wb_close(fsd->wb, NULL, NULL);
+#endif
+#ifdef FTPD_SEND_BYREF
+	/* The pcb is gone, so nothing references the data anymore. */
+	if (fsd->map)
+		release_map(fsd);
+#endif
+#if FTPD_SHARED_READ
+	if (fsd->sr)
+		ftpd_sr_remove(fsd);
+#endif
+#if FTPD_URING
+	ftpd_aio_detach(fsd);
+#endif
+	/* Whatever a transfer that ended early still has open. */
+	close_retr_file(fsd);
+	if (fsd->vfs_dir)
+		FTPD_VFSV(fsd->msgfs, FTPD_VOP_CLOSEDIR, vfs_closedir(fsd->vfs_dir));
+	ftpd_pipe_free(fsd);
+	sfifo_close(&fsd->fifo);
+	ftpd_free(fsd->msgfs->mem, fsd);
 }
 
 static void ftpd_dataclose(struct tcp_pcb *pcb, struct ftpd_datastate *fsd)
 {
-	tcp_arg(pcb, NULL);
-	tcp_sent(pcb, NULL);
-	tcp_recv(pcb, NULL);
-
-	if (fsd->msgfs->datalistenpcb) {
-		tcp_arg(fsd->msgfs->datalistenpcb, NULL);
-		tcp_accept(fsd->msgfs->datalistenpcb, NULL);
-		tcp_close(fsd->msgfs->datalistenpcb);
-		fsd->msgfs->datalistenpcb = NULL;
+	int aborted = 0;
+
+	FTPD_TRACE_EVENT(fsd->msgfs, FTPD_EV_DATA_CLOSE, 0, 0);
+	/* A PASV connection that hasn't been accepted yet has no pcb. */
+	if (pcb) {
+		tcp_arg(pcb, NULL);
+		tcp_sent(pcb, NULL);
+		tcp_recv(pcb, NULL);
 	}
-
-	if (fsd->msgfs->datafs == fsd)
-		fsd->msgfs->datafs = NULL;
-	else
-		ftpd_logw("ftpd_dataclose: not setting datafs to NULL because it is different "
-			"(probably a new PASV connection): %p != %p", fsd->msgfs->datafs, fsd);
+	ftpd_data_unlisten(fsd);
+	ftpd_data_unlink(fsd);
+#if FTPD_WRITEBACK
+	/* Keep what has been received so far, like the unbuffered path does. */
+	if (fsd->wb)
+		ftpd_wb_close(fsd->wb, NULL, NULL);
+#endif
+#ifdef FTPD_SEND_BYREF
+	/* Queued segments may still point into data sent by reference, so
+	   they have to be dropped before it goes away. */
+	if (fsd->unacked > 0 && pcb) {
+		tcp_abort(pcb);
+		aborted = 1;
+	}
+	if (fsd->map)
+		release_map(fsd);
+#endif
+#if FTPD_SHARED_READ
+	if (fsd->sr)
+		ftpd_sr_remove(fsd);
+#endif
+#if FTPD_URING
+	ftpd_aio_detach(fsd);
+#endif
+	/* Whatever a transfer that ended early still has open. */
+	close_retr_file(fsd);
+	if (fsd->vfs_dir)
+		FTPD_VFSV(fsd->msgfs, FTPD_VOP_CLOSEDIR, vfs_closedir(fsd->vfs_dir));
+	ftpd_pipe_free(fsd);
 	sfifo_close(&fsd->fifo);
-	free(fsd);
-	tcp_arg(pcb, NULL);
-	tcp_close(pcb);
+	ftpd_free(fsd->msgfs->mem, fsd);
+	if (!aborted && pcb) {
+		tcp_arg(pcb, NULL);
+		tcp_close(pcb);
+	}
 }
 
-static void send_data(struct tcp_pcb *pcb, struct ftpd_datastate *fsd)
+/*
+ * Hand queued bytes to TCP, limited by the space in the send buffer.
+ * The FIFO can wrap around at most once, so at most two writes are needed.
+ * Returns the error of a failed tcp_write(), if any.
+ */
+static err_t send_fifo(struct tcp_pcb *pcb, sfifo_t *fifo)
 {
-	err_t err;
-	u16_t len;
+	int i;
 
-	if (sfifo_used(&fsd->fifo) > 0) {
-		int i;
+	for (i = 0; i < 2; i++) {
+		char *buf;
+		int len;
+		err_t err;
+
+		len = sfifo_peek_contiguous(fifo, &buf);
+		if (len == 0)
+			return ERR_OK;
 
 		/* We cannot send more data than space available in the send
 		   buffer. */
-		if (tcp_sndbuf(pcb) < sfifo_used(&fsd->fifo)) {
+		if (tcp_sndbuf(pcb) < len)
 			len = tcp_sndbuf(pcb);
-		} else {
-			len = (u16_t) sfifo_used(&fsd->fifo);
+		if (len == 0)
+			return ERR_OK;
+
+		err = tcp_write(pcb, buf, (u16_t) len, TCP_WRITE_FLAG_COPY);
+		if (err != ERR_OK) {
+			ftpd_loge("send_fifo: error writing!");
+			return err;
+		}
+		sfifo_commit_read(fifo, len);
+	}
+	return ERR_OK;
+}
+
+static void send_data(struct tcp_pcb *pcb, struct ftpd_datastate *fsd)
+{
+#if FTPD_TRACE
+	u16_t len = (u16_t) sfifo_used(&fsd->fifo);
+	err_t err = send_fifo(pcb, &fsd->fifo);
+
+	if (err != ERR_OK)
+		FTPD_TRACE_EVENT(fsd->msgfs, FTPD_EV_WRITE_ERR, err, len);
+#else
+	send_fifo(pcb, &fsd->fifo);
+#endif
+}
+
+#ifdef FTPD_SEND_BYREF
+/*
+ * Send a mapped or cached file without copying it. TCP keeps references
+ * to the data until it is acknowledged, so the transfer only ends once
+ * ftpd_datasent() has accounted for every byte.
+ */
+static void send_mapped_file(struct ftpd_datastate *fsd, struct tcp_pcb *pcb)
+{
+	struct ftpd_msgstate *fsm;
+	struct tcp_pcb *msgpcb;
+
+	while (fsd->mappos < fsd->mapend) {
+		size_t len = fsd->mapend - fsd->mappos;
+		err_t err;
+
+		if (len > tcp_sndbuf(pcb))
+			len = tcp_sndbuf(pcb);
+		if (len == 0)
+			return;
+
+		/* Only push with the last segment of the file. */
+		err = tcp_write(pcb, fsd->map + fsd->mappos, (u16_t) len,
+				fsd->mappos + len < fsd->mapend ? TCP_WRITE_FLAG_MORE : 0);
+		if (err != ERR_OK)
+			FTPD_TRACE_EVENT(fsd->msgfs, FTPD_EV_WRITE_ERR, err, len);
+		if (err == ERR_MEM)
+			return;
+		if (err != ERR_OK) {
+			ftpd_loge("send_mapped_file: error writing!");
+			return;
 		}
+		fsd->mappos += len;
+		fsd->unacked += len;
+	}
+
+	if (fsd->unacked > 0)
+		return;
+
+	fsm = fsd->msgfs;
+	msgpcb = fsd->msgpcb;
+
+	release_map(fsd);
+	close_retr_file(fsd);
+	ftpd_dataclose(pcb, fsd);
+	ftpd_data_done(fsm);
+	send_msg(msgpcb, fsm, msg226);
+}
+#endif
+
+#if FTPD_SHARED_READ
+static void send_shared_file(struct ftpd_datastate *fsd, struct tcp_pcb *pcb);
+
+/* New data is in the ring; let the other downloads send it. */
+static void ftpd_sr_kick(struct ftpd_sreader *sr, struct ftpd_datastate *self)
+{
+	struct ftpd_datastate *c = sr->clients;
 
-		i = fsd->fifo.readpos;
-		if ((i + len) > fsd->fifo.size) {
-			err = tcp_write(pcb, fsd->fifo.buffer + i, (u16_t)(fsd->fifo.size - i), 1);
-			if (err != ERR_OK) {
-				ftpd_loge("send_data: error writing!");
+	if (sr->kicking)
+		return;
+	sr->kicking = 1;
+	while (c) {
+		struct ftpd_datastate *next = c->srnext;
+
+		if (c != self && c->connected && c->pcb)
+			send_shared_file(c, c->pcb);
+		c = next;
+	}
+	sr->kicking = 0;
+}
+
+/*
+ * Send from the shared ring. Like send_mapped_file(), the transfer ends
+ * once TCP has had all of it acknowledged.
+ */
+static void send_shared_file(struct ftpd_datastate *fsd, struct tcp_pcb *pcb)
+{
+	struct ftpd_sreader *sr = fsd->sr;
+	struct ftpd_msgstate *fsm;
+	struct tcp_pcb *msgpcb;
+
+	for (;;) {
+		size_t off = fsd->srpos & (FTPD_SHARED_READ - 1);
+		size_t len = sr->filled - fsd->srpos;
+		err_t err;
+
+		if (len == 0) {
+			if (!sr->vfs_file)
+				break;
+			if (!ftpd_sr_read(sr))
 				return;
-			}
-			len -= fsd->fifo.size - i;
-			fsd->fifo.readpos = 0;
-			i = 0;
+			ftpd_sr_kick(sr, fsd);
+			continue;
 		}
+		if (len > FTPD_SHARED_READ - off)
+			len = FTPD_SHARED_READ - off;
+		if (len > tcp_sndbuf(pcb))
+			len = tcp_sndbuf(pcb);
+		if (len == 0)
+			return;
 
-		err = tcp_write(pcb, fsd->fifo.buffer + i, len, 1);
+		err = tcp_write(pcb, sr->ring + off, (u16_t) len, 0);
+		if (err != ERR_OK)
+			FTPD_TRACE_EVENT(fsd->msgfs, FTPD_EV_WRITE_ERR, err, len);
+		if (err == ERR_MEM)
+			return;
 		if (err != ERR_OK) {
-			ftpd_loge("send_data: error writing!");
+			ftpd_loge("send_shared_file: error writing!");
 			return;
 		}
-		fsd->fifo.readpos += len;
+		fsd->srpos += len;
+		fsd->unacked += len;
+	}
+
+	if (fsd->unacked > 0)
+		return;
+
+	fsm = fsd->msgfs;
+	msgpcb = fsd->msgpcb;
+
+	ftpd_sr_remove(fsd);
+	ftpd_dataclose(pcb, fsd);
+	ftpd_data_done(fsm);
+	send_msg(msgpcb, fsm, msg226);
+}
+#endif
+
+#if FTPD_URING
+static void send_file(struct ftpd_datastate *fsd, struct tcp_pcb *pcb);
+
+/* Storage failed under a transfer: end it with 451. */
+static void ftpd_aio_fail(struct ftpd_datastate *fsd)
+{
+	struct ftpd_msgstate *fsm = fsd->msgfs;
+	struct tcp_pcb *msgpcb = fsd->msgpcb;
+
+	ftpd_loge("ftpd_aio_fail: I/O error");
+	ftpd_dataclose(fsd->pcb, fsd);
+	ftpd_data_done(fsm);
+	send_msg(msgpcb, fsm, msg451);
+}
+
+static void ftpd_aio_read_done(struct vfs_uring_req *req, int res)
+{
+	struct ftpd_aio *aio = (struct ftpd_aio *) req;
+	struct ftpd_datastate *fsd = aio->fsd;
+	struct ftpd_msgstate *fsm;
+
+	if (fsd == NULL) {
+		sfifo_close(&aio->fifo);
+		ftpd_free(aio->mem, aio);
+		return;
+	}
+	fsm = fsd->msgfs;
+	ftpd_lat_resume(fsm);
+	ftpd_aio_unlink(fsd, aio);
+	ftpd_free(aio->mem, aio);
+	if (res < 0) {
+		ftpd_aio_fail(fsd);
+		return;
+	}
+	if (res == 0) {
+		close_retr_file(fsd);
+	} else {
+		sfifo_commit_write(&fsd->fifo, res);
+		fsd->readpos += res;
+		if (fsd->readend > 0 && fsd->readpos >= fsd->readend)
+			close_retr_file(fsd);
+	}
+	send_file(fsd, fsd->pcb);
+	ftpd_lat_yield(fsm);
+}
+
+/* Read the next len bytes of the file into buffer in the background. */
+static int ftpd_aio_read(struct ftpd_datastate *fsd, char *buffer, int len)
+{
+	struct ftpd_mem *mem = fsd->msgfs->mem;
+	struct ftpd_aio *aio = ftpd_alloc(mem, sizeof(struct ftpd_aio));
+
+	if (aio == NULL)
+		return -1;
+	memset(aio, 0, sizeof(struct ftpd_aio));
+	aio->req.done = ftpd_aio_read_done;
+	aio->fsd = fsd;
+	aio->mem = mem;
+	if (vfs_uring_read(&aio->req, vfs_fileno(fsd->vfs_file), buffer, (unsigned) len, fsd->readpos) != 0) {
+		ftpd_free(mem, aio);
+		return -1;
+	}
+	aio->next = fsd->aio;
+	fsd->aio = aio;
+	return 0;
+}
+#endif
+
+#if FTPD_ZEROCOPY
+/*
+ * Decide once per transfer whether it can go between file and socket
+ * directly. It can't if something has to see the data on the way, or if
+ * some of it has already taken the buffered path.
+ */
+static int ftpd_zc_ok(struct ftpd_datastate *fsd)
+{
+	if (fsd->zc != 0)
+		return fsd->zc > 0;
+	fsd->zc = -1;
+	if (fsd->vfs_file == NULL || sfifo_used(&fsd->fifo) > 0 || fsd->pipe)
+		return 0;
+#ifdef FTPD_SEND_BYREF
+	if (fsd->map)
+		return 0;
+#endif
+#if FTPD_URING
+	if (fsd->aio)
+		return 0;
+#endif
+	fsd->zc = 1;
+	return 1;
+}
+
+/*
+ * RETR with sendfile(). Returns 0 once the file has been sent and
+ * closed, for send_file() to end the transfer, or if it has to be sent
+ * buffered after all.
+ */
+static int send_file_zc(struct ftpd_datastate *fsd, struct tcp_pcb *pcb)
+{
+	if (fsd->zc == 1) {
+		u64_t len = 0;
+
+		if (fsd->readend > 0) {
+			if (fsd->readpos >= fsd->readend) {
+				close_retr_file(fsd);
+				return 0;
+			}
+			len = fsd->readend - fsd->readpos;
+		}
+		if (tcp_epoll_sendfile(pcb, vfs_fileno(fsd->vfs_file), fsd->readpos, len) != ERR_OK) {
+			fsd->zc = -1;
+			return 0;
+		}
+		fsd->zc = 2;
+		return 1;
 	}
+	if (tcp_epoll_sendfile_left(pcb))
+		return 1;
+	close_retr_file(fsd);
+	return 0;
+}
+#endif
+
+/*
+ * RETR through the pipeline: read from the file into its input and pull
+ * its output into the FIFO, for as long as either moves. Right before the
+ * wrap-around, the output goes through tmp, which sfifo_write() can split,
+ * as the space there may be too small for a stage to write anything.
+ * Returns 0 once the file has been read and everything has come out.
+ */
+static int send_file_piped(struct ftpd_datastate *fsd, struct tcp_pcb *pcb)
+{
+	struct ftpd_pipe *pipe = fsd->pipe;
+	char tmp[16];
+	int moved;
+
+	do {
+		char *buffer;
+		int len;
+		int n;
+
+		moved = 0;
+		len = fsd->vfs_file ? ftpd_pipe_space(pipe, &buffer) : 0;
+		if (fsd->readend > 0 && (size_t) len > fsd->readend - fsd->readpos)
+			len = fsd->readend - fsd->readpos;
+		if (len > 0) {
+			len = FTPD_VFS(fsd->msgfs, FTPD_VOP_READ, vfs_read(buffer, 1, len, fsd->vfs_file));
+			if (len == 0) {
+				if (FTPD_VFS(fsd->msgfs, FTPD_VOP_EOF, vfs_eof(fsd->vfs_file)) == 0)
+					return 1;
+				close_retr_file(fsd);
+			}
+			ftpd_pipe_commit(pipe, len);
+			fsd->readpos += len;
+			if (fsd->readend > 0 && fsd->readpos >= fsd->readend)
+				close_retr_file(fsd);
+			moved = len;
+		}
+
+		len = sfifo_reserve_write(&fsd->fifo, &buffer);
+		if (len < (int) sizeof(tmp) && sfifo_space(&fsd->fifo) > len) {
+			len = sfifo_space(&fsd->fifo);
+			if (len > (int) sizeof(tmp))
+				len = sizeof(tmp);
+			n = ftpd_pipe_pull(pipe, tmp, len, fsd->vfs_file == NULL);
+			sfifo_write(&fsd->fifo, tmp, n);
+		} else {
+			n = ftpd_pipe_pull(pipe, buffer, len, fsd->vfs_file == NULL);
+			sfifo_commit_write(&fsd->fifo, n);
+		}
+		moved += n;
+	} while (moved > 0);
+
+	if (fsd->vfs_file == NULL && ftpd_pipe_done(pipe))
+		return 0;
+	if (sfifo_space(&fsd->fifo) == 0)
+		FTPD_TRACE_EVENT(fsd->msgfs, FTPD_EV_FIFO_FULL, sfifo_used(&fsd->fifo), 0);
+	send_data(pcb, fsd);
+	return 1;
 }
 
 static void send_file(struct ftpd_datastate *fsd, struct tcp_pcb *pcb)
 {
 	if (!fsd->connected)
 		return;
+#if FTPD_ZEROCOPY
+	if (fsd->vfs_file && ftpd_zc_ok(fsd) && send_file_zc(fsd, pcb) != 0)
+		return;
+#endif
+	if (fsd->pipe && send_file_piped(fsd, pcb) != 0)
+		return;
+#if FTPD_SHARED_READ
+	if (fsd->sr) {
+		send_shared_file(fsd, pcb);
+		return;
+	}
+#endif
+#ifdef FTPD_SEND_BYREF
+	if (fsd->map) {
+		send_mapped_file(fsd, pcb);
+		return;
+	}
+#endif
 	if (fsd->vfs_file) {
-		char* buffer = (char*)malloc(2048);
+		char *buffer;
 		int len;
 
-		if (!buffer) {
-			ftpd_loge("send_file: Out of memory");
+#if FTPD_URING
+		/* Keep TCP busy while the next chunk is being read. */
+		if (fsd->aio) {
+			send_data(pcb, fsd);
 			return;
 		}
-
-		len = sfifo_space(&fsd->fifo);
+#endif
+		/* Read straight into the FIFO. Reads start at offset 0 and the
+		   FIFO size is a multiple of the alignment, so whole aligned
+		   chunks never straddle the wrap-around. If there isn't room for
+		   one, wait for the FIFO to drain. A short read leaves readpos
+		   unaligned; it was the end of the file, and the read that
+		   confirms that can take whatever room there is. */
+		/* TCP has taken all we had buffered: storage is behind. */
+		if (sfifo_used(&fsd->fifo) == 0)
+			FTPD_TRACE_EVENT(fsd->msgfs, FTPD_EV_FIFO_EMPTY, 0, 0);
+		len = sfifo_reserve_write(&fsd->fifo, &buffer);
+		if (fsd->chunk > 0 && len > fsd->chunk)
+			len = fsd->chunk;
+		if (fsd->align > 1 && fsd->readpos % fsd->align == 0)
+			len -= len % fsd->align;
+		if (fsd->readend > 0 && (size_t) len > fsd->readend - fsd->readpos)
+			len = fsd->readend - fsd->readpos;
 		if (len == 0) {
+			FTPD_TRACE_EVENT(fsd->msgfs, FTPD_EV_FIFO_FULL, sfifo_used(&fsd->fifo), 0);
+			send_data(pcb, fsd);
+			return;
+		}
+#if FTPD_URING
+		if (ftpd_aio_read(fsd, buffer, len) == 0) {
 			send_data(pcb, fsd);
-			free(buffer);
 			return;
 		}
-		if (len > 2048)
-			len = 2048;
-		len = vfs_read(buffer, 1, len, fsd->vfs_file);
+		/* The ring is full. The file position is wherever the last
+		   blocking read left it. */
+		if (FTPD_VFS(fsd->msgfs, FTPD_VOP_SEEK, vfs_seek(fsd->vfs_file, fsd->readpos)) != 0) {
+			ftpd_aio_fail(fsd);
+			return;
+		}
+#endif
+		len = FTPD_VFS(fsd->msgfs, FTPD_VOP_READ, vfs_read(buffer, 1, len, fsd->vfs_file));
 		if (len == 0) {
-			if (vfs_eof(fsd->vfs_file) == 0) {
-				free(buffer);
+			if (FTPD_VFS(fsd->msgfs, FTPD_VOP_EOF, vfs_eof(fsd->vfs_file)) == 0)
 				return;
-			}
-			vfs_close_file(fsd->vfs_file);
-			fsd->vfs_file = NULL;
-			free(buffer);
+			close_retr_file(fsd);
 			return;
 		}
-		sfifo_write(&fsd->fifo, buffer, len);
+		sfifo_commit_write(&fsd->fifo, len);
+		fsd->readpos += len;
+		if (fsd->readend > 0 && fsd->readpos >= fsd->readend)
+			close_retr_file(fsd);
 		send_data(pcb, fsd);
-		free(buffer);
 	} else {
 		struct ftpd_msgstate *fsm;
 		struct tcp_pcb *msgpcb;
@@ -484,23 +3091,100 @@ static void send_file(struct ftpd_datastate *fsd, struct tcp_pcb *pcb)
 		fsm = fsd->msgfs;
 		msgpcb = fsd->msgpcb;
 
-		vfs_close_file(fsd->vfs_file);
-		fsd->vfs_file = NULL;
 		ftpd_dataclose(pcb, fsd);
-		fsm->datapcb = NULL;
-		fsm->state = FTPD_IDLE;
+		ftpd_data_done(fsm);
 		send_msg(msgpcb, fsm, msg226);
 		return;
 	}
 }
 
+/*
+ * Make the FIFO of a transfer big enough for two reads of size bytes, so
+ * that one can be read while the other is sent. Without the memory, it
+ * stays as it is.
+ */
+static void fit_fifo(struct ftpd_datastate *fsd, size_t size)
+{
+	sfifo_t fifo;
+
+	if (size > FTPD_DATA_FIFO_MAX / 2)
+		size = FTPD_DATA_FIFO_MAX / 2;
+	if (size == 0 || 2 * size <= (size_t) fsd->fifo.size || sfifo_used(&fsd->fifo) > 0)
+		return;
+	/* sfifo_init() rounds up to hold one byte more than asked for. */
+	if (sfifo_init(&fifo, (int) (2 * size - 1), fsd->msgfs->mem) != 0)
+		return;
+	sfifo_close(&fsd->fifo);
+	fsd->fifo = fifo;
+}
+
+/*
+ * Size the reads of a transfer after the backend's preferences: a
+ * multiple of the alignment that fits into the FIFO, which grows for it
+ * if the transfer reads from the file.
+ */
+static void set_io_hints(struct ftpd_datastate *fsd, const vfs_io_hints_t *hints)
+{
+	size_t cap;
+	size_t align = hints->alignment;
+	size_t chunk = hints->optimal_size;
+	int reads = fsd->vfs_file != NULL;
+
+#ifdef FTPD_SEND_BYREF
+	if (fsd->map)
+		reads = 0;
+#endif
+	if (reads)
+		fit_fifo(fsd, chunk > align ? chunk : align);
+	cap = fsd->fifo.size - 1;
+
+	/* Alignment is only kept across the wrap-around if it divides the
+	   FIFO size, i.e. if it is a power of 2 that isn't too big. */
+	if (align == 0 || (align & (align - 1)) != 0 || align > cap)
+		align = 1;
+	if (chunk > cap)
+		chunk = cap;
+	chunk -= chunk % align;
+	if (chunk < align)
+		chunk = align;
+
+	fsd->chunk = (int) chunk;
+	fsd->align = (int) align;
+}
+
+/* A line of LIST output, like ls -l prints it. */
+static int format_list_line(char *buffer, size_t size, vfs_stat_t *st, const char *fname)
+{
+	time_t current_time;
+	int current_year;
+	struct tm *s_time;
+	int len;
+
+	time(&current_time);
+	s_time = gmtime(&current_time);
+	current_year = s_time->tm_year;
+
+	s_time = gmtime(&st->st_mtime);
+	if (s_time->tm_mon < 0 || s_time->tm_mon >= 12)
+		s_time->tm_mon = 0;
+	if (s_time->tm_year == current_year)
+		len = snprintf(buffer, size, "-rw-rw-rw-   1 user     ftp  %11ld %3s %02i %02i:%02i %s\r\n", st->st_size, month_table[s_time->tm_mon], s_time->tm_mday, s_time->tm_hour, s_time->tm_min, fname);
+	else
+		len = snprintf(buffer, size, "-rw-rw-rw-   1 user     ftp  %11ld %3s %02i %5i %s\r\n", st->st_size, month_table[s_time->tm_mon], s_time->tm_mday, s_time->tm_year + 1900, fname);
+	if (VFS_ISDIR(st->st_mode))
+		buffer[0] = 'd';
+	return len;
+}
+
 static void send_next_directory(struct ftpd_datastate *fsd, struct tcp_pcb *pcb, int shortlist)
 {
+	/* The transfer can end in here, taking fsd with it. */
+	struct ftpd_mem *mem = fsd->msgfs->mem;
 	char* buffer;
 	size_t buffer_size = 1024;
 	int len;
 
-	buffer = (char*)malloc(buffer_size);
+	buffer = (char*)ftpd_alloc(mem, buffer_size);
 	if (!buffer) {
 		ftpd_loge("send_next_directory: Out of memory");
 		return;
@@ -508,41 +3192,28 @@ static void send_next_directory(struct ftpd_datastate *fsd, struct tcp_pcb *pcb,
 
 	while (1) {
 	if (fsd->vfs_dirent == NULL)
-		fsd->vfs_dirent = vfs_readdir(fsd->vfs_dir);
+		fsd->vfs_dirent = FTPD_VFSP(fsd->msgfs, FTPD_VOP_READDIR, vfs_readdir(fsd->vfs_dir));
 
 	if (fsd->vfs_dirent) {
 		if (shortlist) {
 			len = sprintf(buffer, "%s\r\n", fsd->vfs_dirent->name);
 			if (sfifo_space(&fsd->fifo) < len) {
+				FTPD_TRACE_EVENT(fsd->msgfs, FTPD_EV_FIFO_FULL, sfifo_used(&fsd->fifo), 0);
 				send_data(pcb, fsd);
-				free(buffer);
+				ftpd_free(mem, buffer);
 				return;
 			}
 			sfifo_write(&fsd->fifo, buffer, len);
 			fsd->vfs_dirent = NULL;
 		} else {
 			vfs_stat_t st;
-			time_t current_time;
-			int current_year;
-			struct tm *s_time;
-
-			time(&current_time);
-			s_time = gmtime(&current_time);
-			current_year = s_time->tm_year;
-
-			vfs_stat(fsd->msgfs->vfs, fsd->vfs_dirent->name, &st);
-			s_time = gmtime(&st.st_mtime);
-			if (s_time->tm_mon < 0 || s_time->tm_mon >= 12)
-				s_time->tm_mon = 0;
-			if (s_time->tm_year == current_year)
-				len = snprintf(buffer, buffer_size, "-rw-rw-rw-   1 user     ftp  %11ld %3s %02i %02i:%02i %s\r\n", st.st_size, month_table[s_time->tm_mon], s_time->tm_mday, s_time->tm_hour, s_time->tm_min, fsd->vfs_dirent->name);
-			else
-				len = snprintf(buffer, buffer_size, "-rw-rw-rw-   1 user     ftp  %11ld %3s %02i %5i %s\r\n", st.st_size, month_table[s_time->tm_mon], s_time->tm_mday, s_time->tm_year + 1900, fsd->vfs_dirent->name);
-			if (VFS_ISDIR(st.st_mode))
-				buffer[0] = 'd';
+
+			FTPD_VFS(fsd->msgfs, FTPD_VOP_STAT, vfs_stat(fsd->msgfs->vfs, fsd->vfs_dirent->name, &st));
+			len = format_list_line(buffer, buffer_size, &st, fsd->vfs_dirent->name);
 			if (len > 0 && sfifo_space(&fsd->fifo) < len) {
+				FTPD_TRACE_EVENT(fsd->msgfs, FTPD_EV_FIFO_FULL, sfifo_used(&fsd->fifo), 0);
 				send_data(pcb, fsd);
-				free(buffer);
+				ftpd_free(mem, buffer);
 				return;
 			}
 			sfifo_write(&fsd->fifo, buffer, len);
@@ -554,31 +3225,147 @@ static void send_next_directory(struct ftpd_datastate *fsd, struct tcp_pcb *pcb,
 
 		if (sfifo_used(&fsd->fifo) > 0) {
 			send_data(pcb, fsd);
-			free(buffer);
+			ftpd_free(mem, buffer);
 			return;
 		}
 		fsm = fsd->msgfs;
 		msgpcb = fsd->msgpcb;
 
-		vfs_closedir(fsd->vfs_dir);
+		FTPD_VFSV(fsd->msgfs, FTPD_VOP_CLOSEDIR, vfs_closedir(fsd->vfs_dir));
 		fsd->vfs_dir = NULL;
 		ftpd_dataclose(pcb, fsd);
-		fsm->datapcb = NULL;
-		fsm->state = FTPD_IDLE;
+		ftpd_data_done(fsm);
 		send_msg(msgpcb, fsm, msg226);
-		free(buffer);
+		ftpd_free(mem, buffer);
 		return;
 	}
 	}
-	free(buffer);
+	ftpd_free(mem, buffer);
 }
 
-static err_t ftpd_datasent(void *arg, struct tcp_pcb *pcb, u16_t len)
+#if FTPD_URING
+static void ftpd_ls_done(struct vfs_uring_req *req, int res);
+
+/* The directory listing is over once the FIFO has drained. */
+static void end_directory(struct ftpd_datastate *fsd, struct tcp_pcb *pcb)
 {
-	struct ftpd_datastate *fsd = arg;
-	switch (fsd->msgfs->state) {
+	struct ftpd_msgstate *fsm = fsd->msgfs;
+	struct tcp_pcb *msgpcb = fsd->msgpcb;
+
+	if (sfifo_used(&fsd->fifo) > 0) {
+		send_data(pcb, fsd);
+		return;
+	}
+	FTPD_VFSV(fsm, FTPD_VOP_CLOSEDIR, vfs_closedir(fsd->vfs_dir));
+	fsd->vfs_dir = NULL;
+	ftpd_dataclose(pcb, fsd);
+	ftpd_data_done(fsm);
+	send_msg(msgpcb, fsm, msg226);
+}
+
+/*
+ * LIST, with the stat calls of up to FTPD_URING_LIST_BATCH entries in
+ * flight together. The batch is listed once the last of them is back.
+ */
+static void send_directory_batched(struct ftpd_datastate *fsd, struct tcp_pcb *pcb)
+{
+	struct ftpd_lsbatch *ls = fsd->ls;
+	char buffer[1024];
+	int len;
+
+	if (ls == NULL) {
+		ls = ftpd_alloc(fsd->msgfs->mem, sizeof(struct ftpd_lsbatch));
+		if (ls == NULL) {
+			send_next_directory(fsd, pcb, 0);
+			return;
+		}
+		memset(ls, 0, sizeof(struct ftpd_lsbatch));
+		ls->fsd = fsd;
+		ls->mem = fsd->msgfs->mem;
+		fsd->ls = ls;
+	}
+	if (ls->pending > 0) {
+		send_data(pcb, fsd);
+		return;
+	}
+	while (1) {
+		for (; ls->next < ls->count; ls->next++) {
+			struct ftpd_lsentry *e = &ls->e[ls->next];
+
+			len = format_list_line(buffer, sizeof(buffer), &e->st, e->fname);
+			if (len > 0 && sfifo_space(&fsd->fifo) < len) {
+				FTPD_TRACE_EVENT(fsd->msgfs, FTPD_EV_FIFO_FULL, sfifo_used(&fsd->fifo), 0);
+				send_data(pcb, fsd);
+				return;
+			}
+			if (len > 0)
+				sfifo_write(&fsd->fifo, buffer, len);
+		}
+
+		ls->count = 0;
+		ls->next = 0;
+		while (ls->count < FTPD_URING_LIST_BATCH) {
+			vfs_dirent_t *dirent = FTPD_VFSP(fsd->msgfs, FTPD_VOP_READDIR, vfs_readdir(fsd->vfs_dir));
+			struct ftpd_lsentry *e;
+
+			if (dirent == NULL)
+				break;
+			e = &ls->e[ls->count++];
+			snprintf(e->fname, sizeof(e->fname), "%s", dirent->name);
+			e->req.done = ftpd_ls_done;
+			e->batch = ls;
+			if (vfs_uring_statx(&e->req, vfs_dirfd(fsd->vfs_dir), e->fname, &e->stx) == 0)
+				ls->pending++;
+			else
+				FTPD_VFS(fsd->msgfs, FTPD_VOP_STAT, vfs_stat(fsd->msgfs->vfs, e->fname, &e->st));
+		}
+		if (ls->pending > 0) {
+			send_data(pcb, fsd);
+			return;
+		}
+		if (ls->count == 0)
+			break;
+	}
+	end_directory(fsd, pcb);
+}
+
+static void ftpd_ls_done(struct vfs_uring_req *req, int res)
+{
+	struct ftpd_lsentry *e = (struct ftpd_lsentry *) req;
+	struct ftpd_lsbatch *ls = e->batch;
+	struct ftpd_datastate *fsd = ls->fsd;
+	struct ftpd_msgstate *fsm;
+
+	/* Like vfs_stat(), which zeroes st when it fails */
+	memset(&e->st, 0, sizeof(e->st));
+	if (res == 0) {
+		e->st.st_mode = e->stx.stx_mode;
+		e->st.st_size = (off_t) e->stx.stx_size;
+		e->st.st_mtime = e->stx.stx_mtime.tv_sec;
+	}
+	if (--ls->pending > 0)
+		return;
+	if (fsd == NULL) {
+		ftpd_free(ls->mem, ls);
+		return;
+	}
+	fsm = fsd->msgfs;
+	ftpd_lat_resume(fsm);
+	send_directory_batched(fsd, fsd->pcb);
+	ftpd_lat_yield(fsm);
+}
+#endif
+
+/* Move a transfer along as far as TCP lets it. */
+static void send_transfer(struct ftpd_datastate *fsd, struct tcp_pcb *pcb)
+{
+	switch (fsd->state) {
 	case FTPD_LIST:
+#if FTPD_URING
+		send_directory_batched(fsd, pcb);
+#else
 		send_next_directory(fsd, pcb, 0);
+#endif
 		break;
 	case FTPD_NLST:
 		send_next_directory(fsd, pcb, 1);
@@ -586,54 +3373,310 @@ static err_t ftpd_datasent(void *arg, struct tcp_pcb *pcb, u16_t len)
 	case FTPD_RETR:
 		send_file(fsd, pcb);
 		break;
+#if FTPD_ZEROCOPY
+	case FTPD_STOR:
+		/* From now on the data goes from the socket to the file. */
+		if (fsd->zc == 0 && ftpd_zc_ok(fsd)
+		    && tcp_epoll_splice(pcb, vfs_fileno(fsd->vfs_file)) != ERR_OK)
+			fsd->zc = -1;
+		break;
+#endif
 	default:
 		break;
 	}
+}
+
+static err_t ftpd_datasent(void *arg, struct tcp_pcb *pcb, u16_t len)
+{
+	struct ftpd_datastate *fsd = arg;
+	struct ftpd_msgstate *fsm = fsd->msgfs;
+
+	ftpd_lat_resume(fsm);
+#ifdef FTPD_SEND_BYREF
+	if (fsd->unacked < len)
+		fsd->unacked = 0;
+	else
+		fsd->unacked -= len;
+#endif
+	send_transfer(fsd, pcb);
+	/* The transfer may have ended and freed fsd. */
+	ftpd_lat_yield(fsm);
 
 	return ERR_OK;
 }
 
+#if FTPD_URING
+static void ftpd_aio_write_done(struct vfs_uring_req *req, int res)
+{
+	struct ftpd_aio *aio = (struct ftpd_aio *) req;
+	struct ftpd_datastate *fsd = aio->fsd;
+	struct ftpd_msgstate *fsm;
+	struct tcp_pcb *msgpcb;
+	int len = aio->len;
+
+	if (fsd)
+		ftpd_aio_unlink(fsd, aio);
+	pbuf_free(aio->p);
+	ftpd_free(aio->mem, aio);
+	if (fsd == NULL)
+		return;
+	fsm = fsd->msgfs;
+	msgpcb = fsd->msgpcb;
+	ftpd_lat_resume(fsm);
+	/* A short write to a file means the disk is full. */
+	if (res != len) {
+		ftpd_aio_fail(fsd);
+		return;
+	}
+	/* Only now that it is on disk may the client send more. */
+	tcp_recved(fsd->pcb, (u16_t) len);
+	if (fsd->stordone && fsd->aio == NULL) {
+		FTPD_VFSV(fsm, FTPD_VOP_CLOSE, vfs_close_file(fsd->vfs_file));
+		fsd->vfs_file = NULL;
+		ftpd_dataclose(fsd->pcb, fsd);
+		ftpd_data_done(fsm);
+		send_msg(msgpcb, fsm, msg226);
+	}
+	ftpd_lat_yield(fsm);
+}
+
+/* Write the pbuf chain at the end of the file in the background. */
+static int ftpd_aio_write(struct ftpd_datastate *fsd, struct pbuf *p)
+{
+	struct ftpd_mem *mem = fsd->msgfs->mem;
+	struct ftpd_aio *aio;
+	struct pbuf *q;
+	int iovcnt = 0;
+
+	for (q = p; q != NULL; q = q->next)
+		iovcnt++;
+	aio = ftpd_alloc(mem, sizeof(struct ftpd_aio) + iovcnt * sizeof(struct iovec));
+	if (aio == NULL)
+		return -1;
+	memset(aio, 0, sizeof(struct ftpd_aio));
+	aio->req.done = ftpd_aio_write_done;
+	aio->fsd = fsd;
+	aio->mem = mem;
+	aio->p = p;
+	aio->len = p->tot_len;
+	for (q = p, iovcnt = 0; q != NULL; q = q->next, iovcnt++) {
+		aio->iov[iovcnt].iov_base = q->payload;
+		aio->iov[iovcnt].iov_len = q->len;
+	}
+	if (vfs_uring_writev(&aio->req, vfs_fileno(fsd->vfs_file), aio->iov, iovcnt, fsd->writepos) != 0) {
+		ftpd_free(mem, aio);
+		return -1;
+	}
+	fsd->writepos += p->tot_len;
+	aio->next = fsd->aio;
+	fsd->aio = aio;
+	return 0;
+}
+#endif
+
+/*
+ * STOR through the pipeline: push the segments of p into it, and write
+ * what comes out of it to the file by way of the FIFO, until nothing
+ * moves anymore. With p NULL, the upload is complete and the pipeline is
+ * drained. Returns -1 if the file can't be written.
+ */
+static int ftpd_recv_piped(struct ftpd_datastate *fsd, struct pbuf *p)
+{
+	struct ftpd_pipe *pipe = fsd->pipe;
+	struct pbuf *q = p;
+	int off = 0;
+
+	for (;;) {
+		char *buffer;
+		int moved = 0;
+		int len;
+
+		while (q != NULL) {
+			len = ftpd_pipe_push(pipe, (char *) q->payload + off, q->len - off);
+			moved += len;
+			off += len;
+			if (off < q->len)
+				break;
+			q = q->next;
+			off = 0;
+		}
+
+		len = sfifo_reserve_write(&fsd->fifo, &buffer);
+		len = ftpd_pipe_pull(pipe, buffer, len, p == NULL);
+		sfifo_commit_write(&fsd->fifo, len);
+		moved += len;
+
+		len = sfifo_peek_contiguous(&fsd->fifo, &buffer);
+		if (len > 0) {
+			if (FTPD_VFS(fsd->msgfs, FTPD_VOP_WRITE, vfs_write(buffer, 1, len, fsd->vfs_file)) != len)
+				return -1;
+			sfifo_commit_read(&fsd->fifo, len);
+			moved += len;
+		}
+		/* The last pull may have filled the FIFO exactly, in which case
+		   the pipeline only knows it is done after another one. */
+		if (p == NULL && ftpd_pipe_done(pipe) && sfifo_used(&fsd->fifo) == 0)
+			return 0;
+		if (moved == 0)
+			return p != NULL && q == NULL ? 0 : -1;
+	}
+}
+
 static err_t ftpd_datarecv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
 {
 	struct ftpd_datastate *fsd = arg;
-	if (err == ERR_OK && p != NULL) {
+
+	ftpd_lat_resume(fsd->msgfs);
+#if FTPD_ZEROCOPY
+	/* Data that came before the splice was set up keeps the rest of the
+	   transfer buffered, or it would land in the file out of order. */
+	if (p != NULL)
+		fsd->zc = -1;
+	if (err != ERR_OK && p == NULL && fsd->vfs_file) {
+		struct ftpd_msgstate *fsm = fsd->msgfs;
+		struct tcp_pcb *msgpcb = fsd->msgpcb;
+
+		ftpd_loge("ftpd_datarecv: error writing!");
+		ftpd_dataclose(pcb, fsd);
+		ftpd_data_done(fsm);
+		send_msg(msgpcb, fsm, msg451);
+		return ERR_OK;
+	}
+#endif
+#if FTPD_WRITEBACK
+	if (err == ERR_OK && p != NULL && fsd->wb) {
+		ftpd_wb_queue(fsd->wb, pcb, p);
+#if FTPD_WB_FLUSH_INLINE
+		/* Write some of the cache for every segment, and more if that is
+		   what it takes to make room for what is still pending. */
+		while (ftpd_wb_flush() && fsd->wb->pending)
+			ftpd_wb_fill(fsd->wb);
+#endif
+		ftpd_lat_yield(fsd->msgfs);
+		return ERR_OK;
+	}
+#endif
+#if FTPD_URING
+	if (err == ERR_OK && p != NULL && fsd->vfs_file && !fsd->pipe && ftpd_aio_write(fsd, p) == 0) {
+		ftpd_lat_yield(fsd->msgfs);
+		return ERR_OK;
+	}
+#endif
+	if (err == ERR_OK && p != NULL && fsd->pipe) {
+		if (ftpd_recv_piped(fsd, p) != 0) {
+			struct ftpd_msgstate *fsm = fsd->msgfs;
+			struct tcp_pcb *msgpcb = fsd->msgpcb;
+
+			ftpd_loge("ftpd_datarecv: error writing!");
+			pbuf_free(p);
+			ftpd_dataclose(pcb, fsd);
+			ftpd_data_done(fsm);
+			send_msg(msgpcb, fsm, msg451);
+			return ERR_OK;
+		}
+		tcp_recved(pcb, p->tot_len);
+		pbuf_free(p);
+		ftpd_lat_yield(fsd->msgfs);
+	} else if (err == ERR_OK && p != NULL) {
+		vfs_iovec_t iov[FTPD_WRITEV_MAX];
 		struct pbuf *q;
 		u16_t tot_len = 0;
+		int iovcnt = 0;
+		int want = 0;
 
-		for (q = p; q != NULL; q = q->next) {
-			int len;
+#if FTPD_URING
+		/* The ring is full. Write where the data belongs, which is not
+		   where the last blocking write left the file position. */
+		FTPD_VFS(fsd->msgfs, FTPD_VOP_SEEK, vfs_seek(fsd->vfs_file, fsd->writepos));
+#endif
 
-			len = vfs_write(q->payload, 1, q->len, fsd->vfs_file);
-			tot_len += len;
-			if (len != q->len)
-				break;
+		/* Hand the chain to the VFS in as few calls as possible. */
+		for (q = p; q != NULL; q = q->next) {
+			iov[iovcnt].base = q->payload;
+			iov[iovcnt].len = q->len;
+			iovcnt++;
+			want += q->len;
+			if (iovcnt == FTPD_WRITEV_MAX || q->next == NULL) {
+				int len;
+
+				len = FTPD_VFS(fsd->msgfs, FTPD_VOP_WRITE, vfs_writev(fsd->vfs_file, iov, iovcnt));
+				tot_len += len;
+				if (len != want)
+					break;
+				iovcnt = 0;
+				want = 0;
+			}
 		}
 
+		/* What wasn't written can't be acknowledged either, and the
+		   window would never open again. */
+		if (tot_len != p->tot_len) {
+			struct ftpd_msgstate *fsm = fsd->msgfs;
+			struct tcp_pcb *msgpcb = fsd->msgpcb;
+
+			ftpd_loge("ftpd_datarecv: error writing!");
+			pbuf_free(p);
+			ftpd_dataclose(pcb, fsd);
+			ftpd_data_done(fsm);
+			send_msg(msgpcb, fsm, msg451);
+			return ERR_OK;
+		}
+#if FTPD_URING
+		fsd->writepos += tot_len;
+#endif
 		/* Inform TCP that we have taken the data. */
 		tcp_recved(pcb, tot_len);
 
 		pbuf_free(p);
+		ftpd_lat_yield(fsd->msgfs);
 	}
 	if (err == ERR_OK && p == NULL) {
 		struct ftpd_msgstate *fsm;
 		struct tcp_pcb *msgpcb;
-		void* old_datafs;
 
 		fsm = fsd->msgfs;
 		msgpcb = fsd->msgpcb;
-		old_datafs = fsm->datafs;
 
-		vfs_close_file(fsd->vfs_file);
+		/* The client gave up on a connection that no transfer has
+		   claimed, e.g. after STOR was refused. */
+		if (fsd->state == FTPD_IDLE) {
+			ftpd_dataclose(pcb, fsd);
+			return ERR_OK;
+		}
+#if FTPD_WRITEBACK
+		if (fsd->wb) {
+			struct ftpd_wbfile *wb = fsd->wb;
+
+			fsd->wb = NULL;
+			ftpd_dataclose(pcb, fsd);
+			ftpd_data_done(fsm);
+			if (FTPD_WB_DURABLE) {
+				ftpd_wb_close(wb, fsm, msgpcb);
+			} else {
+				ftpd_wb_close(wb, NULL, NULL);
+				send_msg(msgpcb, fsm, msg226);
+			}
+			return ERR_OK;
+		}
+#endif
+#if FTPD_URING
+		/* The last write to complete ends the transfer. */
+		if (fsd->aio) {
+			fsd->stordone = 1;
+			return ERR_OK;
+		}
+#endif
+		if (fsd->pipe && ftpd_recv_piped(fsd, NULL) != 0) {
+			ftpd_loge("ftpd_datarecv: error writing!");
+			ftpd_dataclose(pcb, fsd);
+			ftpd_data_done(fsm);
+			send_msg(msgpcb, fsm, msg451);
+			return ERR_OK;
+		}
+		FTPD_VFSV(fsm, FTPD_VOP_CLOSE, vfs_close_file(fsd->vfs_file));
 		fsd->vfs_file = NULL;
 		ftpd_dataclose(pcb, fsd);
-		if (pcb == fsm->datapcb && fsd == old_datafs) {
-			fsm->datapcb = NULL;
-			fsm->state = FTPD_IDLE;
-		} else {
-			ftpd_logw("data connection closed in ftpd_datarecv but it is different "
-				"from the one in fsm: pcb=%p, fsm->datapcb=%p; fsd=%p, fsm->datafs=%p",
-				pcb, fsm->datapcb, fsd, fsm->datafs);
-		}
+		ftpd_data_done(fsm);
 		send_msg(msgpcb, fsm, msg226);
 	}
 	return ERR_OK;
@@ -642,8 +3685,10 @@ static err_t ftpd_datarecv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t
 static err_t ftpd_dataconnected(void *arg, struct tcp_pcb *pcb, err_t err)
 {
 	struct ftpd_datastate *fsd = arg;
-	fsd->msgfs->datapcb = pcb;
+	struct ftpd_msgstate *fsm = fsd->msgfs;
+	fsd->pcb = pcb;
 	fsd->connected = 1;
+	FTPD_TRACE_EVENT(fsm, FTPD_EV_DATA_CONNECT, 0, 0);
 
 	/* Tell TCP that we wish to be informed of incoming data by a call
 	   to the http_recv() function. */
@@ -654,28 +3699,22 @@ static err_t ftpd_dataconnected(void *arg, struct tcp_pcb *pcb, err_t err)
 	tcp_sent(pcb, ftpd_datasent);
 
 	tcp_err(pcb, ftpd_dataerr);
-	switch (fsd->msgfs->state) {
-	case FTPD_LIST:
-		send_next_directory(fsd, pcb, 0);
-		break;
-	case FTPD_NLST:
-		send_next_directory(fsd, pcb, 1);
-		break;
-	case FTPD_RETR:
-		send_file(fsd, pcb);
-		break;
-	default:
-		break;
-	}
+	ftpd_lat_resume(fsm);
+	send_transfer(fsd, pcb);
+	ftpd_lat_yield(fsm);
 	return ERR_OK;
 }
 
 static err_t ftpd_dataaccept(void *arg, struct tcp_pcb *pcb, err_t err)
 {
 	struct ftpd_datastate *fsd = arg;
+	struct ftpd_msgstate *fsm = fsd->msgfs;
 
-	fsd->msgfs->datapcb = pcb;
+	fsd->pcb = pcb;
 	fsd->connected = 1;
+	FTPD_TRACE_EVENT(fsm, FTPD_EV_DATA_ACCEPT, 0, 0);
+	/* One connection per PASV. */
+	ftpd_data_unlisten(fsd);
 
 	/* Tell TCP that we wish to be informed of incoming data by a call
 	   to the http_recv() function. */
@@ -687,65 +3726,99 @@ static err_t ftpd_dataaccept(void *arg, struct tcp_pcb *pcb, err_t err)
 
 	tcp_err(pcb, ftpd_dataerr);
 
-	switch (fsd->msgfs->state) {
-	case FTPD_LIST:
-		send_next_directory(fsd, pcb, 0);
-		break;
-	case FTPD_NLST:
-		send_next_directory(fsd, pcb, 1);
-		break;
-	case FTPD_RETR:
-		send_file(fsd, pcb);
-		break;
-	default:
-		break;
-	}
+	ftpd_lat_resume(fsm);
+	send_transfer(fsd, pcb);
+	ftpd_lat_yield(fsm);
 
 	return ERR_OK;
 }
 
-static int open_dataconnection(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+/*
+ * Set up the state of a data connection for the next transfer command.
+ * One that no transfer has claimed yet is replaced.
+ */
+static struct ftpd_datastate *ftpd_data_new(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
-	if (fsm->passive)
-		return 0;
+	struct ftpd_datastate *fsd;
+	int n = 0;
+
+	if (fsm->datafs)
+		ftpd_dataclose(fsm->datafs->pcb, fsm->datafs);
+	for (fsd = fsm->data; fsd; fsd = fsd->next)
+		n++;
+	if (n >= FTPD_DATA_CONNS) {
+		send_msg(pcb, fsm, msg425);
+		return NULL;
+	}
 
 	/* Allocate memory for the structure that holds the state of the
 	   connection. */
-	fsm->datafs = malloc(sizeof(struct ftpd_datastate));
+	fsd = ftpd_alloc(fsm->mem, sizeof(struct ftpd_datastate));
 
-	if (fsm->datafs == NULL) {
-		ftpd_loge("open_dataconnection: Out of memory");
+	if (fsd == NULL) {
+		ftpd_loge("ftpd_data_new: Out of memory");
 		send_msg(pcb, fsm, msg451);
-		return 1;
+		return NULL;
 	}
-	memset(fsm->datafs, 0, sizeof(struct ftpd_datastate));
-	fsm->datafs->msgfs = fsm;
-	fsm->datafs->msgpcb = pcb;
+	memset(fsd, 0, sizeof(struct ftpd_datastate));
+	fsd->state = FTPD_IDLE;
+	fsd->msgfs = fsm;
+	fsd->msgpcb = pcb;
 
-	if (sfifo_init(&fsm->datafs->fifo, 2000) != 0) {
-		free(fsm->datafs);
-		fsm->datafs = NULL;
+	if (sfifo_init(&fsd->fifo, FTPD_DATA_FIFO_SIZE, fsm->mem) != 0) {
+		ftpd_free(fsm->mem, fsd);
 		send_msg(pcb, fsm, msg451);
+		return NULL;
+	}
+	fsd->next = fsm->data;
+	fsm->data = fsd;
+	fsm->datafs = fsd;
+	return fsd;
+}
+
+/*
+ * The transfer command has set up fsm->datafs, which runs on its own from
+ * here. The next transfer needs a new PASV or PORT connection.
+ */
+static void ftpd_data_start(struct ftpd_msgstate *fsm, enum ftpd_state_e state)
+{
+	fsm->datafs->state = state;
+	fsm->datafs = NULL;
+	fsm->restart = 0;
+	fsm->rangeend = 0;
+	ftpd_set_state(fsm, state);
+}
+
+static int open_dataconnection(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	struct ftpd_datastate *fsd;
+
+	if (fsm->passive) {
+		if (fsm->datafs)
+			return 0;
+		send_msg(pcb, fsm, msg425);
 		return 1;
 	}
 
-	fsm->datapcb = tcp_new();
+	fsd = ftpd_data_new(pcb, fsm);
+	if (fsd == NULL)
+		return 1;
+
+	fsd->pcb = tcp_new();
 
-	if (fsm->datapcb == NULL) {
-		sfifo_close(&fsm->datafs->fifo);
-		free(fsm->datafs);
-		fsm->datafs = NULL;
+	if (fsd->pcb == NULL) {
+		ftpd_dataclose(NULL, fsd);
 		send_msg(pcb, fsm, msg451);
 		return 1;
 	}
 
 	/* Tell TCP that this is the structure we wish to be passed for our
 	   callbacks. */
-	tcp_arg(fsm->datapcb, fsm->datafs);
+	tcp_arg(fsd->pcb, fsd);
 	ip_addr_t dataip;
 	IP_SET_TYPE_VAL(dataip, IPADDR_TYPE_V4);
 	ip4_addr_copy(*ip_2_ip4(&dataip), fsm->dataip);
-	tcp_connect(fsm->datapcb, &dataip, fsm->dataport, ftpd_dataconnected);
+	tcp_connect(fsd->pcb, &dataip, fsm->dataport, ftpd_dataconnected);
 
 	return 0;
 }
@@ -753,7 +3826,7 @@ static int open_dataconnection(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 static void cmd_user(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
 	send_msg(pcb, fsm, msg331);
-	fsm->state = FTPD_PASS;
+	ftpd_set_state(fsm, FTPD_PASS);
 	/*
 	   send_msg(pcb, fs, msgLoginFailed);
 	   fs->state = FTPD_QUIT;
@@ -763,7 +3836,7 @@ static void cmd_user(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 static void cmd_pass(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
 	send_msg(pcb, fsm, msg230);
-	fsm->state = FTPD_IDLE;
+	ftpd_set_state(fsm, FTPD_IDLE);
 	/*
 	   send_msg(pcb, fs, msgLoginFailed);
 	   fs->state = FTPD_QUIT;
@@ -782,6 +3855,7 @@ static void cmd_port(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 	} else {
 		IP4_ADDR(&fsm->dataip, (u8_t) ip[0], (u8_t) ip[1], (u8_t) ip[2], (u8_t) ip[3]);
 		fsm->dataport = ((u16_t) pHi << 8) | (u16_t) pLo;
+		fsm->passive = 0;
 		send_msg(pcb, fsm, msg200);
 	}
 }
@@ -789,12 +3863,12 @@ static void cmd_port(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 static void cmd_quit(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
 	send_msg(pcb, fsm, msg221);
-	fsm->state = FTPD_QUIT;
+	ftpd_set_state(fsm, FTPD_QUIT);
 }
 
 static void cmd_cwd(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
-	if (!vfs_chdir(fsm->vfs, arg)) {
+	if (!FTPD_VFS(fsm, FTPD_VOP_CHDIR, vfs_chdir(fsm->vfs, arg))) {
 		send_msg(pcb, fsm, msg250);
 	} else {
 		send_msg(pcb, fsm, msg550);
@@ -803,7 +3877,7 @@ static void cmd_cwd(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *
 
 static void cmd_cdup(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
-	if (!vfs_chdir(fsm->vfs, "..")) {
+	if (!FTPD_VFS(fsm, FTPD_VOP_CHDIR, vfs_chdir(fsm->vfs, ".."))) {
 		send_msg(pcb, fsm, msg250);
 	} else {
 		send_msg(pcb, fsm, msg550);
@@ -814,9 +3888,9 @@ static void cmd_pwd(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *
 {
 	char *path;
 
-	if ((path = vfs_getcwd(fsm->vfs, NULL, 0))) {
+	if ((path = FTPD_VFSP(fsm, FTPD_VOP_GETCWD, vfs_getcwd(fsm->vfs, NULL, 0)))) {
 		send_msg(pcb, fsm, msg257PWD, path);
-		free(path);
+		ftpd_free(fsm->mem, path);
 	}
 }
 
@@ -825,13 +3899,13 @@ static void cmd_list_common(const char *arg, struct tcp_pcb *pcb, struct ftpd_ms
 	vfs_dir_t *vfs_dir;
 	char *cwd;
 
-	cwd = vfs_getcwd(fsm->vfs, NULL, 0);
+	cwd = FTPD_VFSP(fsm, FTPD_VOP_GETCWD, vfs_getcwd(fsm->vfs, NULL, 0));
 	if ((!cwd)) {
 		send_msg(pcb, fsm, msg451);
 		return;
 	}
-	vfs_dir = vfs_opendir(fsm->vfs, cwd);
-	free(cwd);
+	vfs_dir = FTPD_VFSP(fsm, FTPD_VOP_OPENDIR, vfs_opendir(fsm->vfs, cwd));
+	ftpd_free(fsm->mem, cwd);
 	if (!vfs_dir) {
 
 		send_msg(pcb, fsm, msg451);
@@ -839,7 +3913,7 @@ static void cmd_list_common(const char *arg, struct tcp_pcb *pcb, struct ftpd_ms
 	}
 
 	if (open_dataconnection(pcb, fsm) != 0) {
-		vfs_closedir(vfs_dir);
+		FTPD_VFSV(fsm, FTPD_VOP_CLOSEDIR, vfs_closedir(vfs_dir));
 		return;
 	}
 
@@ -852,9 +3926,9 @@ static void cmd_list_common(const char *arg, struct tcp_pcb *pcb, struct ftpd_ms
 	fsm->datafs->vfs_dir = vfs_dir;
 	fsm->datafs->vfs_dirent = NULL;
 	if (shortlist != 0)
-		fsm->state = FTPD_NLST;
+		ftpd_data_start(fsm, FTPD_NLST);
 	else
-		fsm->state = FTPD_LIST;
+		ftpd_data_start(fsm, FTPD_LIST);
 
 	send_msg(pcb, fsm, msg150);
 }
@@ -869,50 +3943,254 @@ static void cmd_list(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 	cmd_list_common(arg, pcb, fsm, 0);
 }
 
+/* Start the download at the offset from REST or RANG and end it with the range. */
+static int retr_range(struct ftpd_msgstate *fsm, struct ftpd_datastate *fsd)
+{
+	fsd->readpos = fsm->restart;
+	fsd->readend = fsm->rangeend;
+#ifdef FTPD_SEND_BYREF
+	fsd->mapend = fsd->maplen;
+	if (fsd->map) {
+		if (fsd->readend > 0 && fsd->readend < fsd->mapend)
+			fsd->mapend = fsd->readend;
+		fsd->mappos = fsd->readpos < fsd->mapend ? fsd->readpos : fsd->mapend;
+		return 0;
+	}
+#endif
+	if (fsd->readpos == 0 && fsd->readend == 0)
+		return 0;
+	/* Reads no longer start at offset 0, or stop short of the end. */
+	fsd->align = 1;
+	if (fsd->readpos > 0 && fsd->vfs_file
+	    && FTPD_VFS(fsm, FTPD_VOP_SEEK, vfs_seek(fsd->vfs_file, fsd->readpos)) != 0)
+		return -1;
+	return 0;
+}
+
 static void cmd_retr(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
-	vfs_file_t *vfs_file;
+	vfs_file_t *vfs_file = NULL;
 	vfs_stat_t st;
+	vfs_io_hints_t hints;
+#if FTPD_FILE_CACHE || FTPD_CONTENT_CACHE || FTPD_SHARED_READ
+	char *path;
+#endif
+#if FTPD_FILE_CACHE
+	struct ftpd_fcfile *fc = NULL;
+#endif
+#if FTPD_CONTENT_CACHE
+	struct ftpd_ccfile *cc;
+#endif
+#if FTPD_SHARED_READ
+	struct ftpd_sreader *sr = NULL;
+#endif
 
-	vfs_stat(fsm->vfs, arg, &st);
-	if (!VFS_ISREG(st.st_mode)) {
+	if (FTPD_VFS(fsm, FTPD_VOP_STAT, vfs_stat(fsm->vfs, arg, &st)) != 0 || !VFS_ISREG(st.st_mode)) {
+		send_msg(pcb, fsm, msg550);
+		return;
+	}
+	if (fsm->restart > (size_t) st.st_size) {
+		fsm->restart = 0;
+		fsm->rangeend = 0;
+		send_msg(pcb, fsm, msg554);
+		return;
+	}
+#if FTPD_FILE_CACHE || FTPD_CONTENT_CACHE || FTPD_SHARED_READ
+	path = ftpd_abspath(fsm, arg);
+#endif
+#if FTPD_CONTENT_CACHE
+	cc = path && !ftpd_pipe_wanted(fsm) ? ftpd_cc_get(path, &st) : NULL;
+	if (!cc) {
+#endif
+#if FTPD_SHARED_READ
+	/* Ranges and converted transfers are read on their own. */
+	sr = path && !fsm->restart && !fsm->rangeend && !ftpd_pipe_wanted(fsm) ? ftpd_sr_open(fsm, arg, path, &st) : NULL;
+	if (!sr) {
+#endif
+#if FTPD_FILE_CACHE
+	fc = path ? ftpd_fc_get(path, &st) : NULL;
+	vfs_file = fc ? fc->vfs_file : FTPD_VFSP_SHARED(fsm, FTPD_VOP_OPEN, vfs_open(fsm->vfs, arg, "rb"));
+	if (vfs_file && !fc && path)
+		fc = ftpd_fc_put(path, vfs_file, &st);
+#else
+	vfs_file = FTPD_VFSP(fsm, FTPD_VOP_OPEN, vfs_open(fsm->vfs, arg, "rb"));
+#endif
+	if (!vfs_file) {
+#if FTPD_FILE_CACHE || FTPD_CONTENT_CACHE || FTPD_SHARED_READ
+		ftpd_free(fsm->mem, path);
+#endif
+		send_msg(pcb, fsm, msg550);
+		return;
+	}
+#if FTPD_SHARED_READ
+	}
+#endif
+#if FTPD_CONTENT_CACHE
+	}
+#endif
+
+	send_msg(pcb, fsm, msg150recv, fsm->ascii ? "ASCII" : "BINARY", arg, st.st_size);
+
+	if (open_dataconnection(pcb, fsm) != 0) {
+#if FTPD_CONTENT_CACHE
+		if (cc)
+			ftpd_cc_release(cc);
+		else
+#endif
+#if FTPD_SHARED_READ
+		if (sr)
+			ftpd_sr_put(sr);
+		else
+#endif
+#if FTPD_FILE_CACHE
+		if (fc)
+			ftpd_fc_release(fc);
+		else
+#endif
+		FTPD_VFSV(fsm, FTPD_VOP_CLOSE, vfs_close_file(vfs_file));
+#if FTPD_FILE_CACHE || FTPD_CONTENT_CACHE || FTPD_SHARED_READ
+		ftpd_free(fsm->mem, path);
+#endif
+		return;
+	}
+
+	fsm->datafs->vfs_file = vfs_file;
+#if FTPD_FILE_CACHE
+	fsm->datafs->fc = fc;
+#endif
+#if FTPD_CONTENT_CACHE
+	/* Small files are read into RAM now and sent from there, this time
+	   and until they change. */
+	if (!cc && vfs_file && path && !fsm->restart && !fsm->rangeend && !ftpd_pipe_wanted(fsm)
+	    && (cc = ftpd_cc_fill(path, vfs_file, &st)) != NULL)
+		close_retr_file(fsm->datafs);
+	if (cc) {
+		fsm->datafs->cc = cc;
+		fsm->datafs->map = cc->data;
+		fsm->datafs->maplen = cc->size;
+	}
+#endif
+#if FTPD_SHARED_READ
+	if (sr)
+		ftpd_sr_add(sr, fsm->datafs);
+#endif
+#if FTPD_FILE_CACHE || FTPD_CONTENT_CACHE || FTPD_SHARED_READ
+	ftpd_free(fsm->mem, path);
+#endif
+	/* With FTPD_URING the file is read through the ring instead, and
+	   with FTPD_ZEROCOPY sent with sendfile(); page faults on a mapping
+	   would stall the event loop. */
+#if defined(VFS_HAVE_MAP) && !FTPD_URING && !FTPD_ZEROCOPY
+	if (fsm->datafs->vfs_file && !ftpd_pipe_wanted(fsm))
+		fsm->datafs->map = FTPD_VFSP(fsm, FTPD_VOP_MAP, vfs_map(vfs_file, &fsm->datafs->maplen));
+#endif
+	FTPD_VFSV(fsm, FTPD_VOP_IO_HINTS, vfs_io_hints(fsm->vfs, arg, &hints));
+	set_io_hints(fsm->datafs, &hints);
+	if (ftpd_pipe_setup(fsm, fsm->datafs, 1) != 0 || retr_range(fsm, fsm->datafs) != 0) {
+		ftpd_dataclose(fsm->datafs->pcb, fsm->datafs);
+		send_msg(pcb, fsm, msg451);
+		return;
+	}
+	ftpd_data_start(fsm, FTPD_RETR);
+}
+
+static void cmd_stor(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	vfs_file_t *vfs_file;
+#if FTPD_WRITEBACK
+	vfs_io_hints_t hints;
+#endif
+	/* Uploads always start from scratch. */
+	if (fsm->restart || fsm->rangeend) {
+		fsm->restart = 0;
+		fsm->rangeend = 0;
+		send_msg(pcb, fsm, msg504);
+		return;
+	}
+#if FTPD_FILE_CACHE || FTPD_CONTENT_CACHE || FTPD_SHARED_READ
+	ftpd_path_changing(fsm, arg);
+#endif
+#if FTPD_WRITEBACK
+	/* The flusher may close the file after the session has gone */
+	vfs_file = FTPD_VFSP_SHARED(fsm, FTPD_VOP_OPEN, vfs_open(fsm->vfs, arg, "wb"));
+#else
+	vfs_file = FTPD_VFSP(fsm, FTPD_VOP_OPEN, vfs_open(fsm->vfs, arg, "wb"));
+#endif
+	if (!vfs_file) {
 		send_msg(pcb, fsm, msg550);
 		return;
 	}
-	vfs_file = vfs_open(fsm->vfs, arg, "rb");
-	if (!vfs_file) {
-		send_msg(pcb, fsm, msg550);
+
+	send_msg(pcb, fsm, msg150stor, fsm->ascii ? "ASCII" : "BINARY", arg);
+	if (open_dataconnection(pcb, fsm) != 0) {
+		FTPD_VFSV(fsm, FTPD_VOP_CLOSE, vfs_close_file(vfs_file));
+		return;
+	}
+
+#if FTPD_WRITEBACK
+	/* Without a free cache slot, write through as usual. */
+	FTPD_VFSV(fsm, FTPD_VOP_IO_HINTS, vfs_io_hints(fsm->vfs, arg, &hints));
+	/* Converted data goes through the pipeline, so it writes through. */
+	fsm->datafs->wb = ftpd_pipe_wanted(fsm) ? NULL : ftpd_wb_open(vfs_file, &hints);
+	if (!fsm->datafs->wb)
+#endif
+	fsm->datafs->vfs_file = vfs_file;
+	if (ftpd_pipe_setup(fsm, fsm->datafs, 0) != 0) {
+		ftpd_dataclose(fsm->datafs->pcb, fsm->datafs);
+		send_msg(pcb, fsm, msg451);
+		return;
+	}
+#if FTPD_ZEROCOPY
+	/* A data connection that is already up won't call
+	   send_transfer() before the first data arrives. */
+	if (fsm->datafs->connected) {
+		struct ftpd_datastate *fsd = fsm->datafs;
+
+		ftpd_data_start(fsm, FTPD_STOR);
+		send_transfer(fsd, fsd->pcb);
 		return;
 	}
+#endif
+	ftpd_data_start(fsm, FTPD_STOR);
+}
 
-	send_msg(pcb, fsm, msg150recv, arg, st.st_size);
+static void cmd_rest(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	unsigned long offset;
+	int n;
 
-	if (open_dataconnection(pcb, fsm) != 0) {
-		vfs_close_file(vfs_file);
+	if (!isdigit((unsigned char) arg[0]) || sscanf(arg, "%lu%n", &offset, &n) != 1 || arg[n] != '\0') {
+		send_msg(pcb, fsm, msg501);
 		return;
 	}
-
-	fsm->datafs->vfs_file = vfs_file;
-	fsm->state = FTPD_RETR;
+	fsm->restart = offset;
+	fsm->rangeend = 0;
+	send_msg(pcb, fsm, msg350rest, offset);
 }
 
-static void cmd_stor(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+/* RANG start end, with an inclusive end; "RANG 1 0" drops the range. */
+static void cmd_rang(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
-	vfs_file_t *vfs_file;
-	vfs_file = vfs_open(fsm->vfs, arg, "wb");
-	if (!vfs_file) {
-		send_msg(pcb, fsm, msg550);
+	unsigned long start, end;
+	int n;
+
+	if (!isdigit((unsigned char) arg[0]) || sscanf(arg, "%lu %lu%n", &start, &end, &n) != 2 || arg[n] != '\0') {
+		send_msg(pcb, fsm, msg501);
 		return;
 	}
-
-	send_msg(pcb, fsm, msg150stor, arg);
-	if (open_dataconnection(pcb, fsm) != 0) {
-		vfs_close_file(vfs_file);
+	if (start == 1 && end == 0) {
+		fsm->restart = 0;
+		fsm->rangeend = 0;
+		send_msg(pcb, fsm, msg350rang0);
 		return;
 	}
-
-	fsm->datafs->vfs_file = vfs_file;
-	fsm->state = FTPD_STOR;
+	if (end < start) {
+		send_msg(pcb, fsm, msg501);
+		return;
+	}
+	fsm->restart = start;
+	fsm->rangeend = (size_t) end + 1;
+	send_msg(pcb, fsm, msg350rang, start, end);
 }
 
 static void cmd_noop(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
@@ -929,32 +4207,17 @@ static void cmd_pasv(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 {
 	static u16_t port = 4096;
 	static u16_t start_port = 4096;
+	struct ftpd_datastate *fsd;
 	struct tcp_pcb *temppcb;
 
-	/* Allocate memory for the structure that holds the state of the
-	   connection. */
-	fsm->datafs = malloc(sizeof(struct ftpd_datastate));
-
-	if (fsm->datafs == NULL) {
-		ftpd_loge("cmd_pasv: Out of memory");
-		send_msg(pcb, fsm, msg451);
-		return;
-	}
-	memset(fsm->datafs, 0, sizeof(struct ftpd_datastate));
-
-	if (sfifo_init(&fsm->datafs->fifo, 2000) != 0) {
-		free(fsm->datafs);
-		fsm->datafs = NULL;
-		send_msg(pcb, fsm, msg451);
+	fsd = ftpd_data_new(pcb, fsm);
+	if (fsd == NULL)
 		return;
-	}
 
-	fsm->datalistenpcb = tcp_new();
+	fsd->listenpcb = tcp_new();
 
-	if (fsm->datalistenpcb == NULL) {
-		sfifo_close(&fsm->datafs->fifo);
-		free(fsm->datafs);
-		fsm->datafs = NULL;
+	if (fsd->listenpcb == NULL) {
+		ftpd_dataclose(NULL, fsd);
 		send_msg(pcb, fsm, msg451);
 		return;
 	}
@@ -968,7 +4231,7 @@ static void cmd_pasv(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 			port = 4096;
 
 		fsm->dataport = port;
-		err = tcp_bind(fsm->datalistenpcb, (ip_addr_t*)&pcb->local_ip, fsm->dataport);
+		err = tcp_bind(fsd->listenpcb, (ip_addr_t*)&pcb->local_ip, fsm->dataport);
 		if (err == ERR_OK)
 			break;
 		if (start_port == port)
@@ -976,51 +4239,55 @@ static void cmd_pasv(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 		if (err == ERR_USE) {
 			continue;
 		} else {
-			ftpd_dataclose(fsm->datalistenpcb, fsm->datafs);
-			fsm->datalistenpcb = NULL;
+			ftpd_dataclose(NULL, fsd);
+			send_msg(pcb, fsm, msg425);
 			return;
 		}
 	}
 
-	temppcb = tcp_listen(fsm->datalistenpcb);
+	temppcb = tcp_listen(fsd->listenpcb);
 	if (!temppcb) {
 		ftpd_loge("cmd_pasv: tcp_listen failed");
-		ftpd_dataclose(fsm->datalistenpcb, fsm->datafs);
-		fsm->datalistenpcb = NULL;
+		ftpd_dataclose(NULL, fsd);
+		send_msg(pcb, fsm, msg425);
 		return;
 	}
-	fsm->datalistenpcb = temppcb;
+	fsd->listenpcb = temppcb;
 
 	fsm->passive = 1;
-	fsm->datafs->connected = 0;
-	fsm->datafs->msgfs = fsm;
-	fsm->datafs->msgpcb = pcb;
 
 	/* Tell TCP that this is the structure we wish to be passed for our
 	   callbacks. */
-	tcp_arg(fsm->datalistenpcb, fsm->datafs);
-	tcp_accept(fsm->datalistenpcb, ftpd_dataaccept);
+	tcp_arg(fsd->listenpcb, fsd);
+	tcp_accept(fsd->listenpcb, ftpd_dataaccept);
 	send_msg(pcb, fsm, msg227, ip4_addr1(ip_2_ip4(&pcb->local_ip)), ip4_addr2(ip_2_ip4(&pcb->local_ip)), ip4_addr3(ip_2_ip4(&pcb->local_ip)), ip4_addr4(ip_2_ip4(&pcb->local_ip)), (fsm->dataport >> 8) & 0xff, (fsm->dataport) & 0xff);
 }
 
 static void cmd_abrt(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
-	if (fsm->datafs != NULL) {
-		tcp_arg(fsm->datapcb, NULL);
-		tcp_sent(fsm->datapcb, NULL);
-		tcp_recv(fsm->datapcb, NULL);
-		tcp_abort(pcb);
-		sfifo_close(&fsm->datafs->fifo);
-		free(fsm->datafs);
-		fsm->datafs = NULL;
+	int aborted = 0;
+
+	/* Every transfer of the session goes. */
+	while (fsm->data) {
+		if (fsm->data->state != FTPD_IDLE)
+			aborted = 1;
+		ftpd_dataclose(fsm->data->pcb, fsm->data);
 	}
-	fsm->state = FTPD_IDLE;
+	ftpd_set_state(fsm, FTPD_IDLE);
+	if (aborted)
+		send_msg(pcb, fsm, msg426);
+	send_msg(pcb, fsm, msg226);
 }
 
 static void cmd_type(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
-	if(strcmp(arg, "I") != 0) {
-		send_msg(pcb, fsm, msg502);
+	/* A N and L 8 are the same as A and I. */
+	if (!strcmp(arg, "A") || !strcmp(arg, "A N")) {
+		fsm->ascii = 1;
+	} else if (!strcmp(arg, "I") || !strcmp(arg, "L 8")) {
+		fsm->ascii = 0;
+	} else {
+		send_msg(pcb, fsm, msg504);
 		return;
 	}
 	
@@ -1043,15 +4310,15 @@ static void cmd_rnfr(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 		return;
 	}
 	if (fsm->renamefrom)
-		free(fsm->renamefrom);
-	fsm->renamefrom = malloc(strlen(arg) + 1);
+		ftpd_free(fsm->mem, fsm->renamefrom);
+	fsm->renamefrom = ftpd_alloc(fsm->mem, strlen(arg) + 1);
 	if (fsm->renamefrom == NULL) {
 		ftpd_loge("cmd_rnfr: Out of memory");
 		send_msg(pcb, fsm, msg451);
 		return;
 	}
 	strcpy(fsm->renamefrom, arg);
-	fsm->state = FTPD_RNFR;
+	ftpd_set_state(fsm, FTPD_RNFR);
 	send_msg(pcb, fsm, msg350);
 }
 
@@ -1061,7 +4328,7 @@ static void cmd_rnto(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 		send_msg(pcb, fsm, msg503);
 		return;
 	}
-	fsm->state = FTPD_IDLE;
+	ftpd_set_state(fsm, FTPD_IDLE);
 	if (arg == NULL) {
 		send_msg(pcb, fsm, msg501);
 		return;
@@ -1070,7 +4337,11 @@ static void cmd_rnto(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 		send_msg(pcb, fsm, msg501);
 		return;
 	}
-	if (vfs_rename(fsm->vfs, fsm->renamefrom, arg)) {
+#if FTPD_FILE_CACHE || FTPD_CONTENT_CACHE || FTPD_SHARED_READ
+	ftpd_path_changing(fsm, fsm->renamefrom);
+	ftpd_path_changing(fsm, arg);
+#endif
+	if (FTPD_VFS(fsm, FTPD_VOP_RENAME, vfs_rename(fsm->vfs, fsm->renamefrom, arg))) {
 		send_msg(pcb, fsm, msg450);
 	} else {
 		send_msg(pcb, fsm, msg250);
@@ -1087,7 +4358,7 @@ static void cmd_mkd(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *
 		send_msg(pcb, fsm, msg501);
 		return;
 	}
-	if (vfs_mkdir(fsm->vfs, arg, VFS_IRWXU | VFS_IRWXG | VFS_IRWXO) != 0) {
+	if (FTPD_VFS(fsm, FTPD_VOP_MKDIR, vfs_mkdir(fsm->vfs, arg, VFS_IRWXU | VFS_IRWXG | VFS_IRWXO)) != 0) {
 		send_msg(pcb, fsm, msg550);
 	} else {
 		send_msg(pcb, fsm, msg257, arg);
@@ -1106,7 +4377,7 @@ static void cmd_rmd(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *
 		send_msg(pcb, fsm, msg501);
 		return;
 	}
-	if (vfs_stat(fsm->vfs, arg, &st) != 0) {
+	if (FTPD_VFS(fsm, FTPD_VOP_STAT, vfs_stat(fsm->vfs, arg, &st)) != 0) {
 		send_msg(pcb, fsm, msg550);
 		return;
 	}
@@ -1114,7 +4385,10 @@ static void cmd_rmd(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *
 		send_msg(pcb, fsm, msg550);
 		return;
 	}
-	if (vfs_rmdir(fsm->vfs, arg) != 0) {
+#if FTPD_FILE_CACHE || FTPD_CONTENT_CACHE || FTPD_SHARED_READ
+	ftpd_path_changing(fsm, arg);
+#endif
+	if (FTPD_VFS(fsm, FTPD_VOP_RMDIR, vfs_rmdir(fsm->vfs, arg)) != 0) {
 		send_msg(pcb, fsm, msg550);
 	} else {
 		send_msg(pcb, fsm, msg250);
@@ -1133,7 +4407,7 @@ static void cmd_dele(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 		send_msg(pcb, fsm, msg501);
 		return;
 	}
-	if (vfs_stat(fsm->vfs, arg, &st) != 0) {
+	if (FTPD_VFS(fsm, FTPD_VOP_STAT, vfs_stat(fsm->vfs, arg, &st)) != 0) {
 		send_msg(pcb, fsm, msg550);
 		return;
 	}
@@ -1141,7 +4415,10 @@ static void cmd_dele(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 		send_msg(pcb, fsm, msg550);
 		return;
 	}
-	if (vfs_remove(fsm->vfs, arg) != 0) {
+#if FTPD_FILE_CACHE || FTPD_CONTENT_CACHE || FTPD_SHARED_READ
+	ftpd_path_changing(fsm, arg);
+#endif
+	if (FTPD_VFS(fsm, FTPD_VOP_REMOVE, vfs_remove(fsm->vfs, arg)) != 0) {
 		send_msg(pcb, fsm, msg550);
 	} else {
 		send_msg(pcb, fsm, msg250);
@@ -1161,7 +4438,7 @@ static void cmd_mdtm(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 		send_msg(pcb, fsm, msg501);
 		return;
 	}
-	if (vfs_stat(fsm->vfs, arg, &st) != 0) {
+	if (FTPD_VFS(fsm, FTPD_VOP_STAT, vfs_stat(fsm->vfs, arg, &st)) != 0) {
 		send_msg(pcb, fsm, msg550);
 		return;
 	}
@@ -1185,7 +4462,7 @@ static void cmd_size(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 		send_msg(pcb, fsm, msg501);
 		return;
 	}
-	if (vfs_stat(fsm->vfs, arg, &st) != 0) {
+	if (FTPD_VFS(fsm, FTPD_VOP_STAT, vfs_stat(fsm->vfs, arg, &st)) != 0) {
 		send_msg(pcb, fsm, msg550);
 		return;
 	}
@@ -1193,6 +4470,165 @@ static void cmd_size(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate
 	send_msg(pcb, fsm, "213 %li", st.st_size);
 }
 
+#if FTPD_HASH_THREADS
+/*
+ * A checksum being computed. If the session ends first, fsm is cleared
+ * and the job cancelled, but the file stays open until the threads are
+ * through with it.
+ */
+struct ftpd_hash {
+	struct vfs_hash_job job;
+	struct ftpd_msgstate *fsm;
+	struct tcp_pcb *msgpcb;
+	struct ftpd_mem *mem;
+	vfs_file_t *vfs_file;
+	int xcrc;		/* reply like XCRC rather than HASH */
+	size_t start;
+	size_t len;
+	u32_t reported;		/* when progress was last sent */
+	char *path;
+	u32_t crcs[];		/* of each chunk */
+};
+
+/* Set once the threads are running and their completions are watched */
+static int ftpd_hash_up;
+
+static void ftpd_hash_done(struct vfs_hash_job *job, int res)
+{
+	struct ftpd_hash *h = (struct ftpd_hash *) job;
+	struct ftpd_msgstate *fsm = h->fsm;
+
+	FTPD_VFSV(fsm, FTPD_VOP_CLOSE, vfs_close_file(h->vfs_file));
+	if (fsm) {
+		fsm->hash = NULL;
+		ftpd_lat_resume(fsm);
+		if (res != 0)
+			send_msg(h->msgpcb, fsm, msg451);
+		else if (h->xcrc)
+			send_msg(h->msgpcb, fsm, "250 %08lX", (unsigned long) job->crc);
+		else
+			send_msg(h->msgpcb, fsm, "213 CRC32 %lu-%lu %08lx %s", (unsigned long) h->start,
+				 (unsigned long) (h->len > 0 ? h->start + h->len - 1 : h->start),
+				 (unsigned long) job->crc, h->path);
+		ftpd_lat_yield(fsm);
+	}
+	ftpd_free(h->mem, h->path);
+	ftpd_free(h->mem, h);
+}
+
+/* Let the client know that a long checksum is still going. */
+static void ftpd_hash_progress(struct ftpd_msgstate *fsm, struct tcp_pcb *pcb)
+{
+	struct ftpd_hash *h = fsm->hash;
+	unsigned long long done;
+	unsigned percent;
+	u32_t now = sys_now();
+
+	if (now - h->reported < FTPD_HASH_PROGRESS_MS || h->len == 0)
+		return;
+	h->reported = now;
+	done = vfs_hash_progress(&h->job);
+	percent = (unsigned) (done * 100 / h->len);
+	/* The code is part of the format, as send_msg() looks there to
+	   tell continuation lines from the final reply. */
+	if (h->xcrc)
+		send_msg(pcb, fsm, "250-CRC32 %u%% (%llu of %llu bytes)", percent, done,
+			 (unsigned long long) h->len);
+	else
+		send_msg(pcb, fsm, "213-CRC32 %u%% (%llu of %llu bytes)", percent, done,
+			 (unsigned long long) h->len);
+}
+
+/* The control connection is going away; don't reply on it. */
+static void ftpd_hash_forget(struct ftpd_msgstate *fsm)
+{
+	if (fsm->hash) {
+		fsm->hash->fsm = NULL;
+		vfs_hash_cancel(&fsm->hash->job);
+		fsm->hash = NULL;
+	}
+}
+
+static void cmd_hash_common(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm, int xcrc)
+{
+	struct ftpd_hash *h;
+	vfs_file_t *vfs_file;
+	vfs_stat_t st;
+	size_t start, end;
+	unsigned chunks;
+
+	/* Like a transfer, the checksum uses up the range. */
+	start = fsm->restart;
+	end = fsm->rangeend;
+	fsm->restart = 0;
+	fsm->rangeend = 0;
+	if (arg == NULL || *arg == '\0') {
+		send_msg(pcb, fsm, msg501);
+		return;
+	}
+	if (!ftpd_hash_up) {
+		send_msg(pcb, fsm, msg502);
+		return;
+	}
+	/* One at a time per session */
+	if (fsm->hash) {
+		send_msg(pcb, fsm, msg450);
+		return;
+	}
+	if (FTPD_VFS(fsm, FTPD_VOP_STAT, vfs_stat(fsm->vfs, arg, &st)) != 0 || !VFS_ISREG(st.st_mode)) {
+		send_msg(pcb, fsm, msg550);
+		return;
+	}
+	if (end == 0 || end > (size_t) st.st_size)
+		end = st.st_size;
+	if (start > end)
+		start = end;
+	vfs_file = FTPD_VFSP(fsm, FTPD_VOP_OPEN, vfs_open(fsm->vfs, arg, "rb"));
+	if (!vfs_file) {
+		send_msg(pcb, fsm, msg550);
+		return;
+	}
+
+	chunks = vfs_hash_chunks(end - start);
+	h = ftpd_alloc(fsm->mem, sizeof(struct ftpd_hash) + chunks * sizeof(u32_t));
+	if (h)
+		h->path = ftpd_strdup(fsm->mem, arg);
+	if (!h || !h->path) {
+		ftpd_free(fsm->mem, h);
+		FTPD_VFSV(fsm, FTPD_VOP_CLOSE, vfs_close_file(vfs_file));
+		send_msg(pcb, fsm, msg451);
+		return;
+	}
+	h->job.done = ftpd_hash_done;
+	h->fsm = fsm;
+	h->msgpcb = pcb;
+	h->mem = fsm->mem;
+	h->vfs_file = vfs_file;
+	h->xcrc = xcrc;
+	h->start = start;
+	h->len = end - start;
+	h->reported = sys_now();
+	if (vfs_hash_crc32(&h->job, vfs_fileno(vfs_file), start, end - start, h->crcs) != 0) {
+		ftpd_free(fsm->mem, h->path);
+		ftpd_free(fsm->mem, h);
+		FTPD_VFSV(fsm, FTPD_VOP_CLOSE, vfs_close_file(vfs_file));
+		send_msg(pcb, fsm, msg451);
+		return;
+	}
+	fsm->hash = h;
+}
+
+static void cmd_xcrc(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	cmd_hash_common(arg, pcb, fsm, 1);
+}
+
+static void cmd_hash(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	cmd_hash_common(arg, pcb, fsm, 0);
+}
+#endif
+
 struct ftpd_command {
 	char *cmd;
 	void (*func) (const char *arg, struct tcp_pcb * pcb, struct ftpd_msgstate * fsm);
@@ -1211,6 +4647,8 @@ static struct ftpd_command ftpd_commands[] = {
 	{"LIST", cmd_list},
 	{"RETR", cmd_retr},
 	{"STOR", cmd_stor},
+	{"REST", cmd_rest},
+	{"RANG", cmd_rang},
 	{"NOOP", cmd_noop},
 	{"SYST", cmd_syst},
 	{"ABOR", cmd_abrt},
@@ -1226,63 +4664,268 @@ static struct ftpd_command ftpd_commands[] = {
 	{"PASV", cmd_pasv},
 	{"MDTM", cmd_mdtm},
 	{"SIZE", cmd_size},
+#if FTPD_HASH_THREADS
+	{"XCRC", cmd_xcrc},
+	{"HASH", cmd_hash},
+#endif
+#if FTPD_LATENCY || FTPD_MEM_STATS
+	{"SITE", cmd_site},
+#endif
 	{NULL, NULL}
 };
 
-static void send_msgdata(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+#if FTPD_LATENCY
+struct ftpd_lathist {
+	u32_t count;
+	u32_t max;
+	u32_t buckets[FTPD_LAT_BUCKETS];
+};
+
+/* One set per entry of ftpd_commands[], in the same order. */
+static struct ftpd_lathist ftpd_lat[sizeof(ftpd_commands) / sizeof(ftpd_commands[0])][FTPD_LAT_KINDS];
+
+static void ftpd_lat_add(struct ftpd_lathist *h, u32_t us)
 {
-	err_t err;
-	u16_t len;
+	u32_t v = us;
+	int i;
 
-	if (sfifo_used(&fsm->fifo) > 0) {
-		int i;
+	for (i = 0; v > 1 && i < FTPD_LAT_BUCKETS - 1; i++)
+		v >>= 1;
+	h->buckets[i]++;
+	h->count++;
+	if (us > h->max)
+		h->max = us;
+}
 
-		/* We cannot send more data than space available in the send
-		   buffer. */
-		if (tcp_sndbuf(pcb) < sfifo_used(&fsm->fifo)) {
-			len = tcp_sndbuf(pcb);
-		} else {
-			len = (u16_t) sfifo_used(&fsm->fifo);
-		}
+/* Upper bound of the bucket holding the given percentile. */
+static u32_t ftpd_lat_percentile(const struct ftpd_lathist *h, int pct)
+{
+	u32_t rank = (u32_t) (((unsigned long long) h->count * pct + 99) / 100);
+	u32_t seen = 0;
+	int i;
 
-		i = fsm->fifo.readpos;
-		if ((i + len) > fsm->fifo.size) {
-			err = tcp_write(pcb, fsm->fifo.buffer + i, (u16_t)(fsm->fifo.size - i), 1);
-			if (err != ERR_OK) {
-				ftpd_loge("send_msgdata: error writing!");
-				return;
-			}
-			len -= fsm->fifo.size - i;
-			fsm->fifo.readpos = 0;
-			i = 0;
-		}
+	if (rank == 0)
+		return 0;
+	for (i = 0; i < FTPD_LAT_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	if (i == FTPD_LAT_BUCKETS - 1 || ((2UL << i) - 1) > h->max)
+		return h->max;
+	return (2UL << i) - 1;
+}
 
-		err = tcp_write(pcb, fsm->fifo.buffer + i, len, 1);
-		if (err != ERR_OK) {
-			ftpd_loge("send_msgdata: error writing!");
+static void ftpd_lat_start(struct ftpd_msgstate *fsm, struct ftpd_command *cmd)
+{
+	fsm->latnested = 0;
+	if (fsm->latverb >= 0 && fsm->state != FTPD_IDLE) {
+		/* Something like NOOP or ABOR during a transfer; leave the
+		   transfer's timing alone. */
+		fsm->latnested = 1;
+		return;
+	}
+	fsm->latverb = cmd->cmd ? (int) (cmd - ftpd_commands) : -1;
+	fsm->latstart = FTPD_LAT_CLOCK();
+	fsm->latvfs = 0;
+	fsm->latwait = 0;
+}
+
+/* A final reply has been queued: the timed command is done. */
+static void ftpd_lat_done(struct ftpd_msgstate *fsm)
+{
+	struct ftpd_lathist *h;
+
+	if (fsm->latverb < 0 || fsm->latnested)
+		return;
+	h = ftpd_lat[fsm->latverb];
+	ftpd_lat_add(&h[FTPD_LAT_TOTAL], FTPD_LAT_CLOCK() - fsm->latstart);
+	ftpd_lat_add(&h[FTPD_LAT_VFS], fsm->latvfs);
+	ftpd_lat_add(&h[FTPD_LAT_WAIT], fsm->latwait);
+	fsm->latverb = -1;
+}
+
+int ftpd_latency(const char *verb, int kind, struct ftpd_latency *lat)
+{
+	const struct ftpd_lathist *h;
+	struct ftpd_command *cmd;
+
+	if (kind < 0 || kind >= FTPD_LAT_KINDS)
+		return -1;
+	for (cmd = ftpd_commands; cmd->cmd != NULL; cmd++) {
+		if (!strcmp(cmd->cmd, verb))
+			break;
+	}
+	if (cmd->cmd == NULL)
+		return -1;
+	h = &ftpd_lat[cmd - ftpd_commands][kind];
+	lat->count = h->count;
+	lat->p50 = ftpd_lat_percentile(h, 50);
+	lat->p99 = ftpd_lat_percentile(h, 99);
+	lat->max = h->max;
+	return 0;
+}
+
+void ftpd_latency_reset(void)
+{
+	memset(ftpd_lat, 0, sizeof(ftpd_lat));
+}
+
+/* SITE LATENCY [RESET] */
+static void site_latency(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	struct ftpd_command *cmd;
+
+	if (*arg) {
+		if (strcmp(arg, "RESET") && strcmp(arg, "reset")) {
+			send_msg(pcb, fsm, msg501);
 			return;
 		}
-		fsm->fifo.readpos += len;
+		ftpd_latency_reset();
+		send_msg(pcb, fsm, msg200);
+		return;
+	}
+
+	send_msg(pcb, fsm, "211-Latency in us, p50/p99/max: total, vfs, wait");
+	for (cmd = ftpd_commands; cmd->cmd != NULL; cmd++) {
+		const struct ftpd_lathist *h = ftpd_lat[cmd - ftpd_commands];
+
+		if (h[FTPD_LAT_TOTAL].count == 0)
+			continue;
+		send_msg(pcb, fsm, "211-%-4s %lu: %lu/%lu/%lu %lu/%lu/%lu %lu/%lu/%lu",
+			cmd->cmd, (unsigned long) h[FTPD_LAT_TOTAL].count,
+			(unsigned long) ftpd_lat_percentile(&h[FTPD_LAT_TOTAL], 50),
+			(unsigned long) ftpd_lat_percentile(&h[FTPD_LAT_TOTAL], 99),
+			(unsigned long) h[FTPD_LAT_TOTAL].max,
+			(unsigned long) ftpd_lat_percentile(&h[FTPD_LAT_VFS], 50),
+			(unsigned long) ftpd_lat_percentile(&h[FTPD_LAT_VFS], 99),
+			(unsigned long) h[FTPD_LAT_VFS].max,
+			(unsigned long) ftpd_lat_percentile(&h[FTPD_LAT_WAIT], 50),
+			(unsigned long) ftpd_lat_percentile(&h[FTPD_LAT_WAIT], 99),
+			(unsigned long) h[FTPD_LAT_WAIT].max);
+	}
+	send_msg(pcb, fsm, "211 End");
+}
+#endif
+
+#if FTPD_MEM_STATS
+/* SITE MEMORY */
+static void site_memory(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	struct ftpd_mem_usage own, all;
+
+	ftpd_mem_usage(fsm->mem, &own);
+	ftpd_mem_usage(NULL, &all);
+	send_msg(pcb, fsm, "211-This session: %lu bytes, peak %lu",
+		(unsigned long) own.current, (unsigned long) own.peak);
+#if FTPD_SESSION_ARENA
+	send_msg(pcb, fsm, "211-Arena: %lu of %lu bytes",
+		(unsigned long) fsm->mem->slabused, (unsigned long) FTPD_SESSION_ARENA);
+#endif
+	send_msg(pcb, fsm, "211 All sessions: %lu bytes, peak %lu",
+		(unsigned long) all.current, (unsigned long) all.peak);
+}
+#endif
+
+#if FTPD_LATENCY || FTPD_MEM_STATS
+static void cmd_site(const char *arg, struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+	char word[8];
+	int i;
+
+	for (i = 0; i < (int) sizeof(word) - 1 && isalpha((unsigned char) arg[i]); i++)
+		word[i] = toupper((unsigned char) arg[i]);
+	word[i] = '\0';
+	for (arg += i; *arg == ' '; arg++)
+		;
+#if FTPD_LATENCY
+	if (!strcmp(word, "LATENCY")) {
+		site_latency(arg, pcb, fsm);
+		return;
+	}
+#endif
+#if FTPD_MEM_STATS
+	if (!strcmp(word, "MEMORY")) {
+		site_memory(arg, pcb, fsm);
+		return;
 	}
+#endif
+	send_msg(pcb, fsm, msg504);
+}
+#endif
+
+static void send_msgdata(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
+{
+#if FTPD_TRACE
+	u16_t len = (u16_t) sfifo_used(&fsm->fifo);
+	err_t err = send_fifo(pcb, &fsm->fifo);
+
+	if (err != ERR_OK)
+		FTPD_TRACE_EVENT(fsm, FTPD_EV_WRITE_ERR, err, len);
+#else
+	send_fifo(pcb, &fsm->fifo);
+#endif
+#if FTPD_MSG_NODELAY
+	/* Replies sent from data connection or poll callbacks would
+	   otherwise wait for the next output on the control PCB. */
+	if (!fsm->batching)
+		tcp_output(pcb);
+#endif
 }
 
 static void send_msg(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm, char *msg, ...)
 {
 	va_list arg;
-	char buffer[1024];
+	char *buffer;
+	int space;
 	int len;
 
+	/* Format the reply straight into the FIFO if it fits in front of
+	   the wrap-around point. */
+	space = sfifo_reserve_write(&fsm->fifo, &buffer);
 	va_start(arg, msg);
-	len = vsnprintf(buffer, sizeof(buffer), msg, arg);
+	len = vsnprintf(buffer, space, msg, arg);
 	va_end(arg);
-	if (len < 0 || sfifo_space(&fsm->fifo) < len+2)
+	if (len < 0)
 		return;
-	ftpd_logi("< %s", buffer);
-	strcpy(buffer+len, "\r\n");
-	sfifo_write(&fsm->fifo, buffer, len+2);
+	if (len + 2 <= space) {
+		ftpd_logi("< %s", buffer);
+		memcpy(buffer+len, "\r\n", 2);
+		sfifo_commit_write(&fsm->fifo, len+2);
+	} else {
+		char tmp[1024];
+
+		va_start(arg, msg);
+		len = vsnprintf(tmp, sizeof(tmp), msg, arg);
+		va_end(arg);
+		if (len < 0)
+			return;
+		if (len > (int) sizeof(tmp) - 3)
+			len = sizeof(tmp) - 3;
+		if (sfifo_space(&fsm->fifo) < len+2)
+			return;
+		tmp[len] = '\0';
+		ftpd_logi("< %s", tmp);
+		memcpy(tmp+len, "\r\n", 2);
+		sfifo_write(&fsm->fifo, tmp, len+2);
+	}
+#if FTPD_LATENCY
+	/* Preliminary (1xx) and continuation lines don't end a command. */
+	if (msg[0] != '1' && msg[3] != '-')
+		ftpd_lat_done(fsm);
+#endif
 	send_msgdata(pcb, fsm);
 }
 
+/* Free the session state and end its memory account. */
+static void ftpd_msgfree(struct ftpd_msgstate *fsm)
+{
+	struct ftpd_mem *mem = fsm->mem;
+
+	ftpd_free(mem, fsm);
+	ftpd_mem_put(mem);
+}
+
 static void ftpd_msgerr(void *arg, err_t err)
 {
 	struct ftpd_msgstate *fsm = arg;
@@ -1290,35 +4933,45 @@ static void ftpd_msgerr(void *arg, err_t err)
 	ftpd_loge("ftpd_msgerr: %s (%i)", lwip_strerr(err), err);
 	if (fsm == NULL)
 		return;
-	if (fsm->datafs) {
-		ftpd_dataclose(fsm->datapcb, fsm->datafs);
-		fsm->datapcb = NULL;
-	}
+	FTPD_TRACE_EVENT(fsm, FTPD_EV_CLOSE, err, 0);
+	while (fsm->data)
+		ftpd_dataclose(fsm->data->pcb, fsm->data);
+#if FTPD_WRITEBACK
+	ftpd_wb_forget(fsm);
+#endif
+#if FTPD_HASH_THREADS
+	ftpd_hash_forget(fsm);
+#endif
 	sfifo_close(&fsm->fifo);
-	vfs_close(fsm->vfs);
+	FTPD_VFSV(fsm, FTPD_VOP_CLOSEFS, vfs_close(fsm->vfs));
 	fsm->vfs = NULL;
 	if (fsm->renamefrom)
-		free(fsm->renamefrom);
+		ftpd_free(fsm->mem, fsm->renamefrom);
 	fsm->renamefrom = NULL;
-	free(fsm);
+	ftpd_msgfree(fsm);
 }
 
 static void ftpd_msgclose(struct tcp_pcb *pcb, struct ftpd_msgstate *fsm)
 {
+	FTPD_TRACE_EVENT(fsm, FTPD_EV_CLOSE, 0, 0);
 	tcp_arg(pcb, NULL);
 	tcp_sent(pcb, NULL);
 	tcp_recv(pcb, NULL);
-	if (fsm->datafs) {
-		ftpd_dataclose(fsm->datapcb, fsm->datafs);
-		fsm->datapcb = NULL;
-	}
+	while (fsm->data)
+		ftpd_dataclose(fsm->data->pcb, fsm->data);
+#if FTPD_WRITEBACK
+	ftpd_wb_forget(fsm);
+#endif
+#if FTPD_HASH_THREADS
+	ftpd_hash_forget(fsm);
+#endif
 	sfifo_close(&fsm->fifo);
-	vfs_close(fsm->vfs);
+	FTPD_VFSV(fsm, FTPD_VOP_CLOSEFS, vfs_close(fsm->vfs));
 	fsm->vfs = NULL;
 	if (fsm->renamefrom)
-		free(fsm->renamefrom);
+		ftpd_free(fsm->mem, fsm->renamefrom);
 	fsm->renamefrom = NULL;
-	free(fsm);
+	ftpd_msgfree(fsm);
 	tcp_arg(pcb, NULL);
 	tcp_close(pcb);
 }
@@ -1346,7 +4999,7 @@ static err_t ftpd_msgrecv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t
 		/* Inform TCP that we have taken the data. */
 		tcp_recved(pcb, p->tot_len);
 
-		text = malloc(p->tot_len + 1);
+		text = ftpd_alloc(fsm->mem, p->tot_len + 1);
 		if (text) {
 			char cmd[5];
 			struct pbuf *q;
@@ -1380,12 +5033,28 @@ static err_t ftpd_msgrecv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t
 			else
 				pt = &text[strlen(cmd) + 1];
 
+#if FTPD_MSG_NODELAY
+			fsm->batching = 1;
+#endif
+#if FTPD_LATENCY
+			ftpd_lat_start(fsm, ftpd_cmd);
+#endif
 			if (ftpd_cmd->func)
 				ftpd_cmd->func(pt, pcb, fsm);
 			else
 				send_msg(pcb, fsm, msg502);
+#if FTPD_MSG_NODELAY
+			/* Push out everything the command replied in one go. */
+			fsm->batching = 0;
+			tcp_output(pcb);
+#endif
+#if FTPD_LATENCY
+			if (!fsm->latnested)
+				ftpd_lat_yield(fsm);
+			fsm->latnested = 0;
+#endif
 
-			free(text);
+			ftpd_free(fsm->mem, text);
 		}
 		pbuf_free(p);
 	} else if (err == ERR_OK && p == NULL) {
@@ -1398,27 +5067,42 @@ static err_t ftpd_msgrecv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t
 static err_t ftpd_msgpoll(void *arg, struct tcp_pcb *pcb)
 {
 	struct ftpd_msgstate *fsm = arg;
+	int i;
 
 	if (fsm == NULL)
 		return ERR_OK;
 
-	if (fsm->datafs) {
-		if (fsm->datafs->connected) {
-			switch (fsm->state) {
-			case FTPD_LIST:
-				send_next_directory(fsm->datafs, fsm->datapcb, 0);
-				break;
-			case FTPD_NLST:
-				send_next_directory(fsm->datafs, fsm->datapcb, 1);
-				break;
-			case FTPD_RETR:
-				send_file(fsm->datafs, fsm->datapcb);
-				break;
-			default:
-				break;
-			}
-		}
+#if FTPD_WRITEBACK
+#if FTPD_WB_FLUSH_INLINE
+	do {
+		ftpd_wb_fill_all();
+	} while (ftpd_wb_flush());
+#else
+	/* In case a wakeup from the storage task couldn't be posted */
+	ftpd_wb_fill_all();
+#endif
+	ftpd_wb_reap();
+#endif
+
+	/* A transfer can end others of the session (see ftpd_sr_kick()), so
+	   the list is walked again from the start each time. */
+	ftpd_lat_resume(fsm);
+	for (i = 0;; i++) {
+		struct ftpd_datastate *fsd = fsm->data;
+		int n;
+
+		for (n = 0; fsd && n < i; n++)
+			fsd = fsd->next;
+		if (!fsd)
+			break;
+		if (fsd->connected)
+			send_transfer(fsd, fsd->pcb);
 	}
+	ftpd_lat_yield(fsm);
+#if FTPD_HASH_THREADS
+	if (fsm->hash)
+		ftpd_hash_progress(fsm, pcb);
+#endif
 
 	return ERR_OK;
 }
@@ -1426,27 +5110,44 @@ static err_t ftpd_msgpoll(void *arg, struct tcp_pcb *pcb)
 static err_t ftpd_msgaccept(void *arg, struct tcp_pcb *pcb, err_t err)
 {
 	struct ftpd_msgstate *fsm;
+	struct ftpd_mem *mem;
 
 	/* Allocate memory for the structure that holds the state of the
-	   connection. */
-	fsm = malloc(sizeof(struct ftpd_msgstate));
+	   connection, charged to the session's own account. */
+	mem = ftpd_mem_new(FTPD_SESSION_MEM_LIMIT);
+	if (FTPD_MEM_STATS && mem == NULL) {
+		ftpd_loge("ftpd_msgaccept: Out of memory");
+		return ERR_MEM;
+	}
+	fsm = ftpd_alloc(mem, sizeof(struct ftpd_msgstate));
 
 	if (fsm == NULL) {
 		ftpd_loge("ftpd_msgaccept: Out of memory");
+		ftpd_mem_put(mem);
 		return ERR_MEM;
 	}
 	memset(fsm, 0, sizeof(struct ftpd_msgstate));
+	fsm->mem = mem;
 
 	/* Initialize the structure. */
-	if (sfifo_init(&fsm->fifo, 2000) != 0) {
-		free(fsm);
+	if (sfifo_init(&fsm->fifo, FTPD_MSG_FIFO_SIZE, fsm->mem) != 0) {
+		ftpd_msgfree(fsm);
 		return ERR_MEM;
 	}
 	fsm->state = FTPD_IDLE;
-	fsm->vfs = vfs_openfs();
+#if FTPD_LATENCY
+	fsm->latverb = -1;
+#endif
+#if FTPD_TRACE
+	fsm->traceid = ++ftpd_trace_sessions;
+	if (fsm->traceid == 0)
+		fsm->traceid = ++ftpd_trace_sessions;
+#endif
+	FTPD_TRACE_EVENT(fsm, FTPD_EV_ACCEPT, 0, 0);
+	fsm->vfs = FTPD_VFSP(fsm, FTPD_VOP_OPENFS, vfs_openfs());
 	if (fsm->vfs == NULL) {
 		sfifo_close(&fsm->fifo);
-		free(fsm);
+		ftpd_msgfree(fsm);
 		return ERR_CLSD;
 	}
 
@@ -1466,19 +5167,129 @@ static err_t ftpd_msgaccept(void *arg, struct tcp_pcb *pcb, err_t err)
 
 	tcp_poll(pcb, ftpd_msgpoll, 1);
 
+#if FTPD_MSG_NODELAY
+	tcp_nagle_disable(pcb);
+#endif
+
 	send_msg(pcb, fsm, msg220);
 
 	return ERR_OK;
 }
 
+#if FTPD_TRACE
+static const char *ftpd_trace_states[] = {
+	"USER", "PASS", "IDLE", "NLST", "LIST", "RETR", "RNFR", "STOR", "QUIT"
+};
+
+static const char *ftpd_trace_vfsops[] = {
+	"vfs_openfs", "vfs_close", "vfs_open", "vfs_close_file", "vfs_read",
+	"vfs_write", "vfs_eof", "vfs_rewind", "vfs_seek", "vfs_stat",
+	"vfs_opendir", "vfs_readdir", "vfs_closedir", "vfs_chdir", "vfs_getcwd",
+	"vfs_rename", "vfs_mkdir", "vfs_rmdir", "vfs_remove", "vfs_io_hints",
+	"vfs_map", "vfs_unmap"
+};
+
+static const char *ftpd_trace_names[] = {
+	"accept", "close", "state", "data connect", "data accept", "data close",
+	"fifo full", "fifo empty", "tcp_write failed"
+};
+
+/*
+ * Write the ring as Chrome trace JSON: one thread per session, with
+ * session 0 for storage work that belongs to none, VFS calls as slices
+ * and everything else as instant events.
+ */
+void ftpd_trace_dump(FILE *f)
+{
+	unsigned int head = ftpd_trace_head;
+	unsigned int i = head > FTPD_TRACE ? head - FTPD_TRACE : 0;
+	unsigned long long ts = 0;
+	u32_t last = 0;
+	const char *sep = "";
+
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (; i != head; i++) {
+		const struct ftpd_trace_event *ev = &ftpd_trace_ring[i & (FTPD_TRACE - 1)];
+
+		/* The clock wraps; only the differences count. */
+		if (*sep)
+			ts += (u32_t) (ev->ts - last);
+		last = ev->ts;
+		fprintf(f, "%s{\"pid\":1,\"tid\":%u,\"ts\":%llu,", sep, ev->session, ts);
+		sep = ",\n";
+		switch (ev->event) {
+		case FTPD_EV_VFS_BEGIN:
+		case FTPD_EV_VFS_END:
+			fprintf(f, "\"ph\":\"%s\",\"name\":\"%s\"",
+				ev->event == FTPD_EV_VFS_BEGIN ? "B" : "E",
+				ev->a < sizeof(ftpd_trace_vfsops) / sizeof(ftpd_trace_vfsops[0]) ? ftpd_trace_vfsops[ev->a] : "vfs");
+			if (ev->event == FTPD_EV_VFS_END)
+				fprintf(f, ",\"args\":{\"ret\":%ld}", (long) (s32_t) ev->b);
+			break;
+		case FTPD_EV_STATE:
+			fprintf(f, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"args\":{\"from\":\"%s\"}",
+				ev->b < sizeof(ftpd_trace_states) / sizeof(ftpd_trace_states[0]) ? ftpd_trace_states[ev->b] : "?",
+				ev->a < sizeof(ftpd_trace_states) / sizeof(ftpd_trace_states[0]) ? ftpd_trace_states[ev->a] : "?");
+			break;
+		default:
+			fprintf(f, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"args\":{\"a\":%ld,\"b\":%lu}",
+				ev->event < sizeof(ftpd_trace_names) / sizeof(ftpd_trace_names[0]) ? ftpd_trace_names[ev->event] : "?",
+				(long) (s32_t) ev->a, (unsigned long) ev->b);
+			break;
+		}
+		fprintf(f, "}");
+	}
+	fprintf(f, "\n]}\n");
+}
+#endif
+
+#if FTPD_URING
+static void ftpd_uring_ready(void *arg)
+{
+	vfs_uring_complete();
+}
+
+static void ftpd_uring_flush(void *arg)
+{
+	vfs_uring_submit();
+}
+#endif
+
+#if FTPD_HASH_THREADS
+static void ftpd_hash_ready(void *arg)
+{
+	vfs_hash_complete();
+}
+#endif
+
 void ftpd_init(void)
 {
 	struct tcp_pcb *pcb;
 
 	vfs_load_plugin(vfs_default_fs);
+#if FTPD_URING
+	/* Without a ring, storage calls simply block. */
+	if (vfs_uring_init(FTPD_URING) == 0
+	    && tcp_epoll_watch(vfs_uring_fd(), ftpd_uring_ready, ftpd_uring_flush, NULL) != 0)
+		vfs_uring_exit();
+#endif
+#if FTPD_WRITEBACK && !FTPD_WB_FLUSH_INLINE && FTPD_EPOLL
+	/* Without it, the cache is refilled on poll only. */
+	ftpd_wb_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ftpd_wb_eventfd >= 0 && tcp_epoll_watch(ftpd_wb_eventfd, ftpd_wb_ready, NULL, NULL) != 0) {
+		close(ftpd_wb_eventfd);
+		ftpd_wb_eventfd = -1;
+	}
+#endif
+#if FTPD_HASH_THREADS
+	/* Without threads, XCRC and HASH aren't available. */
+	if (vfs_hash_init(FTPD_HASH_THREADS) == 0
+	    && tcp_epoll_watch(vfs_hash_fd(), ftpd_hash_ready, NULL, NULL) == 0)
+		ftpd_hash_up = 1;
+#endif
 
 	pcb = tcp_new();
-	tcp_bind(pcb, IP_ADDR_ANY, 21);
+	tcp_bind(pcb, IP_ADDR_ANY, FTPD_PORT);
 	pcb = tcp_listen(pcb);
 	tcp_accept(pcb, ftpd_msgaccept);
 }
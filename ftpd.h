@@ -34,6 +34,74 @@
 #ifndef __FTPD_H__
 #define __FTPD_H__
 
+#include <stdio.h>
+
 void ftpd_init(void);
 
+/* Every allocation of ftpd and the VFS backends goes through these. The
+ * context is the account that is charged: a session's, or NULL for
+ * shared state. VFS backends charge ftpd_mem_owner, which ftpd points at
+ * the session it is serving around each VFS call.
+ */
+struct ftpd_mem;
+
+extern struct ftpd_mem *ftpd_mem_owner;
+
+void *ftpd_alloc(struct ftpd_mem *ctx, size_t size);
+void ftpd_free(struct ftpd_mem *ctx, void *ptr);
+char *ftpd_strdup(struct ftpd_mem *ctx, const char *str);
+
+/* With FTPD_MEM_STATS: bytes in use and the high-water mark for an
+ * account, or for everything with NULL. Returns -1 without.
+ */
+struct ftpd_mem_usage {
+	size_t current;
+	size_t peak;
+};
+
+int ftpd_mem_usage(const struct ftpd_mem *ctx, struct ftpd_mem_usage *usage);
+
+/* With FTPD_WRITEBACK: write cached uploads to storage. Call this from a
+ * storage task if FTPD_WB_FLUSH_INLINE is 0; whenever it writes something,
+ * it wakes the tcpip thread to refill the cache. Returns nonzero while
+ * there is more to do.
+ */
+int ftpd_wb_flush(void);
+
+/* With FTPD_FILE_CACHE: forget cached files at or below an absolute path,
+ * or all of them for NULL. Call this after changing files behind the
+ * server's back.
+ */
+void ftpd_fc_invalidate(const char *path);
+
+/* The same for FTPD_CONTENT_CACHE. */
+void ftpd_cc_invalidate(const char *path);
+
+/* With FTPD_LATENCY: p50/p99/max in microseconds of one kind of time for
+ * a command verb such as "LIST". TOTAL runs from receiving the command to
+ * queueing its final reply, i.e. 226 for transfers. Returns -1 for an
+ * unknown verb. Call these from the tcpip thread.
+ */
+enum {
+	FTPD_LAT_TOTAL,
+	FTPD_LAT_VFS,		/* in storage calls on the command's path */
+	FTPD_LAT_WAIT,		/* between transfer callbacks, mostly on TCP */
+	FTPD_LAT_KINDS
+};
+
+struct ftpd_latency {
+	unsigned long count;
+	unsigned long p50;
+	unsigned long p99;
+	unsigned long max;
+};
+
+int ftpd_latency(const char *verb, int kind, struct ftpd_latency *lat);
+void ftpd_latency_reset(void);
+
+/* With FTPD_TRACE: write the trace ring to f as Chrome trace JSON, for
+ * chrome://tracing or ui.perfetto.dev.
+ */
+void ftpd_trace_dump(FILE *f);
+
 #endif				/* __FTPD_H__ */
@@ -0,0 +1,915 @@
+/*
+ * Copyright (c) 2002 Florian Schulze.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of the contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * tcp_epoll.c - This file is part of the FTP daemon for lwIP
+ *
+ */
+
+/*
+ * The subset of lwIP's raw TCP API that ftpd uses, on nonblocking
+ * sockets and epoll. See tcp_epoll.h.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "tcp_epoll.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Events taken from the kernel per epoll_wait() */
+#ifndef TCP_EPOLL_EVENTS
+#define TCP_EPOLL_EVENTS 256
+#endif
+
+#if TCP_SND_BUF > 65535 || TCP_WND > 65535
+#error "TCP_SND_BUF and TCP_WND must fit into u16_t"
+#endif
+
+const ip_addr_t ip_addr_any;
+
+static int epfd = -1;
+static struct tcp_pcb *pcbs;
+/* Connections to flush and to report sent data for, in order */
+static struct tcp_pcb *work, **worktail = &work;
+/* Closed connections, freed at the end of the event round */
+static struct tcp_pcb *dead;
+static u32_t lastpoll;
+static struct tcp_pcb *watches;
+
+/*
+ * Create the epoll instance on first use. This is also where SIGPIPE gets
+ * ignored, once, as there is no MSG_NOSIGNAL for sendfile(); a handler the
+ * application has installed is left alone.
+ */
+static int epoll_open(void)
+{
+	struct sigaction sa;
+
+	if (epfd >= 0)
+		return 0;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		return -1;
+	if (sigaction(SIGPIPE, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL)
+		signal(SIGPIPE, SIG_IGN);
+	return 0;
+}
+
+u32_t sys_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u32_t) ts.tv_sec * 1000 + (u32_t) (ts.tv_nsec / 1000000);
+}
+
+const char *lwip_strerr(err_t err)
+{
+	static const char *msgs[] = {
+		"Ok.", "Out of memory error.", "Buffer error.", "Timeout.",
+		"Routing problem.", "Operation in progress.", "Illegal value.",
+		"Operation would block.", "Address in use.", "Already connecting.",
+		"Already connected.", "Not connected.", "Low-level netif error.",
+		"Connection aborted.", "Connection reset.", "Connection closed.",
+		"Illegal argument."
+	};
+
+	if (err > 0 || -err >= (int) (sizeof(msgs) / sizeof(msgs[0])))
+		return "Unknown error.";
+	return msgs[-err];
+}
+
+u8_t pbuf_free(struct pbuf *p)
+{
+	u8_t count = 0;
+
+	while (p != NULL && --p->ref == 0) {
+		struct pbuf *next = p->next;
+
+		free(p);
+		count++;
+		p = next;
+	}
+	return count;
+}
+
+void pbuf_cat(struct pbuf *head, struct pbuf *tail)
+{
+	struct pbuf *p;
+
+	for (p = head; p->next != NULL; p = p->next)
+		p->tot_len += tail->tot_len;
+	p->tot_len += tail->tot_len;
+	p->next = tail;
+}
+
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset)
+{
+	u16_t done = 0;
+
+	for (; p != NULL && done < len; p = p->next) {
+		u16_t n;
+
+		if (offset >= p->len) {
+			offset -= p->len;
+			continue;
+		}
+		n = p->len - offset;
+		if (n > len - done)
+			n = len - done;
+		memcpy((char *) dataptr + done, (const char *) p->payload + offset, n);
+		done += n;
+		offset = 0;
+	}
+	return done;
+}
+
+static struct pbuf *pbuf_new(const void *data, u16_t len)
+{
+	struct pbuf *p = malloc(sizeof(struct pbuf) + len);
+
+	if (p == NULL)
+		return NULL;
+	p->next = NULL;
+	p->payload = p + 1;
+	p->tot_len = p->len = len;
+	p->ref = 1;
+	memcpy(p->payload, data, len);
+	return p;
+}
+
+static void set_events(struct tcp_pcb *pcb, u32_t events)
+{
+	struct epoll_event ev;
+	int op;
+
+	if (pcb->fd < 0 || events == pcb->events)
+		return;
+	if (pcb->events == 0)
+		op = EPOLL_CTL_ADD;
+	else if (events == 0)
+		op = EPOLL_CTL_DEL;
+	else
+		op = EPOLL_CTL_MOD;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = pcb;
+	if (epoll_ctl(epfd, op, pcb->fd, &ev) == 0)
+		pcb->events = events;
+}
+
+/* Ask epoll for what the connection can make progress with. */
+static void update_events(struct tcp_pcb *pcb)
+{
+	u32_t events = 0;
+
+	if (pcb->dead)
+		return;
+	if (pcb->ready) {
+		events = EPOLLIN;
+	} else if (pcb->state == LISTEN) {
+		if (!pcb->paused)
+			events = EPOLLIN;
+	} else if (pcb->state == SYN_SENT) {
+		events = EPOLLOUT;
+	} else if (pcb->state != CLOSED) {
+		if (!pcb->eof && !pcb->closing && (pcb->rcv_wnd > 0 || pcb->sink))
+			events |= EPOLLIN;
+		if (pcb->sndlen > 0 || pcb->file)
+			events |= EPOLLOUT;
+	}
+	set_events(pcb, events);
+}
+
+static void want_work(struct tcp_pcb *pcb)
+{
+	if (pcb->busy)
+		return;
+	pcb->busy = 1;
+	pcb->worknext = NULL;
+	*worktail = pcb;
+	worktail = &pcb->worknext;
+}
+
+static struct tcp_pcb *pcb_alloc(int fd)
+{
+	struct tcp_pcb *pcb = calloc(1, sizeof(struct tcp_pcb));
+
+	if (pcb == NULL)
+		return NULL;
+	pcb->fd = fd;
+	pcb->state = CLOSED;
+	pcb->rcv_wnd = TCP_WND;
+	pcb->next = pcbs;
+	if (pcbs)
+		pcbs->prev = pcb;
+	pcbs = pcb;
+	return pcb;
+}
+
+/* Close the socket. The pcb stays readable until the round is over. */
+static void pcb_release(struct tcp_pcb *pcb)
+{
+	if (pcb->dead)
+		return;
+	if (pcb->fd >= 0)
+		close(pcb->fd);
+	if (pcb->sink) {
+		close(pcb->pipefd[0]);
+		close(pcb->pipefd[1]);
+		pcb->sink = 0;
+	}
+	pcb->fd = -1;
+	pcb->file = 0;
+	pcb->events = 0;
+	pcb->state = CLOSED;
+	pcb->dead = 1;
+	if (pcb->prev)
+		pcb->prev->next = pcb->next;
+	else
+		pcbs = pcb->next;
+	if (pcb->next)
+		pcb->next->prev = pcb->prev;
+	pcb->deadnext = dead;
+	dead = pcb;
+}
+
+/* The connection is gone: tell the owner, like lwIP does, after the fact. */
+static void pcb_fail(struct tcp_pcb *pcb, err_t err)
+{
+	tcp_err_fn errf = pcb->errf;
+	void *arg = pcb->callback_arg;
+
+	pcb_release(pcb);
+	if (errf)
+		errf(arg, err);
+}
+
+static void set_addrs(struct tcp_pcb *pcb)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+
+	if (getsockname(pcb->fd, (struct sockaddr *) &sa, &len) == 0) {
+		pcb->local_ip.addr = sa.sin_addr.s_addr;
+		pcb->local_port = ntohs(sa.sin_port);
+	}
+	len = sizeof(sa);
+	if (getpeername(pcb->fd, (struct sockaddr *) &sa, &len) == 0) {
+		pcb->remote_ip.addr = sa.sin_addr.s_addr;
+		pcb->remote_port = ntohs(sa.sin_port);
+	}
+}
+
+struct tcp_pcb *tcp_new(void)
+{
+	struct tcp_pcb *pcb;
+	int fd;
+
+	if (epoll_open() != 0)
+		return NULL;
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+	pcb = pcb_alloc(fd);
+	if (pcb == NULL)
+		close(fd);
+	return pcb;
+}
+
+err_t tcp_bind(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port)
+{
+	struct sockaddr_in sa;
+	int one = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = ipaddr ? ipaddr->addr : INADDR_ANY;
+	setsockopt(pcb->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(pcb->fd, (struct sockaddr *) &sa, sizeof(sa)) != 0)
+		return errno == EADDRINUSE ? ERR_USE : ERR_VAL;
+	pcb->local_ip.addr = sa.sin_addr.s_addr;
+	pcb->local_port = port;
+	return ERR_OK;
+}
+
+struct tcp_pcb *tcp_listen(struct tcp_pcb *pcb)
+{
+	if (listen(pcb->fd, SOMAXCONN) != 0)
+		return NULL;
+	pcb->state = LISTEN;
+	update_events(pcb);
+	return pcb;
+}
+
+err_t tcp_connect(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port, tcp_connected_fn connected)
+{
+	struct sockaddr_in sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = ipaddr->addr;
+	pcb->connected = connected;
+	pcb->remote_ip = *ipaddr;
+	pcb->remote_port = port;
+	/* Even an immediate success is reported from the event loop. */
+	if (connect(pcb->fd, (struct sockaddr *) &sa, sizeof(sa)) != 0 && errno != EINPROGRESS)
+		return ERR_RTE;
+	pcb->state = SYN_SENT;
+	update_events(pcb);
+	return ERR_OK;
+}
+
+void tcp_arg(struct tcp_pcb *pcb, void *arg)
+{
+	if (pcb)
+		pcb->callback_arg = arg;
+}
+
+void tcp_accept(struct tcp_pcb *pcb, tcp_accept_fn accept)
+{
+	if (pcb)
+		pcb->accept = accept;
+}
+
+void tcp_recv(struct tcp_pcb *pcb, tcp_recv_fn recv)
+{
+	if (pcb)
+		pcb->recv = recv;
+}
+
+void tcp_sent(struct tcp_pcb *pcb, tcp_sent_fn sent)
+{
+	if (pcb)
+		pcb->sent = sent;
+}
+
+void tcp_err(struct tcp_pcb *pcb, tcp_err_fn errf)
+{
+	if (pcb)
+		pcb->errf = errf;
+}
+
+void tcp_poll(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval)
+{
+	pcb->poll = poll;
+	pcb->pollinterval = interval;
+}
+
+void tcp_setprio(struct tcp_pcb *pcb, u8_t prio)
+{
+}
+
+void tcp_nagle_disable(struct tcp_pcb *pcb)
+{
+	int one = 1;
+
+	setsockopt(pcb->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+err_t tcp_write(struct tcp_pcb *pcb, const void *dataptr, u16_t len, u8_t apiflags)
+{
+	u32_t tail, first;
+
+	if (pcb->dead || pcb->closing)
+		return ERR_CLSD;
+	if (pcb->state != SYN_SENT && pcb->state != ESTABLISHED && pcb->state != CLOSE_WAIT)
+		return ERR_CONN;
+	if (len > TCP_SND_BUF - pcb->sndlen || pcb->file)
+		return ERR_MEM;
+	if (pcb->snd == NULL && (pcb->snd = malloc(TCP_SND_BUF)) == NULL)
+		return ERR_MEM;
+	tail = (pcb->sndhead + pcb->sndlen) % TCP_SND_BUF;
+	first = TCP_SND_BUF - tail;
+	if (first > len)
+		first = len;
+	memcpy(pcb->snd + tail, dataptr, first);
+	memcpy(pcb->snd, (const char *) dataptr + first, len - first);
+	pcb->sndlen += len;
+	pcb->sndmore = (apiflags & TCP_WRITE_FLAG_MORE) != 0;
+	want_work(pcb);
+	return ERR_OK;
+}
+
+/*
+ * Send the queued file, up to TCP_EPOLL_FILE_BURST bytes at a time so
+ * that one fast connection doesn't hold up the others. The rest goes at
+ * the next EPOLLOUT.
+ */
+static void flush_file(struct tcp_pcb *pcb)
+{
+	u64_t budget = TCP_EPOLL_FILE_BURST;
+
+	while (budget > 0) {
+		off_t off = (off_t) pcb->fileoff;
+		size_t len = budget;
+		ssize_t n;
+
+		if (!pcb->fileall && len > pcb->fileleft)
+			len = pcb->fileleft;
+		n = sendfile(pcb->fd, pcb->filefd, &off, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				pcb->failed = 1;
+			return;
+		}
+		pcb->fileoff += (u64_t) n;
+		pcb->fileleft -= pcb->fileall ? 0 : (u64_t) n;
+		pcb->acked += (u32_t) n;
+		budget -= (u64_t) n;
+		/* The end of the file comes early if it has been truncated. */
+		if (n == 0 || (!pcb->fileall && pcb->fileleft == 0)) {
+			pcb->file = 0;
+			return;
+		}
+	}
+}
+
+/* Hand queued data to the kernel, as much as it takes. */
+static void flush(struct tcp_pcb *pcb)
+{
+	while (pcb->sndlen > 0 && !pcb->failed && (pcb->state == ESTABLISHED || pcb->state == CLOSE_WAIT)) {
+		struct iovec iov[2];
+		struct msghdr msg;
+		u32_t first = TCP_SND_BUF - pcb->sndhead;
+		ssize_t n;
+
+		if (first > pcb->sndlen)
+			first = pcb->sndlen;
+		memset(&msg, 0, sizeof(msg));
+		iov[0].iov_base = pcb->snd + pcb->sndhead;
+		iov[0].iov_len = first;
+		iov[1].iov_base = pcb->snd;
+		iov[1].iov_len = pcb->sndlen - first;
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iov[1].iov_len > 0 ? 2 : 1;
+		n = sendmsg(pcb->fd, &msg, MSG_NOSIGNAL | (pcb->sndmore ? MSG_MORE : 0));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				pcb->failed = 1;
+			return;
+		}
+		pcb->sndhead = (pcb->sndhead + (u32_t) n) % TCP_SND_BUF;
+		pcb->sndlen -= (u32_t) n;
+		pcb->acked += (u32_t) n;
+	}
+	if (pcb->sndlen == 0 && pcb->file && !pcb->failed
+	    && (pcb->state == ESTABLISHED || pcb->state == CLOSE_WAIT))
+		flush_file(pcb);
+}
+
+err_t tcp_output(struct tcp_pcb *pcb)
+{
+	if (pcb->dead)
+		return ERR_CLSD;
+	flush(pcb);
+	if (!pcb->dead)
+		want_work(pcb);
+	return ERR_OK;
+}
+
+err_t tcp_epoll_sendfile(struct tcp_pcb *pcb, int fd, u64_t offset, u64_t len)
+{
+	if (pcb->dead || pcb->closing)
+		return ERR_CLSD;
+	if (pcb->state != ESTABLISHED && pcb->state != CLOSE_WAIT)
+		return ERR_CONN;
+	if (pcb->file)
+		return ERR_MEM;
+	pcb->file = 1;
+	pcb->fileall = len == 0;
+	pcb->filefd = fd;
+	pcb->fileoff = offset;
+	pcb->fileleft = len;
+	want_work(pcb);
+	return ERR_OK;
+}
+
+int tcp_epoll_sendfile_left(struct tcp_pcb *pcb)
+{
+	return pcb->file;
+}
+
+err_t tcp_epoll_splice(struct tcp_pcb *pcb, int fd)
+{
+	if (pcb->dead || pcb->closing || pcb->eof)
+		return ERR_CLSD;
+	if (pcb->sink)
+		return ERR_ALREADY;
+	if (pipe2(pcb->pipefd, O_NONBLOCK | O_CLOEXEC) != 0)
+		return ERR_MEM;
+	pcb->sink = 1;
+	pcb->sinkfd = fd;
+	update_events(pcb);
+	return ERR_OK;
+}
+
+u16_t tcp_sndbuf(struct tcp_pcb *pcb)
+{
+	if (pcb->dead || pcb->closing || pcb->file)
+		return 0;
+	return (u16_t) (TCP_SND_BUF - pcb->sndlen);
+}
+
+void tcp_recved(struct tcp_pcb *pcb, u16_t len)
+{
+	u32_t wnd = (u32_t) pcb->rcv_wnd + len;
+
+	pcb->rcv_wnd = wnd > TCP_WND ? TCP_WND : (u16_t) wnd;
+	update_events(pcb);
+}
+
+static void finish_close(struct tcp_pcb *pcb)
+{
+	pcb_release(pcb);
+}
+
+err_t tcp_close(struct tcp_pcb *pcb)
+{
+	/* Nothing is reported for a closed pcb anymore. */
+	pcb->callback_arg = NULL;
+	pcb->accept = NULL;
+	pcb->connected = NULL;
+	pcb->recv = NULL;
+	pcb->sent = NULL;
+	pcb->poll = NULL;
+	pcb->errf = NULL;
+	/* The caller owns the file and may close it now: drop what is left. */
+	pcb->file = 0;
+	if (pcb->sndlen > 0 && (pcb->state == ESTABLISHED || pcb->state == CLOSE_WAIT)) {
+		/* Send what is queued first; close() would drop it. */
+		pcb->closing = 1;
+		want_work(pcb);
+		return ERR_OK;
+	}
+	finish_close(pcb);
+	return ERR_OK;
+}
+
+void tcp_abort(struct tcp_pcb *pcb)
+{
+	struct linger lg;
+
+	/* Reset the connection instead of closing it. */
+	lg.l_onoff = 1;
+	lg.l_linger = 0;
+	if (pcb->fd >= 0)
+		setsockopt(pcb->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	pcb_fail(pcb, ERR_ABRT);
+}
+
+/* Pass data, or NULL at the end, to the recv callback. */
+static void deliver(struct tcp_pcb *pcb, struct pbuf *p)
+{
+	if (pcb->recv) {
+		pcb->recv(pcb->callback_arg, pcb, p, ERR_OK);
+	} else if (p) {
+		/* Like lwIP's tcp_recv_null() */
+		tcp_recved(pcb, p->tot_len);
+		pbuf_free(p);
+	} else {
+		tcp_close(pcb);
+	}
+}
+
+/* The end of the stream, or of writing it to the file */
+static void sink_end(struct tcp_pcb *pcb, err_t err)
+{
+	pcb->eof = 1;
+	if (err == ERR_OK)
+		pcb->state = CLOSE_WAIT;
+	update_events(pcb);
+	if (pcb->recv)
+		pcb->recv(pcb->callback_arg, pcb, NULL, err);
+	else
+		tcp_close(pcb);
+}
+
+/* Move what has arrived from the socket to the file, through the pipe. */
+static void do_splice(struct tcp_pcb *pcb)
+{
+	int i;
+
+	/* A bounded amount per round, like flush_file() */
+	for (i = 0; i < TCP_EPOLL_FILE_BURST / 65536; i++) {
+		ssize_t n = splice(pcb->fd, NULL, pcb->pipefd[1], NULL, 65536, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				pcb_fail(pcb, ERR_RST);
+			return;
+		}
+		if (n == 0) {
+			sink_end(pcb, ERR_OK);
+			return;
+		}
+		while (n > 0) {
+			ssize_t m = splice(pcb->pipefd[0], NULL, pcb->sinkfd, NULL, (size_t) n, SPLICE_F_MOVE);
+
+			if (m < 0 && errno == EINTR)
+				continue;
+			if (m <= 0) {
+				sink_end(pcb, ERR_BUF);
+				return;
+			}
+			n -= m;
+		}
+	}
+}
+
+static void do_read(struct tcp_pcb *pcb)
+{
+	static char buf[TCP_WND];
+	struct pbuf *p;
+	ssize_t n;
+
+	if (pcb->sink && !pcb->eof && !pcb->closing) {
+		do_splice(pcb);
+		return;
+	}
+	if (pcb->eof || pcb->closing || pcb->rcv_wnd == 0)
+		return;
+	n = recv(pcb->fd, buf, pcb->rcv_wnd, 0);
+	if (n < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+			pcb_fail(pcb, ERR_RST);
+		return;
+	}
+	if (n == 0) {
+		pcb->eof = 1;
+		pcb->state = CLOSE_WAIT;
+		update_events(pcb);
+		deliver(pcb, NULL);
+		return;
+	}
+	p = pbuf_new(buf, (u16_t) n);
+	if (p == NULL) {
+		pcb_fail(pcb, ERR_MEM);
+		return;
+	}
+	pcb->rcv_wnd -= (u16_t) n;
+	update_events(pcb);
+	deliver(pcb, p);
+}
+
+static void do_accept(struct tcp_pcb *lpcb)
+{
+	int i;
+
+	/* A bounded number per round, so that a flood of connections
+	   doesn't starve the established ones. */
+	for (i = 0; i < 16 && !lpcb->dead && lpcb->state == LISTEN; i++) {
+		struct tcp_pcb *pcb;
+		err_t err;
+		int fd;
+
+		fd = accept4(lpcb->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				/* Retried at the next poll */
+				lpcb->paused = 1;
+				update_events(lpcb);
+			}
+			return;
+		}
+		pcb = pcb_alloc(fd);
+		if (pcb == NULL) {
+			close(fd);
+			return;
+		}
+		pcb->state = ESTABLISHED;
+		set_addrs(pcb);
+		pcb->callback_arg = lpcb->callback_arg;
+		err = lpcb->accept ? lpcb->accept(lpcb->callback_arg, pcb, ERR_OK) : ERR_VAL;
+		if (err != ERR_OK) {
+			if (!pcb->dead)
+				tcp_abort(pcb);
+			continue;
+		}
+		update_events(pcb);
+	}
+}
+
+static void do_connect(struct tcp_pcb *pcb)
+{
+	int soerr = 0;
+	socklen_t len = sizeof(soerr);
+
+	if (getsockopt(pcb->fd, SOL_SOCKET, SO_ERROR, &soerr, &len) != 0 || soerr != 0) {
+		pcb_fail(pcb, ERR_RST);
+		return;
+	}
+	pcb->state = ESTABLISHED;
+	set_addrs(pcb);
+	update_events(pcb);
+	if (pcb->connected && pcb->connected(pcb->callback_arg, pcb, ERR_OK) != ERR_OK && !pcb->dead)
+		tcp_abort(pcb);
+}
+
+/* Flush what was written and report what the kernel has taken. */
+static void settle(void)
+{
+	while (work) {
+		struct tcp_pcb *pcb = work;
+
+		work = pcb->worknext;
+		if (work == NULL)
+			worktail = &work;
+		pcb->busy = 0;
+		if (pcb->dead)
+			continue;
+		flush(pcb);
+		if (pcb->failed) {
+			pcb_fail(pcb, ERR_RST);
+			continue;
+		}
+		while (!pcb->dead && pcb->acked > 0 && pcb->sent) {
+			u16_t n = pcb->acked > 0xffff ? 0xffff : (u16_t) pcb->acked;
+
+			pcb->acked -= n;
+			pcb->sent(pcb->callback_arg, pcb, n);
+		}
+		if (pcb->dead)
+			continue;
+		pcb->acked = 0;
+		if (pcb->closing && pcb->sndlen == 0)
+			finish_close(pcb);
+		else
+			update_events(pcb);
+	}
+}
+
+static void handle(struct tcp_pcb *pcb, u32_t events)
+{
+	if (pcb->ready) {
+		pcb->ready(pcb->callback_arg);
+	} else if (pcb->state == LISTEN) {
+		do_accept(pcb);
+	} else if (pcb->state == SYN_SENT) {
+		do_connect(pcb);
+	} else if (pcb->closing) {
+		/* Only waiting to send the rest */
+		if (events & (EPOLLERR | EPOLLHUP))
+			pcb_release(pcb);
+		else
+			want_work(pcb);
+	} else {
+		if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			do_read(pcb);
+		if (!pcb->dead && (events & EPOLLERR) && !(pcb->events & EPOLLIN))
+			pcb_fail(pcb, ERR_RST);
+		if (!pcb->dead && (events & EPOLLOUT))
+			want_work(pcb);
+	}
+}
+
+/* The poll callbacks, every TCP_EPOLL_POLL_MS */
+static void poll_all(void)
+{
+	struct tcp_pcb *pcb, *next;
+
+	for (pcb = pcbs; pcb; pcb = next) {
+		next = pcb->next;
+		if (pcb->dead)
+			continue;
+		if (pcb->paused) {
+			pcb->paused = 0;
+			update_events(pcb);
+		}
+		/* Give the buffers of idle connections back. */
+		if (pcb->sndlen == 0 && pcb->snd && !pcb->busy) {
+			free(pcb->snd);
+			pcb->snd = NULL;
+			pcb->sndhead = 0;
+		}
+		if (pcb->poll && ++pcb->polltmr >= pcb->pollinterval) {
+			pcb->polltmr = 0;
+			pcb->poll(pcb->callback_arg, pcb);
+			if (!pcb->dead)
+				want_work(pcb);
+		}
+	}
+}
+
+static void reap(void)
+{
+	while (dead) {
+		struct tcp_pcb *pcb = dead;
+
+		dead = pcb->deadnext;
+		free(pcb->snd);
+		free(pcb);
+	}
+}
+
+int tcp_epoll_watch(int fd, void (*ready)(void *arg), void (*flush)(void *arg), void *arg)
+{
+	struct tcp_pcb *pcb;
+
+	if (epoll_open() != 0)
+		return -1;
+	pcb = calloc(1, sizeof(struct tcp_pcb));
+	if (pcb == NULL)
+		return -1;
+	/* Not on the list of connections, so the timers leave it alone. */
+	pcb->fd = fd;
+	pcb->ready = ready;
+	pcb->flush = flush;
+	pcb->callback_arg = arg;
+	update_events(pcb);
+	if (pcb->events == 0) {
+		free(pcb);
+		return -1;
+	}
+	pcb->watchnext = watches;
+	watches = pcb;
+	return 0;
+}
+
+int tcp_epoll_poll(int timeout)
+{
+	struct epoll_event events[TCP_EPOLL_EVENTS];
+	struct tcp_pcb *w;
+	u32_t since;
+	int i, n;
+
+	if (epoll_open() != 0)
+		return -1;
+	/* Whatever was written outside of a callback */
+	settle();
+	for (w = watches; w; w = w->watchnext) {
+		if (w->flush)
+			w->flush(w->callback_arg);
+	}
+	since = sys_now() - lastpoll;
+	if (since >= TCP_EPOLL_POLL_MS)
+		since = TCP_EPOLL_POLL_MS;
+	if (timeout < 0 || timeout > (int) (TCP_EPOLL_POLL_MS - since))
+		timeout = TCP_EPOLL_POLL_MS - since;
+
+	n = epoll_wait(epfd, events, TCP_EPOLL_EVENTS, timeout);
+	if (n < 0 && errno != EINTR)
+		return -1;
+	for (i = 0; i < n; i++) {
+		struct tcp_pcb *pcb = events[i].data.ptr;
+
+		if (pcb->dead)
+			continue;
+		handle(pcb, events[i].events);
+		settle();
+	}
+	if (sys_now() - lastpoll >= TCP_EPOLL_POLL_MS) {
+		lastpoll = sys_now();
+		poll_all();
+		settle();
+	}
+	reap();
+	return 0;
+}
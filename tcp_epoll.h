@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2002 Florian Schulze.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of the contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * tcp_epoll.h - This file is part of the FTP daemon for lwIP
+ *
+ */
+
+#ifndef __TCP_EPOLL_H__
+#define __TCP_EPOLL_H__
+
+/*
+ * ftpd reaches the network only through the part of lwIP's raw TCP API
+ * declared below: tcp_new/bind/listen/accept/connect to set connections
+ * up, the recv, sent, err and poll callbacks, tcp_write/tcp_output/
+ * tcp_sndbuf to send, tcp_recved for flow control and tcp_close/tcp_abort
+ * to end them. With lwIP that is lwIP itself. Building ftpd.c with
+ * FTPD_EPOLL and linking tcp_epoll.c provides the same interface on
+ * nonblocking Linux sockets instead, so the server can run as a normal
+ * process with many sessions on one thread.
+ *
+ * All of ftpd runs on the thread that calls tcp_epoll_poll(), which plays
+ * the part of lwIP's tcpip thread. Like with lwIP:
+ *
+ * - callbacks are never made from inside a tcp_* call, except for the err
+ *   callback from tcp_abort();
+ * - a pcb must not be used after tcp_close(), tcp_abort() or its err
+ *   callback;
+ * - data passed to tcp_write() is sent after the callback returns, and
+ *   the sent callback reports bytes that the kernel has taken. Data is
+ *   always copied, so TCP_WRITE_FLAG_COPY makes no difference.
+ *
+ * Received data is read only while the receive window, TCP_WND, has room;
+ * tcp_recved() opens it again.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Bytes tcp_write() can queue per connection, at most 65535 */
+#ifndef TCP_SND_BUF
+#define TCP_SND_BUF 32768
+#endif
+
+/* Bytes that may be received but not yet tcp_recved(), at most 65535 */
+#ifndef TCP_WND
+#define TCP_WND 65535
+#endif
+
+/* Interval of the poll callbacks, in milliseconds */
+#ifndef TCP_EPOLL_POLL_MS
+#define TCP_EPOLL_POLL_MS 500
+#endif
+
+/* Bytes sent with sendfile() per connection and round of the event loop */
+#ifndef TCP_EPOLL_FILE_BURST
+#define TCP_EPOLL_FILE_BURST (1024 * 1024)
+#endif
+
+#define TCP_MSS 1460
+
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+typedef uint64_t u64_t;
+typedef int8_t s8_t;
+typedef int16_t s16_t;
+typedef int32_t s32_t;
+typedef s8_t err_t;
+
+/* Error codes, with lwIP's values */
+#define ERR_OK 0
+#define ERR_MEM -1
+#define ERR_BUF -2
+#define ERR_TIMEOUT -3
+#define ERR_RTE -4
+#define ERR_INPROGRESS -5
+#define ERR_VAL -6
+#define ERR_WOULDBLOCK -7
+#define ERR_USE -8
+#define ERR_ALREADY -9
+#define ERR_ISCONN -10
+#define ERR_CONN -11
+#define ERR_IF -12
+#define ERR_ABRT -13
+#define ERR_RST -14
+#define ERR_CLSD -15
+#define ERR_ARG -16
+
+/* IPv4 only. Addresses are in network byte order, as in lwIP. */
+struct ip4_addr {
+	u32_t addr;
+};
+typedef struct ip4_addr ip4_addr_t;
+typedef struct ip4_addr ip_addr_t;
+
+#define IPADDR_TYPE_V4 0
+#define IP_SET_TYPE_VAL(ipaddr, iptype)
+#define ip_2_ip4(ipaddr) (ipaddr)
+#define ip4_addr_copy(dest, src) ((dest).addr = (src).addr)
+#define IP4_ADDR(ipaddr, a, b, c, d) \
+	((ipaddr)->addr = (u32_t) (((u32_t) (d) << 24) | ((u32_t) (c) << 16) | \
+		((u32_t) (b) << 8) | (u32_t) (a)))
+#define ip4_addr1(ipaddr) (((const u8_t *) &(ipaddr)->addr)[0])
+#define ip4_addr2(ipaddr) (((const u8_t *) &(ipaddr)->addr)[1])
+#define ip4_addr3(ipaddr) (((const u8_t *) &(ipaddr)->addr)[2])
+#define ip4_addr4(ipaddr) (((const u8_t *) &(ipaddr)->addr)[3])
+
+extern const ip_addr_t ip_addr_any;
+#define IP_ADDR_ANY (&ip_addr_any)
+
+/* Received data. Each pbuf of a chain is allocated on its own. */
+struct pbuf {
+	struct pbuf *next;
+	void *payload;
+	u16_t tot_len;
+	u16_t len;
+	u16_t ref;
+};
+
+u8_t pbuf_free(struct pbuf *p);
+void pbuf_cat(struct pbuf *head, struct pbuf *tail);
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset);
+
+enum tcp_state {
+	CLOSED,
+	LISTEN,
+	SYN_SENT,
+	SYN_RCVD,
+	ESTABLISHED,
+	FIN_WAIT_1,
+	FIN_WAIT_2,
+	CLOSE_WAIT,
+	CLOSING,
+	LAST_ACK,
+	TIME_WAIT
+};
+
+#define TCP_WRITE_FLAG_COPY 0x01
+#define TCP_WRITE_FLAG_MORE 0x02
+
+#define TCP_PRIO_MIN 1
+#define TCP_PRIO_NORMAL 64
+#define TCP_PRIO_MAX 127
+
+struct tcp_pcb;
+
+typedef err_t (*tcp_accept_fn)(void *arg, struct tcp_pcb *newpcb, err_t err);
+typedef err_t (*tcp_connected_fn)(void *arg, struct tcp_pcb *tpcb, err_t err);
+typedef err_t (*tcp_recv_fn)(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err);
+typedef err_t (*tcp_sent_fn)(void *arg, struct tcp_pcb *tpcb, u16_t len);
+typedef err_t (*tcp_poll_fn)(void *arg, struct tcp_pcb *tpcb);
+typedef void (*tcp_err_fn)(void *arg, err_t err);
+
+struct tcp_pcb {
+	/* The fields that ftpd reads */
+	ip_addr_t local_ip;
+	ip_addr_t remote_ip;
+	u16_t local_port;
+	u16_t remote_port;
+	enum tcp_state state;
+
+	/* The rest belongs to tcp_epoll.c */
+	int fd;
+	void *callback_arg;
+	tcp_accept_fn accept;
+	tcp_connected_fn connected;
+	tcp_recv_fn recv;
+	tcp_sent_fn sent;
+	tcp_poll_fn poll;
+	tcp_err_fn errf;
+	u8_t pollinterval;
+	u8_t polltmr;
+	u32_t events;		/* epoll events asked for */
+	char *snd;		/* ring of TCP_SND_BUF bytes */
+	u32_t sndhead;
+	u32_t sndlen;
+	u8_t sndmore;		/* the last tcp_write had TCP_WRITE_FLAG_MORE */
+	u32_t acked;		/* taken by the kernel, not yet reported */
+	u16_t rcv_wnd;
+	u8_t eof;		/* the peer has closed its side */
+	u8_t closing;		/* tcp_close() with data still queued */
+	u8_t dead;		/* freed once the current event round ends */
+	u8_t busy;		/* on the work list */
+	u8_t paused;		/* listener out of file descriptors */
+	u8_t failed;		/* sending failed, reported from the event loop */
+	u8_t file;		/* sending filefd after the ring */
+	u8_t fileall;		/* ... up to its end rather than fileleft bytes */
+	int filefd;
+	u64_t fileoff;
+	u64_t fileleft;
+	u8_t sink;		/* received data goes to sinkfd instead */
+	int sinkfd;
+	int pipefd[2];
+	void (*ready)(void *arg);	/* set for tcp_epoll_watch() */
+	void (*flush)(void *arg);
+	struct tcp_pcb *worknext;
+	struct tcp_pcb *deadnext;
+	struct tcp_pcb *prev, *next;	/* all live pcbs */
+	struct tcp_pcb *watchnext;
+};
+
+struct tcp_pcb *tcp_new(void);
+err_t tcp_bind(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port);
+struct tcp_pcb *tcp_listen(struct tcp_pcb *pcb);
+err_t tcp_connect(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port, tcp_connected_fn connected);
+void tcp_arg(struct tcp_pcb *pcb, void *arg);
+void tcp_accept(struct tcp_pcb *pcb, tcp_accept_fn accept);
+void tcp_recv(struct tcp_pcb *pcb, tcp_recv_fn recv);
+void tcp_sent(struct tcp_pcb *pcb, tcp_sent_fn sent);
+void tcp_err(struct tcp_pcb *pcb, tcp_err_fn errf);
+void tcp_poll(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval);
+err_t tcp_write(struct tcp_pcb *pcb, const void *dataptr, u16_t len, u8_t apiflags);
+err_t tcp_output(struct tcp_pcb *pcb);
+u16_t tcp_sndbuf(struct tcp_pcb *pcb);
+void tcp_recved(struct tcp_pcb *pcb, u16_t len);
+void tcp_nagle_disable(struct tcp_pcb *pcb);
+void tcp_setprio(struct tcp_pcb *pcb, u8_t prio);
+err_t tcp_close(struct tcp_pcb *pcb);
+void tcp_abort(struct tcp_pcb *pcb);
+
+const char *lwip_strerr(err_t err);
+
+/* Milliseconds from a monotonic clock */
+u32_t sys_now(void);
+
+/*
+ * Wait up to timeout milliseconds (-1 for as long as it takes, but never
+ * past the next poll callback) and handle what happened on all
+ * connections. Returns -1 if epoll failed, otherwise 0.
+ */
+int tcp_epoll_poll(int timeout);
+
+/*
+ * Have the event loop watch another file descriptor, such as one for
+ * storage I/O that completes asynchronously: ready is called when fd is
+ * readable and flush, if not NULL, each time before the loop waits.
+ * Both run like TCP callbacks. Returns 0, or -1 on failure.
+ */
+int tcp_epoll_watch(int fd, void (*ready)(void *arg), void (*flush)(void *arg), void *arg);
+
+/*
+ * Zero-copy transfers between connections and files. They are not part
+ * of lwIP's API.
+ *
+ * tcp_epoll_sendfile() queues len bytes of the file fd from offset on
+ * (len 0 for up to the end of the file), to be sent with sendfile() after
+ * what has been written. The sent callback reports them like written
+ * data. tcp_write() fails with ERR_MEM while a file is queued;
+ * tcp_epoll_sendfile_left() tells whether it is. tcp_close() drops what
+ * is left of the file, so wait for it to be sent before closing. As
+ * sendfile() can't be kept from raising SIGPIPE, tcp_epoll ignores SIGPIPE
+ * for the whole process when it starts, unless the application has
+ * installed a handler for it.
+ *
+ * tcp_epoll_splice() has all data that arrives from now on written to
+ * the file fd at its current position, moved by splice() through a pipe.
+ * The recv callback then only gets the end of the stream: p is NULL, and
+ * err is ERR_OK, or ERR_BUF if writing the file failed.
+ */
+err_t tcp_epoll_sendfile(struct tcp_pcb *pcb, int fd, u64_t offset, u64_t len);
+int tcp_epoll_sendfile_left(struct tcp_pcb *pcb);
+err_t tcp_epoll_splice(struct tcp_pcb *pcb, int fd);
+
+#endif /* __TCP_EPOLL_H__ */
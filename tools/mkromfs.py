@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+"""Pack a directory tree into a C source file for the vfs_romfs backend.
+
+Usage: mkromfs.py <directory> <output.c>
+
+The entries are emitted sorted by path (byte order, as compared by strcmp)
+so that vfs_romfs.c can look them up with bsearch. Each directory links
+to its first child and each entry to its next sibling for vfs_readdir.
+File modification times are taken from the tree unless SOURCE_DATE_EPOCH
+is set, which makes the output reproducible.
+"""
+
+import os
+import sys
+
+
+def collect(root):
+    entries = {"": None}
+    for dirpath, dirnames, filenames in os.walk(root):
+        dirnames.sort()
+        rel = os.path.relpath(dirpath, root)
+        rel = "" if rel == "." else rel.replace(os.sep, "/")
+        entries[rel] = None
+        for f in filenames:
+            path = f if not rel else rel + "/" + f
+            entries[path] = os.path.join(dirpath, f)
+    return entries
+
+
+def c_string(s):
+    out = '"'
+    for b in s.encode("utf-8"):
+        c = chr(b)
+        if c in '"\\':
+            out += "\\" + c
+        elif 32 <= b < 127 and c != "?":
+            out += c
+        else:
+            out += "\\%03o" % b
+    return out + '"'
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write(__doc__)
+        return 1
+    root, output = sys.argv[1], sys.argv[2]
+    entries = collect(root)
+    paths = sorted(entries, key=lambda p: p.encode("utf-8"))
+    index = {p: i for i, p in enumerate(paths)}
+    epoch = os.environ.get("SOURCE_DATE_EPOCH")
+
+    first_child = [-1] * len(paths)
+    next_sibling = [-1] * len(paths)
+    last_child = {}
+    for i, p in enumerate(paths):
+        if p == "":
+            continue
+        parent = index[p.rsplit("/", 1)[0] if "/" in p else ""]
+        if parent in last_child:
+            next_sibling[last_child[parent]] = i
+        else:
+            first_child[parent] = i
+        last_child[parent] = i
+
+    with open(output, "w") as out:
+        out.write("/* Generated by tools/mkromfs.py from %s. Do not edit. */\n\n" % os.path.basename(os.path.abspath(root)))
+        out.write('#include "vfs_romfs.h"\n\n')
+        for i, p in enumerate(paths):
+            if entries[p] is None:
+                continue
+            with open(entries[p], "rb") as f:
+                data = f.read()
+            out.write("static const unsigned char data%d[] = {" % i)
+            for j in range(0, len(data), 16):
+                out.write("\n\t" + ", ".join("0x%02x" % b for b in data[j:j + 16]) + ",")
+            out.write("\n\t0\n};\n\n")
+
+        out.write("const vfs_romfs_entry_t vfs_romfs_entries[] = {\n")
+        for i, p in enumerate(paths):
+            src = entries[p]
+            if src is None:
+                st = os.stat(os.path.join(root, *p.split("/")) if p else root)
+                data, size, mode = "NULL", 0, "VFS_ROMFS_DIR"
+            else:
+                st = os.stat(src)
+                data, size, mode = "data%d" % i, st.st_size, "0"
+            mtime = int(epoch) if epoch else int(st.st_mtime)
+            out.write("\t{%s, %s, %dUL, %dUL, %s, %d, %d},\n" % (
+                c_string(p), data, size, mtime, mode, first_child[i], next_sibling[i]))
+        out.write("};\n\n")
+        out.write("const int vfs_romfs_count = %d;\n" % len(paths))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""Check TYPE A uploads against a running server.
+
+Usage: test_stor_ascii.py [host [port [max_size]]]
+
+Uploads a file of every size from 0 to max_size bytes (default 2400) in
+TYPE A and reads it back in TYPE I, which has to give the upload with its
+CRLFs turned into LFs. The sizes cover every position at which an upload
+can end relative to the stage buffers (FTPD_PIPE_BUF) and the wrap-around
+of the default data FIFO, including the ones where the last of the data
+fills the room left in the FIFO exactly. The files are named
+stor_ascii.txt in the login directory, which needs to be writable.
+"""
+
+import ftplib
+import io
+import sys
+
+
+def text(size):
+    # Lines of different lengths, with a lone CR now and then, which is
+    # data and has to arrive as it was sent.
+    out = bytearray()
+    i = 0
+    while len(out) < size:
+        out += b"x" * (i % 13) + (b"\r" if i % 7 == 3 else b"") + b"\r\n"
+        i += 1
+    return bytes(out[:size])
+
+
+def main():
+    host = sys.argv[1] if len(sys.argv) > 1 else "127.0.0.1"
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 21
+    max_size = int(sys.argv[3]) if len(sys.argv) > 3 else 2400
+
+    ftp = ftplib.FTP()
+    ftp.connect(host, port, timeout=30)
+    ftp.login("anonymous", "test")
+    failed = 0
+    for size in range(max_size + 1):
+        data = text(size)
+        # storbinary() would switch to TYPE I first.
+        ftp.sendcmd("TYPE A")
+        conn = ftp.transfercmd("STOR stor_ascii.txt")
+        conn.sendall(data)
+        conn.close()
+        ftp.voidresp()
+        got = io.BytesIO()
+        ftp.retrbinary("RETR stor_ascii.txt", got.write)
+        if got.getvalue() != data.replace(b"\r\n", b"\n"):
+            print("size %d: stored %d bytes, expected %d"
+                  % (size, len(got.getvalue()), len(data.replace(b"\r\n", b"\n"))))
+            failed += 1
+    ftp.delete("stor_ascii.txt")
+    ftp.quit()
+    print("%d of %d sizes failed" % (failed, max_size + 1))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
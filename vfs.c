@@ -25,6 +25,7 @@
  */
 
 #include "vfs.h"
+#include "ftpd.h"
 #include <src/ff.h>
 #include <string.h>
 #include <stdlib.h>
@@ -36,6 +37,480 @@ vfs_dirent_t dir_ent;
 
 FIL guard_for_the_whole_fs;
 
+/* What a file opened for writing is allocated as; the FIL comes first, so
+ * that the vfs_file_t* handed out points at it. */
+struct vfs_wfile {
+	FIL fil;
+	BYTE buf[_MAX_SS];	/* segments collected by vfs_writev() */
+};
+
+/* Directories hold a lock slot with _FS_LOCK until they are closed;
+ * f_closedir() came with it in FatFs R0.10.
+ */
+#ifdef _FS_LOCK
+#define close_dir(dir) f_closedir(dir)
+#else
+#define close_dir(dir) ((void)0)
+#endif
+
+#if VFS_FAT_INDEX
+/* Name index for large directories.
+ *
+ * FatFs finds a name by reading its directory from the start, which takes
+ * milliseconds once there are thousands of entries. The first lookup in a
+ * directory reads it once and keeps the entries in a hash table, so that
+ * vfs_stat() is answered from RAM afterwards, including "no such file".
+ * FatFs cannot open a file by its entry, so vfs_open() still searches.
+ *
+ * Only changes made through this file are seen; call vfs_index_invalidate()
+ * after writing to the volume directly. Names are compared ignoring ASCII
+ * case like FAT does; paths with other characters bypass the index.
+ * Whole directories are dropped, least recently used first, to stay within
+ * VFS_FAT_INDEX_BUDGET bytes. Like the rest of this file, it expects to be
+ * called from one thread at a time.
+ */
+
+#ifndef VFS_FAT_INDEX_BUDGET
+#define VFS_FAT_INDEX_BUDGET 32768
+#endif
+
+/* Longest path that is indexed, including the working directory. */
+#ifndef VFS_FAT_INDEX_PATH
+#define VFS_FAT_INDEX_PATH 256
+#endif
+
+struct index_entry {
+	struct index_entry* next;	/* hash chain */
+	struct index_entry* twin;	/* other name of the same entry, if any */
+	DWORD fsize;
+	WORD fdate;
+	WORD ftime;
+	BYTE fattrib;
+	char name[1];
+};
+
+/* A directory without buckets didn't fit into the budget. It is kept so
+ * that it isn't read again on every lookup. */
+struct index_dir {
+	struct index_dir* prev;	/* LRU list, most recently used first */
+	struct index_dir* next;
+	struct index_entry** buckets;
+	unsigned nbuckets;
+	unsigned count;
+	size_t bytes;
+	char path[1];
+};
+
+/* Files open for writing; their directories are not answered from the
+ * index until they are closed, because their entries keep changing. */
+struct index_writer {
+	struct index_writer* next;
+	vfs_file_t* file;
+	char path[1];
+};
+
+static struct index_dir* index_lru;
+static struct index_writer* index_writers;
+static size_t index_bytes;
+static char index_cwd[VFS_FAT_INDEX_PATH];
+#if _USE_LFN
+static char index_lfn[_MAX_LFN + 1];
+#endif
+
+static unsigned index_hash(const char* s) {
+	unsigned h = 2166136261u;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Upper-case a name in place. Return nonzero if it is not plain ASCII. */
+static int index_fold(char* s) {
+	for (; *s; s++) {
+		if ((unsigned char)*s >= 0x80) return 1;
+		if (*s >= 'a' && *s <= 'z') *s -= 'a' - 'A';
+	}
+	return 0;
+}
+
+/* Turn a path into "DIR\0NAME" in buf, with DIR absolute and folded, and
+ * point *leaf at NAME. Return nonzero if the index can't be used for it.
+ */
+static int index_key(const char* path, char* buf, char** leaf) {
+	char* slash;
+	size_t n = 0;
+
+	if (*path != '/') {
+		if (index_cwd[0] == 0) {
+			if (f_getcwd(index_cwd, sizeof(index_cwd)) != FR_OK) {
+				index_cwd[0] = 0;
+				return 1;
+			}
+		}
+		n = strlen(index_cwd);
+		/* One volume only, so a drive prefix carries no information. */
+		if (n >= 2 && index_cwd[1] == ':' && _VOLUMES == 1) {
+			memcpy(buf, index_cwd + 2, n - 2);
+			n -= 2;
+		} else {
+			memcpy(buf, index_cwd, n);
+		}
+		if (n == 0 || buf[n - 1] != '/') buf[n++] = '/';
+	}
+	if (n + strlen(path) + 1 > VFS_FAT_INDEX_PATH) return 1;
+	strcpy(buf + n, path);
+	if (index_fold(buf) || strchr(buf, ':')) return 1;
+	if (strstr(buf, "//") || strstr(buf, "/./") || strstr(buf, "/../")) return 1;
+
+	slash = strrchr(buf, '/');
+	*slash = 0;
+	*leaf = slash + 1;
+	if (**leaf == 0 || strcmp(*leaf, ".") == 0 || strcmp(*leaf, "..") == 0) return 1;
+	return 0;
+}
+
+static void index_touch(struct index_dir* di) {
+	if (di == index_lru) return;
+	di->prev->next = di->next;
+	if (di->next) di->next->prev = di->prev;
+	di->prev = NULL;
+	di->next = index_lru;
+	index_lru->prev = di;
+	index_lru = di;
+}
+
+static struct index_dir* index_find(const char* dir) {
+	struct index_dir* di;
+
+	for (di = index_lru; di; di = di->next) {
+		if (strcmp(di->path, dir) == 0) {
+			index_touch(di);
+			return di;
+		}
+	}
+	return NULL;
+}
+
+static void index_clear(struct index_dir* di) {
+	size_t size = sizeof(struct index_dir) + strlen(di->path);
+	unsigned i;
+
+	for (i = 0; i < di->nbuckets; i++) {
+		while (di->buckets[i]) {
+			struct index_entry* e = di->buckets[i];
+			di->buckets[i] = e->next;
+			ftpd_free(NULL, e);
+		}
+	}
+	ftpd_free(NULL, di->buckets);
+	di->buckets = NULL;
+	di->nbuckets = 0;
+	di->count = 0;
+	index_bytes -= di->bytes - size;
+	di->bytes = size;
+}
+
+static void index_drop(struct index_dir* di) {
+	index_clear(di);
+	if (di->prev) di->prev->next = di->next;
+	else index_lru = di->next;
+	if (di->next) di->next->prev = di->prev;
+	index_bytes -= di->bytes;
+	ftpd_free(NULL, di);
+}
+
+/* Make room for n more bytes by dropping other directories. */
+static int index_reserve(size_t n, struct index_dir* keep) {
+	struct index_dir* di = index_lru;
+
+	while (di && di->next) di = di->next;
+	while (index_bytes + n > VFS_FAT_INDEX_BUDGET && di) {
+		struct index_dir* prev = di->prev;
+		if (di != keep) index_drop(di);
+		di = prev;
+	}
+	return index_bytes + n > VFS_FAT_INDEX_BUDGET;
+}
+
+static struct index_entry* index_get(struct index_dir* di, const char* leaf) {
+	struct index_entry* e;
+
+	if (!di->buckets) return NULL;
+	e = di->buckets[index_hash(leaf) & (di->nbuckets - 1)];
+	while (e && strcmp(e->name, leaf) != 0) e = e->next;
+	return e;
+}
+
+static int index_grow(struct index_dir* di) {
+	unsigned n = di->nbuckets * 2;
+	struct index_entry** b;
+	unsigned i;
+
+	if (index_reserve(n * sizeof(*b) / 2, di)) return 1;
+	b = ftpd_alloc(NULL, n * sizeof(*b));
+	if (!b) return 1;
+	memset(b, 0, n * sizeof(*b));
+	for (i = 0; i < di->nbuckets; i++) {
+		while (di->buckets[i]) {
+			struct index_entry* e = di->buckets[i];
+			unsigned h = index_hash(e->name) & (n - 1);
+			di->buckets[i] = e->next;
+			e->next = b[h];
+			b[h] = e;
+		}
+	}
+	ftpd_free(NULL, di->buckets);
+	di->buckets = b;
+	di->bytes += di->nbuckets * sizeof(*b);
+	index_bytes += di->nbuckets * sizeof(*b);
+	di->nbuckets = n;
+	return 0;
+}
+
+static struct index_entry* index_insert(struct index_dir* di, const char* leaf, const FILINFO* fi) {
+	size_t len = strlen(leaf);
+	size_t size = sizeof(struct index_entry) + len;
+	struct index_entry* e;
+	unsigned h;
+
+	if (di->count >= di->nbuckets * 2 && index_grow(di)) return NULL;
+	if (index_reserve(size, di)) return NULL;
+	e = ftpd_alloc(NULL, size);
+	if (!e) return NULL;
+	memcpy(e->name, leaf, len + 1);
+	e->twin = NULL;
+	e->fsize = fi->fsize;
+	e->fdate = fi->fdate;
+	e->ftime = fi->ftime;
+	e->fattrib = fi->fattrib;
+	h = index_hash(leaf) & (di->nbuckets - 1);
+	e->next = di->buckets[h];
+	di->buckets[h] = e;
+	di->count++;
+	di->bytes += size;
+	index_bytes += size;
+	return e;
+}
+
+/* Add a directory entry under its short and, if it has one, long name.
+ * Names that aren't ASCII are left out; lookups for them bypass the index.
+ */
+static int index_add(struct index_dir* di, FILINFO* fi) {
+	struct index_entry* e = NULL;
+	char name[sizeof(fi->fname)];
+
+	strcpy(name, fi->fname);
+	if (!index_fold(name)) {
+		e = index_insert(di, name, fi);
+		if (!e) return 1;
+	}
+#if _USE_LFN
+	if (fi->lfname && fi->lfname[0] && !index_fold(fi->lfname) && strcmp(fi->lfname, name) != 0) {
+		struct index_entry* l = index_insert(di, fi->lfname, fi);
+		if (!l) return 1;
+		l->twin = e;
+		if (e) e->twin = l;
+	}
+#endif
+	return 0;
+}
+
+static void index_unlink(struct index_dir* di, struct index_entry* e) {
+	struct index_entry** p = &di->buckets[index_hash(e->name) & (di->nbuckets - 1)];
+	size_t size = sizeof(struct index_entry) + strlen(e->name);
+
+	while (*p != e) p = &(*p)->next;
+	*p = e->next;
+	di->count--;
+	di->bytes -= size;
+	index_bytes -= size;
+	ftpd_free(NULL, e);
+}
+
+static void index_remove(struct index_dir* di, const char* leaf) {
+	struct index_entry* e = index_get(di, leaf);
+
+	if (!e) return;
+	if (e->twin) index_unlink(di, e->twin);
+	index_unlink(di, e);
+}
+
+static void index_setlfn(FILINFO* fi) {
+#if _USE_LFN
+	fi->lfname = index_lfn;
+	fi->lfsize = sizeof(index_lfn);
+#endif
+}
+
+/* Read a whole directory into a new index. */
+static struct index_dir* index_build(const char* dir) {
+	size_t len = strlen(dir);
+	size_t size = sizeof(struct index_dir) + len + 16 * sizeof(struct index_entry*);
+	struct index_dir* di;
+	DIR d;
+	FILINFO fi;
+
+	if (index_reserve(size, NULL)) return NULL;
+	di = ftpd_alloc(NULL, sizeof(struct index_dir) + len);
+	if (!di) return NULL;
+	di->buckets = ftpd_alloc(NULL, 16 * sizeof(struct index_entry*));
+	if (!di->buckets) {
+		ftpd_free(NULL, di);
+		return NULL;
+	}
+	memset(di->buckets, 0, 16 * sizeof(struct index_entry*));
+	memcpy(di->path, dir, len + 1);
+	di->nbuckets = 16;
+	di->count = 0;
+	di->bytes = size;
+	index_bytes += size;
+	di->prev = NULL;
+	di->next = index_lru;
+	if (index_lru) index_lru->prev = di;
+	index_lru = di;
+
+	if (f_opendir(&d, len ? dir : "/") != FR_OK) goto fail;
+	for (;;) {
+		index_setlfn(&fi);
+		if (f_readdir(&d, &fi) != FR_OK) {
+			close_dir(&d);
+			goto fail;
+		}
+		if (fi.fname[0] == 0) break;
+		if (strcmp(fi.fname, ".") == 0 || strcmp(fi.fname, "..") == 0) continue;
+		if (index_add(di, &fi)) {
+			index_clear(di);
+			break;
+		}
+	}
+	close_dir(&d);
+	return di;
+
+fail:
+	index_drop(di);
+	return NULL;
+}
+
+static int index_writing(const char* dir) {
+	size_t len = strlen(dir);
+	struct index_writer* w;
+
+	for (w = index_writers; w; w = w->next) {
+		if (strncmp(w->path, dir, len) == 0 && w->path[len] == '/' && !strchr(w->path + len + 1, '/'))
+			return 1;
+	}
+	return 0;
+}
+
+/* Return 0 and fill *fi if found, 1 if there is no such entry, and -1 if
+ * the index doesn't know.
+ */
+static int index_lookup(const char* path, FILINFO* fi) {
+	char buf[VFS_FAT_INDEX_PATH];
+	char* leaf;
+	struct index_dir* di;
+	struct index_entry* e;
+
+	if (index_key(path, buf, &leaf) || index_writing(buf)) return -1;
+	di = index_find(buf);
+	if (!di) di = index_build(buf);
+	if (!di || !di->buckets) return -1;
+	e = index_get(di, leaf);
+	if (!e) return 1;
+	fi->fsize = e->fsize;
+	fi->fdate = e->fdate;
+	fi->ftime = e->ftime;
+	fi->fattrib = e->fattrib;
+	return 0;
+}
+
+/* An entry was created or changed: read it again if its directory is
+ * indexed. */
+static void index_update(const char* path) {
+	char buf[VFS_FAT_INDEX_PATH];
+	char* leaf;
+	struct index_dir* di;
+	FILINFO fi;
+
+	if (index_key(path, buf, &leaf)) {
+		/* Unknown directory, so start over. */
+		vfs_index_invalidate();
+		return;
+	}
+	di = index_find(buf);
+	if (!di || !di->buckets) return;
+	index_remove(di, leaf);
+	index_setlfn(&fi);
+	if (f_stat(path, &fi) != FR_OK) return;
+	if (index_add(di, &fi)) index_clear(di);
+}
+
+/* An entry is gone. If it was a directory, so are the indexes below it. */
+static void index_forget(const char* path) {
+	char buf[VFS_FAT_INDEX_PATH];
+	char* leaf;
+	struct index_dir* di;
+	size_t len;
+
+	if (index_key(path, buf, &leaf)) {
+		vfs_index_invalidate();
+		return;
+	}
+	di = index_find(buf);
+	if (di) index_remove(di, leaf);
+
+	leaf[-1] = '/';
+	len = strlen(buf);
+	di = index_lru;
+	while (di) {
+		struct index_dir* next = di->next;
+		if (strncmp(di->path, buf, len) == 0 && (di->path[len] == 0 || di->path[len] == '/'))
+			index_drop(di);
+		di = next;
+	}
+}
+
+/* Remember a file opened for writing, by absolute path in case the
+ * working directory changes before it is closed. */
+static int index_open_write(vfs_file_t* file, const char* path) {
+	char buf[VFS_FAT_INDEX_PATH];
+	char* leaf;
+	struct index_writer* w;
+
+	if (index_key(path, buf, &leaf)) {
+		vfs_index_invalidate();
+		return 0;
+	}
+	leaf[-1] = '/';
+	w = ftpd_alloc(NULL, sizeof(*w) + strlen(buf));
+	if (!w) return 1;
+	strcpy(w->path, buf);
+	w->file = file;
+	w->next = index_writers;
+	index_writers = w;
+	return 0;
+}
+
+static void index_close_write(vfs_file_t* file) {
+	struct index_writer** p = &index_writers;
+
+	while (*p && (*p)->file != file) p = &(*p)->next;
+	if (*p) {
+		struct index_writer* w = *p;
+		*p = w->next;
+		index_update(w->path);
+		ftpd_free(NULL, w);
+	}
+}
+
+void vfs_index_invalidate(void) {
+	while (index_lru) index_drop(index_lru);
+	index_cwd[0] = 0;
+}
+#endif
+
 int vfs_read (void* buffer, int dummy, int len, vfs_file_t* file) {
 	unsigned int bytesread;
 	FRESULT r = f_read(file, buffer, len, &bytesread);
@@ -60,9 +535,17 @@ int vfs_stat(vfs_t* vfs, const char* filename, vfs_stat_t* st) {
 #if _USE_LFN
 	f.lfname = NULL;
 #endif
+#if VFS_FAT_INDEX
+	int r = index_lookup(filename, &f);
+	if (r > 0) return 1;
+	if (r < 0 && FR_OK != f_stat(filename, &f)) {
+		return 1;
+	}
+#else
 	if (FR_OK != f_stat(filename, &f)) {
 		return 1;
 	}
+#endif
 	st->st_size = f.fsize;
 	st->st_mode = f.fattrib;
 	st->st_mtime.date = f.fdate;
@@ -70,12 +553,36 @@ int vfs_stat(vfs_t* vfs, const char* filename, vfs_stat_t* st) {
 	return 0;
 }
 
+/* Storage calls are cheapest when they cover whole clusters. We get at the
+ * volume through a directory object because f_getfree() may scan the FAT.
+ */
+int vfs_io_hints(vfs_t* vfs, const char* path, vfs_io_hints_t* hints) {
+	DIR dir;
+	UINT ss = 512;
+
+	hints->optimal_size = 512;
+	hints->alignment = 512;
+	if (FR_OK != f_opendir(&dir, "")) {
+		return 1;
+	}
+#if _MAX_SS != 512
+	ss = dir.fs->ssize;
+#endif
+	hints->optimal_size = (size_t)dir.fs->csize * ss;
+	hints->alignment = ss;
+	close_dir(&dir);
+	return 0;
+}
+
 void vfs_close(vfs_t* vfs) {
 }
 
 void vfs_close_file(vfs_file_t* file) {
-	f_close(vfs);
-	free(vfs);
+	f_close(file);
+#if VFS_FAT_INDEX
+	index_close_write(file);
+#endif
+	ftpd_free(ftpd_mem_owner, file);
 }
 
 int vfs_write (void* buffer, int dummy, int len, vfs_file_t* file) {
@@ -85,48 +592,135 @@ int vfs_write (void* buffer, int dummy, int len, vfs_file_t* file) {
 	return byteswritten;
 }
 
+/* Small segments are collected into one sector before they are handed to
+ * FatFs so that a chain of tiny buffers doesn't cost one f_write each.
+ * The sector belongs to the file, which has to be opened with "w".
+ */
+int vfs_writev(vfs_file_t* file, const vfs_iovec_t* iov, int iovcnt) {
+	BYTE* buf = ((struct vfs_wfile*)file)->buf;
+	UINT fill = 0;
+	UINT written;
+	int total = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		const BYTE* p = iov[i].base;
+		UINT len = iov[i].len;
+
+		while (len > 0) {
+			UINT n;
+
+			if (fill == 0 && len >= _MAX_SS) {
+				if (f_write(file, p, len, &written) != FR_OK) return total;
+				total += written;
+				if (written != len) return total;
+				break;
+			}
+
+			n = _MAX_SS - fill;
+			if (n > len) n = len;
+			memcpy(buf + fill, p, n);
+			fill += n;
+			p += n;
+			len -= n;
+
+			if (fill == _MAX_SS) {
+				if (f_write(file, buf, fill, &written) != FR_OK) return total;
+				total += written;
+				if (written != fill) return total;
+				fill = 0;
+			}
+		}
+	}
+
+	if (fill > 0) {
+		if (f_write(file, buf, fill, &written) != FR_OK) return total;
+		total += written;
+	}
+	return total;
+}
+
 vfs_t* vfs_openfs() {
 	return &guard_for_the_whole_fs;
 }
 
 vfs_file_t* vfs_open(vfs_t* vfs, const char* filename, const char* mode) {
-	vfs_file_t *f = malloc(sizeof(vfs_file_t));
+	vfs_file_t *f;
 	BYTE flags = 0;
 	while (*mode != '\0') {
 		if (*mode == 'r') flags |= FA_READ;
 		if (*mode == 'w') flags |= FA_WRITE | FA_CREATE_ALWAYS;
 		mode++;
 	}
+	f = ftpd_alloc(ftpd_mem_owner, (flags & FA_WRITE) ? sizeof(struct vfs_wfile) : sizeof(vfs_file_t));
+	if (f == NULL) return NULL;
 	FRESULT r = f_open(f, filename, flags);
 	if (FR_OK != r) {
-		free(f);
+		ftpd_free(ftpd_mem_owner, f);
 		return NULL;
 	}
+#if VFS_FAT_INDEX
+	if ((flags & FA_WRITE) && index_open_write(f, filename)) {
+		f_close(f);
+		ftpd_free(ftpd_mem_owner, f);
+		return NULL;
+	}
+#endif
 	return f;
 }
 
+#if VFS_FAT_INDEX
+int vfs_rename(vfs_t* vfs, const char* from, const char* to) {
+	FRESULT r = f_rename(from, to);
+	if (r == FR_OK) {
+		index_forget(from);
+		index_update(to);
+	}
+	return r;
+}
+
+int vfs_mkdir(vfs_t* vfs, const char* name, int mode) {
+	FRESULT r = f_mkdir(name);
+	if (r == FR_OK) index_update(name);
+	return r;
+}
+
+int vfs_remove(vfs_t* vfs, const char* name) {
+	FRESULT r = f_unlink(name);
+	if (r == FR_OK) index_forget(name);
+	return r;
+}
+
+int vfs_chdir(vfs_t* vfs, const char* dir) {
+	FRESULT r = f_chdir(dir);
+	if (r == FR_OK) index_cwd[0] = 0;
+	return r;
+}
+#endif
+
 char* vfs_getcwd(vfs_t* vfs, void* dummy1, int dummy2) {
-	char* cwd = malloc(255);
+	char* cwd = ftpd_alloc(ftpd_mem_owner, 255);
 	FRESULT r = f_getcwd(cwd, 255);
 	if (r != FR_OK) {
-		free(cwd);
+		ftpd_free(ftpd_mem_owner, cwd);
 		return NULL;
 	}
 	return cwd;
 }
 
 vfs_dir_t* vfs_opendir(vfs_t* vfs, const char* path) {
-	vfs_dir_t* dir = malloc(sizeof *dir);
+	vfs_dir_t* dir = ftpd_alloc(ftpd_mem_owner, sizeof *dir);
 	FRESULT r = f_opendir(dir, path);
 	if (FR_OK != r) {
-		free(dir);
+		ftpd_free(ftpd_mem_owner, dir);
 		return NULL;
 	}
 	return dir;
 }
 
 void vfs_closedir(vfs_dir_t* dir) {
-	free(dir);
+	close_dir(dir);
+	ftpd_free(ftpd_mem_owner, dir);
 }
 
 struct tm dummy = {
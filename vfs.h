@@ -49,6 +49,14 @@ typedef struct {
 	char name[13];
 } vfs_dirent_t;
 typedef FIL vfs_t;
+typedef struct {
+	void* base;
+	size_t len;
+} vfs_iovec_t;
+typedef struct {
+	size_t optimal_size;
+	size_t alignment;
+} vfs_io_hints_t;
 
 struct tm {
   int tm_year;
@@ -60,25 +68,44 @@ struct tm {
 
 #define time(x)
 #define vfs_eof f_eof
+#define vfs_rewind(file) f_lseek(file, 0)
+#define vfs_seek(file, offset) f_lseek(file, offset)
 #define VFS_ISDIR(st_mode) ((st_mode) & AM_DIR)
 #define VFS_ISREG(st_mode) !((st_mode) & AM_DIR)
-#define vfs_rename(vfs, from, to) f_rename(from, to)
 #define VFS_IRWXU 0
 #define VFS_IRWXG 0
 #define VFS_IRWXO 0
+
+/* Keep a name index of large directories in RAM, see vfs.c */
+#ifndef VFS_FAT_INDEX
+#define VFS_FAT_INDEX 0
+#endif
+
+#if VFS_FAT_INDEX
+int vfs_rename(vfs_t* vfs, const char* from, const char* to);
+int vfs_mkdir(vfs_t* vfs, const char* name, int mode);
+int vfs_remove(vfs_t* vfs, const char* name);
+#define vfs_rmdir(vfs, name) vfs_remove(vfs, name)
+int vfs_chdir(vfs_t* vfs, const char* dir);
+void vfs_index_invalidate(void);
+#else
+#define vfs_rename(vfs, from, to) f_rename(from, to)
 #define vfs_mkdir(vfs, name, mode) f_mkdir(name)
 #define vfs_rmdir(vfs, name) f_unlink(name)
 #define vfs_remove(vfs, name) f_unlink(name)
 #define vfs_chdir(vfs, dir) f_chdir(dir)
+#endif
 char* vfs_getcwd(vfs_t* vfs, void*, int dummy);
 int vfs_read (void* buffer, int dummy, int len, vfs_file_t* file);
 int vfs_write (void* buffer, int dummy, int len, vfs_file_t* file);
+int vfs_writev(vfs_file_t* file, const vfs_iovec_t* iov, int iovcnt);
 vfs_dirent_t* vfs_readdir(vfs_dir_t* dir);
 vfs_file_t* vfs_open(vfs_t* vfs, const char* filename, const char* mode);
 vfs_t* vfs_openfs();
 void vfs_close(vfs_t* vfs);
-void vfs_close_file(vfs_file_t* file)
+void vfs_close_file(vfs_file_t* file);
 int vfs_stat(vfs_t* vfs, const char* filename, vfs_stat_t* st);
+int vfs_io_hints(vfs_t* vfs, const char* path, vfs_io_hints_t* hints);
 void vfs_closedir(vfs_dir_t* dir);
 vfs_dir_t* vfs_opendir(vfs_t* vfs, const char* path);
 struct tm* gmtime(time_t *c_t);
@@ -47,6 +47,14 @@ typedef DIR vfs_dir_t;
 typedef FILE vfs_file_t;
 typedef struct stat vfs_stat_t;
 typedef struct dirent vfs_dirent_t;
+typedef struct {
+  void* base;
+  size_t len;
+} vfs_iovec_t;
+typedef struct {
+  size_t optimal_size;
+  size_t alignment;
+} vfs_io_hints_t;
 typedef struct {
   // We have two buffers for absolute paths. The first cwdlen characters
   // will always contain the current working directory (cwd). The last
@@ -74,6 +82,8 @@ typedef struct {
 #define vfs_read fread
 #define vfs_write fwrite
 #define vfs_eof feof
+#define vfs_rewind(file) fseek(file, 0, SEEK_SET)
+#define vfs_seek(file, offset) fseek(file, (long)(offset), SEEK_SET)
 
 #define vfs_readdir readdir
 #define vfs_closedir closedir
@@ -84,8 +94,21 @@ typedef struct {
 #define VFS_IRWXG 0
 #define VFS_IRWXO 0
 
+// The FILE buffer already coalesces small writes, so we simply feed it
+// the segments one after the other.
+static inline int vfs_writev(vfs_file_t* file, const vfs_iovec_t* iov, int iovcnt) {
+  int total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    size_t len = fwrite(iov[i].base, 1, iov[i].len, file);
+    total += len;
+    if (len != iov[i].len)
+      break;
+  }
+  return total;
+}
+
 static inline vfs_t* vfs_openfs() {
-  vfs_t* vfs = (vfs_t*)malloc(sizeof(vfs_t));
+  vfs_t* vfs = (vfs_t*)ftpd_alloc(ftpd_mem_owner, sizeof(vfs_t));
   if (!vfs)
     return NULL;
   strcpy(vfs->file1, VFS_ROOT);
@@ -95,7 +118,7 @@ static inline vfs_t* vfs_openfs() {
 }
 
 static inline void vfs_close(vfs_t* vfs) {
-  free(vfs);
+  ftpd_free(ftpd_mem_owner, vfs);
 }
 
 static inline void vfs_close_file(vfs_file_t* file) {
@@ -250,7 +273,7 @@ static inline char* vfs_getcwd(vfs_t* vfs, void* dummy1, int dummy2) {
   else
     // keep the slash to avoid returning an empty path
     vfs->file1[vfs->cwdlen] = 0;
-  return strdup(vfs->file1 + vfs->rootlen-1);
+  return ftpd_strdup(ftpd_mem_owner, vfs->file1 + vfs->rootlen-1);
 }
 
 static inline vfs_file_t* vfs_open(vfs_t* vfs, const char* path, const char* mode) {
@@ -272,6 +295,20 @@ static inline int vfs_stat(vfs_t* vfs, const char* path, vfs_stat_t* st) {
   }
 }
 
+static inline int vfs_io_hints(vfs_t* vfs, const char* path, vfs_io_hints_t* hints) {
+  struct stat st;
+
+  // FAT sectors; the FAT driver reports the cluster size in st_blksize.
+  hints->optimal_size = 512;
+  hints->alignment = 512;
+  path = abspath(vfs, path);
+  if (!path || stat(path, &st) != 0)
+    return 1;
+  if (st.st_blksize > 0)
+    hints->optimal_size = st.st_blksize;
+  return 0;
+}
+
 static inline vfs_dir_t* vfs_opendir(vfs_t* vfs, const char* path) {
   path = abspath(vfs, path);
   if (!path)
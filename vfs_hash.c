@@ -0,0 +1,324 @@
+/* Copyright (c) 2013, Philipp Tölke
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "vfs_hash.h"
+#include "ftpd.h"
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define CRC32_POLY 0xedb88320
+
+/* Slicing-by-8: eight bytes per step */
+static uint32_t crc_table[8][256];
+/* x^(2^n) modulo the polynomial, for combining */
+static uint32_t x2n_table[32];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t more = PTHREAD_COND_INITIALIZER;
+/* Jobs with chunks left to hand out */
+static struct vfs_hash_job* queue;
+static struct vfs_hash_job** queuetail = &queue;
+/* Jobs the threads are through with */
+static struct vfs_hash_job* done;
+static int event_fd = -1;
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char* p, size_t len) {
+	crc = ~crc;
+	while (len > 0 && ((uintptr_t)p & 7) != 0) {
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+		uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+
+		crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff]
+		    ^ crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24]
+		    ^ crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff]
+		    ^ crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	return ~crc;
+}
+
+/* a * b modulo the polynomial, bit-reflected like the CRC */
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+	uint32_t m = (uint32_t)1 << 31;
+	uint32_t p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+	}
+	return p;
+}
+
+/* x^(n * 2^k) modulo the polynomial */
+static uint32_t x2nmodp(uint64_t n, unsigned k) {
+	uint32_t p = (uint32_t)1 << 31;
+
+	while (n) {
+		if (n & 1)
+			p = multmodp(x2n_table[k & 31], p);
+		n >>= 1;
+		k++;
+	}
+	return p;
+}
+
+static void crc_init(void) {
+	uint32_t p;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		uint32_t c = (uint32_t)i;
+
+		for (j = 0; j < 8; j++)
+			c = c & 1 ? (c >> 1) ^ CRC32_POLY : c >> 1;
+		crc_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++)
+			crc_table[j][i] = crc_table[0][crc_table[j - 1][i] & 0xff] ^ (crc_table[j - 1][i] >> 8);
+	}
+	p = (uint32_t)1 << 30;		/* x^1 */
+	x2n_table[0] = p;
+	for (i = 1; i < 32; i++)
+		x2n_table[i] = p = multmodp(p, p);
+}
+
+/* Called with the lock held */
+static void job_finish(struct vfs_hash_job* job) {
+	uint64_t one = 1;
+
+	job->next = done;
+	done = job;
+	if (write(event_fd, &one, sizeof(one)) < 0) {
+		/* The counter is already nonzero. */
+	}
+}
+
+/* Hand out no more chunks. Called with the lock held. */
+static void job_stop(struct vfs_hash_job* job) {
+	struct vfs_hash_job** pp;
+
+	if (job->claimed < job->chunks) {
+		for (pp = &queue; *pp != job; pp = &(*pp)->next)
+			;
+		*pp = job->next;
+		if (queuetail == &job->next)
+			queuetail = pp;
+		job->chunks = job->claimed;
+		if (job->finished == job->claimed)
+			job_finish(job);
+	}
+}
+
+static void* hash_thread(void* arg) {
+	unsigned char* buf = arg;
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		struct vfs_hash_job* job;
+		uint64_t pos, left;
+		uint32_t crc = 0;
+		int error = 0;
+		unsigned i;
+
+		while (queue == NULL)
+			pthread_cond_wait(&more, &lock);
+		job = queue;
+		i = job->claimed++;
+		if (job->claimed == job->chunks) {
+			queue = job->next;
+			if (queue == NULL)
+				queuetail = &queue;
+		}
+		pthread_mutex_unlock(&lock);
+
+		pos = job->offset + (uint64_t)i * VFS_HASH_CHUNK;
+		left = job->length - (uint64_t)i * VFS_HASH_CHUNK;
+		if (left > VFS_HASH_CHUNK)
+			left = VFS_HASH_CHUNK;
+		while (left > 0) {
+			ssize_t n = pread(job->fd, buf, left, (off_t)pos);
+
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				/* Ending early means the file has been truncated. */
+				error = n < 0 ? -errno : -EIO;
+				break;
+			}
+			crc = crc32_update(crc, buf, (size_t)n);
+			pos += (uint64_t)n;
+			left -= (uint64_t)n;
+		}
+
+		pthread_mutex_lock(&lock);
+		job->crcs[i] = crc;
+		job->hashed += pos - (job->offset + (uint64_t)i * VFS_HASH_CHUNK);
+		if (error && job->error == 0) {
+			job->error = error;
+			job_stop(job);
+		}
+		job->finished++;
+		if (job->finished == job->chunks)
+			job_finish(job);
+	}
+	return NULL;
+}
+
+int vfs_hash_init(unsigned threads) {
+	unsigned i;
+
+	if (event_fd >= 0)
+		return 0;
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event_fd < 0)
+		return -errno;
+	crc_init();
+	for (i = 0; i < threads; i++) {
+		pthread_t t;
+		void* buf = ftpd_alloc(NULL, VFS_HASH_CHUNK);
+
+		if (buf == NULL)
+			break;
+		if (pthread_create(&t, NULL, hash_thread, buf) != 0) {
+			ftpd_free(NULL, buf);
+			break;
+		}
+		pthread_detach(t);
+	}
+	if (i == 0) {
+		close(event_fd);
+		event_fd = -1;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+int vfs_hash_fd(void) {
+	return event_fd;
+}
+
+unsigned vfs_hash_chunks(uint64_t len) {
+	return (unsigned)((len + VFS_HASH_CHUNK - 1) / VFS_HASH_CHUNK);
+}
+
+int vfs_hash_crc32(struct vfs_hash_job* job, int fd, uint64_t offset, uint64_t len, uint32_t* crcs) {
+	if (event_fd < 0)
+		return -1;
+	job->crc = 0;
+	job->next = NULL;
+	job->fd = fd;
+	job->offset = offset;
+	job->length = len;
+	job->crcs = crcs;
+	job->chunks = vfs_hash_chunks(len);
+	job->claimed = 0;
+	job->finished = 0;
+	job->hashed = 0;
+	job->error = 0;
+	job->cancelled = 0;
+	pthread_mutex_lock(&lock);
+	if (job->chunks == 0) {
+		job_finish(job);
+	} else {
+		*queuetail = job;
+		queuetail = &job->next;
+		pthread_cond_broadcast(&more);
+	}
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+uint64_t vfs_hash_progress(struct vfs_hash_job* job) {
+	uint64_t hashed;
+
+	pthread_mutex_lock(&lock);
+	hashed = job->hashed;
+	pthread_mutex_unlock(&lock);
+	return hashed;
+}
+
+void vfs_hash_cancel(struct vfs_hash_job* job) {
+	pthread_mutex_lock(&lock);
+	job->cancelled = 1;
+	job_stop(job);
+	pthread_mutex_unlock(&lock);
+}
+
+int vfs_hash_complete(void) {
+	struct vfs_hash_job* job;
+	uint64_t count;
+	int n = 0;
+
+	if (read(event_fd, &count, sizeof(count)) < 0)
+		return 0;
+	pthread_mutex_lock(&lock);
+	job = done;
+	done = NULL;
+	pthread_mutex_unlock(&lock);
+	while (job) {
+		struct vfs_hash_job* next = job->next;
+		int res = job->cancelled ? -ECANCELED : job->error;
+
+		if (res == 0 && job->chunks > 0) {
+			/* All chunks but the last are whole. */
+			uint32_t op = x2nmodp(VFS_HASH_CHUNK, 3);
+			uint64_t last = job->length - (uint64_t)(job->chunks - 1) * VFS_HASH_CHUNK;
+			unsigned i;
+
+			job->crc = job->crcs[0];
+			for (i = 1; i < job->chunks; i++) {
+				if (i == job->chunks - 1)
+					op = x2nmodp(last, 3);
+				job->crc = multmodp(op, job->crc) ^ job->crcs[i];
+			}
+		}
+		job->done(job, res);
+		job = next;
+		n++;
+	}
+	return n;
+}
@@ -0,0 +1,96 @@
+/* Copyright (c) 2013, Philipp Tölke
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef INCLUDE_VFS_HASH_H
+#define INCLUDE_VFS_HASH_H
+
+/* Checksums of whole files, computed by a pool of threads, for the Linux
+ * build with vfs_posix.h and tcp_epoll.c. A file is cut into chunks of
+ * VFS_HASH_CHUNK bytes that the threads read with pread() and checksum
+ * at the same time. The CRC32s of the chunks are then combined into the
+ * CRC32 of the whole range, the way zlib's crc32_combine() does it.
+ *
+ * Jobs are started and completed on the thread of the event loop:
+ * vfs_hash_fd() becomes readable when some have finished, and
+ * vfs_hash_complete() calls their done functions.
+ */
+
+#include <stdint.h>
+
+/* Bytes a thread reads and checksums at a time; each thread has a buffer
+ * of this size. */
+#ifndef VFS_HASH_CHUNK
+#define VFS_HASH_CHUNK (4 * 1024 * 1024)
+#endif
+
+struct vfs_hash_job;
+
+/* res is 0, or a negative errno. */
+typedef void (*vfs_hash_done_fn)(struct vfs_hash_job* job, int res);
+
+/* Embedded in the caller's job, which must stay valid, like the file,
+ * until done has been called. Only done and crc are the caller's. */
+struct vfs_hash_job {
+	vfs_hash_done_fn done;
+	uint32_t crc;		/* the result, once done has been called with 0 */
+	struct vfs_hash_job* next;
+	int fd;
+	uint64_t offset;
+	uint64_t length;
+	uint32_t* crcs;		/* of each chunk */
+	unsigned chunks;	/* handed out in order... */
+	unsigned claimed;	/* ...up to here... */
+	unsigned finished;	/* ...and this many are through */
+	uint64_t hashed;
+	int error;
+	int cancelled;
+};
+
+/* Start threads threads. Returns 0, or a negative errno. */
+int vfs_hash_init(unsigned threads);
+
+/* Readable when jobs have finished */
+int vfs_hash_fd(void);
+
+/* Entries that the crcs array of a job over len bytes needs */
+unsigned vfs_hash_chunks(uint64_t len);
+
+/* Start computing the CRC32 of len bytes of the file fd from offset on.
+ * crcs has room for vfs_hash_chunks(len) entries. Returns 0, or -1 if
+ * there are no threads. */
+int vfs_hash_crc32(struct vfs_hash_job* job, int fd, uint64_t offset, uint64_t len, uint32_t* crcs);
+
+/* Bytes checksummed so far */
+uint64_t vfs_hash_progress(struct vfs_hash_job* job);
+
+/* Hand out no more chunks of job. done is still called, with -ECANCELED,
+ * once the threads are through with it. */
+void vfs_hash_cancel(struct vfs_hash_job* job);
+
+/* Call done for every finished job. Returns how many there were. */
+int vfs_hash_complete(void);
+
+#endif /* INCLUDE_VFS_HASH_H */
@@ -0,0 +1,410 @@
+/* Copyright (c) 2013, Philipp Tlke
+ * Copyright (c) 2017, Benjamin Koch
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef INCLUDE_VFS_H
+#define INCLUDE_VFS_H
+
+// VFS backend for hosted builds (e.g. the lwIP unix port on Linux). It serves
+// the directory VFS_POSIX_ROOT and keeps a virtual cwd per connection, so
+// clients can never leave the root with "..".
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef VFS_POSIX_ROOT
+#define VFS_POSIX_ROOT "."
+#endif
+
+// Serve RETR straight from a read-only mapping of the file. See vfs_map().
+#ifndef VFS_POSIX_MMAP
+#define VFS_POSIX_MMAP 1
+#endif
+
+#if VFS_POSIX_MMAP
+#include <sys/mman.h>
+
+// Most files mapped at the same time. Beyond that, RETR reads as usual.
+#ifndef VFS_POSIX_MAX_MAPS
+#define VFS_POSIX_MAX_MAPS 16
+#endif
+#endif
+
+// Buffers per writev() call. IOV_MAX is only declared with _XOPEN_SOURCE
+// or _GNU_SOURCE, so use a cap of our own; 16 is the least POSIX allows.
+#ifndef VFS_POSIX_IOV_MAX
+#define VFS_POSIX_IOV_MAX 16
+#endif
+
+#define VFS_PATH_MAX PATH_MAX
+
+#define vfs_load_plugin(x)
+#define bcopy(src, dest, len) memmove(dest, src, len)
+
+typedef DIR vfs_dir_t;
+typedef struct {
+  int fd;
+  int eof;
+} vfs_file_t;
+typedef struct stat vfs_stat_t;
+typedef struct dirent vfs_dirent_t;
+typedef struct {
+  void* base;
+  size_t len;
+} vfs_iovec_t;
+typedef struct {
+  size_t optimal_size;
+  size_t alignment;
+} vfs_io_hints_t;
+typedef struct {
+  // Virtual cwd, always starting with a slash. It is relative to VFS_POSIX_ROOT.
+  char cwd[VFS_PATH_MAX];
+  // Buffers for resolved host paths. We need two of them for vfs_rename.
+  char path1[VFS_PATH_MAX], path2[VFS_PATH_MAX];
+} vfs_t;
+
+#define vfs_readdir readdir
+#define vfs_closedir closedir
+
+#define VFS_ISDIR(st_mode) S_ISDIR(st_mode)
+#define VFS_ISREG(st_mode) S_ISREG(st_mode)
+#define VFS_IRWXU S_IRWXU
+#define VFS_IRWXG S_IRWXG
+#define VFS_IRWXO S_IRWXO
+
+// Make path absolute (relative to cwd), collapse "." and ".." without ever
+// going above the root and prepend VFS_POSIX_ROOT. The part of the result
+// after the root is the virtual path.
+static inline const char* vfs_resolve(vfs_t* vfs, char* out, const char* path) {
+  char tmp[VFS_PATH_MAX];
+  size_t rootlen = strlen(VFS_POSIX_ROOT);
+  size_t len = rootlen;
+  char *tok, *save;
+  int n;
+
+  if (*path == '/')
+    n = snprintf(tmp, sizeof(tmp), "%s", path);
+  else
+    n = snprintf(tmp, sizeof(tmp), "%s/%s", vfs->cwd, path);
+  if (n < 0 || n >= (int)sizeof(tmp) || rootlen + 2 > VFS_PATH_MAX)
+    return NULL;
+
+  memcpy(out, VFS_POSIX_ROOT, rootlen);
+  for (tok = strtok_r(tmp, "/", &save); tok; tok = strtok_r(NULL, "/", &save)) {
+    size_t toklen = strlen(tok);
+    if (strcmp(tok, ".") == 0)
+      continue;
+    if (strcmp(tok, "..") == 0) {
+      while (len > rootlen && out[len-1] != '/')
+        len--;
+      if (len > rootlen)
+        len--;
+      continue;
+    }
+    if (len + 1 + toklen + 1 > VFS_PATH_MAX)
+      return NULL;
+    out[len++] = '/';
+    memcpy(out+len, tok, toklen);
+    len += toklen;
+  }
+  if (len == rootlen)
+    out[len++] = '/';
+  out[len] = 0;
+  return out;
+}
+
+static inline vfs_t* vfs_openfs() {
+  vfs_t* vfs = (vfs_t*)ftpd_alloc(ftpd_mem_owner, sizeof(vfs_t));
+  if (!vfs)
+    return NULL;
+  strcpy(vfs->cwd, "/");
+  return vfs;
+}
+
+static inline void vfs_close(vfs_t* vfs) {
+  ftpd_free(ftpd_mem_owner, vfs);
+}
+
+#if VFS_POSIX_MMAP
+// The files vfs_map has mapped. Truncating one would make the sends that
+// still reference its mapping fault with SIGBUS, so vfs_open refuses to
+// open them for writing until vfs_unmap. This only covers the server
+// itself: other processes mustn't truncate files that are being served.
+// ftpd maps, unmaps and opens files from the tcpip thread only.
+static struct {
+  const void* addr;
+  dev_t dev;
+  ino_t ino;
+} vfs_posix_maps[VFS_POSIX_MAX_MAPS];
+
+static inline int vfs_posix_mapped(const struct stat* st) {
+  int i;
+
+  for (i = 0; i < VFS_POSIX_MAX_MAPS; i++)
+    if (vfs_posix_maps[i].addr && vfs_posix_maps[i].dev == st->st_dev
+        && vfs_posix_maps[i].ino == st->st_ino)
+      return 1;
+  return 0;
+}
+#endif
+
+static inline vfs_file_t* vfs_open(vfs_t* vfs, const char* path, const char* mode) {
+  int flags = 0;
+  vfs_file_t* file;
+
+  path = vfs_resolve(vfs, vfs->path1, path);
+  if (!path)
+    return NULL;
+  for (; *mode; mode++) {
+    if (*mode == 'r')
+      flags |= O_RDONLY;
+    if (*mode == 'w')
+      flags |= O_WRONLY | O_CREAT | O_TRUNC;
+  }
+#if VFS_POSIX_MMAP
+  if (flags & O_TRUNC) {
+    struct stat st;
+
+    if (stat(path, &st) == 0 && vfs_posix_mapped(&st))
+      return NULL;
+  }
+#endif
+
+  file = (vfs_file_t*)ftpd_alloc(ftpd_mem_owner, sizeof(vfs_file_t));
+  if (!file)
+    return NULL;
+  file->fd = open(path, flags | O_CLOEXEC, 0644);
+  file->eof = 0;
+  if (file->fd < 0) {
+    ftpd_free(ftpd_mem_owner, file);
+    return NULL;
+  }
+  return file;
+}
+
+static inline void vfs_close_file(vfs_file_t* file) {
+  close(file->fd);
+  ftpd_free(ftpd_mem_owner, file);
+}
+
+static inline int vfs_read(void* buffer, int dummy, int len, vfs_file_t* file) {
+  ssize_t r = read(file->fd, buffer, len);
+  if (r == 0)
+    file->eof = 1;
+  return r < 0 ? 0 : (int)r;
+}
+
+static inline int vfs_write(void* buffer, int dummy, int len, vfs_file_t* file) {
+  ssize_t r = write(file->fd, buffer, len);
+  return r < 0 ? 0 : (int)r;
+}
+
+static inline int vfs_writev(vfs_file_t* file, const vfs_iovec_t* iov, int iovcnt) {
+  struct iovec v[VFS_POSIX_IOV_MAX];
+  int total = 0;
+
+  // Longer chains go out in groups; a short write ends it.
+  while (iovcnt > 0) {
+    int n = iovcnt < VFS_POSIX_IOV_MAX ? iovcnt : VFS_POSIX_IOV_MAX;
+    size_t want = 0;
+    ssize_t r;
+    int i;
+
+    for (i = 0; i < n; i++) {
+      v[i].iov_base = iov[i].base;
+      v[i].iov_len = iov[i].len;
+      want += iov[i].len;
+    }
+    r = writev(file->fd, v, n);
+    if (r < 0)
+      break;
+    total += (int)r;
+    if ((size_t)r != want)
+      break;
+    iov += n;
+    iovcnt -= n;
+  }
+  return total;
+}
+
+#define vfs_eof(file) ((file)->eof)
+
+// The descriptors behind files and directories, for asynchronous I/O that
+// bypasses the calls here (ftpd's FTPD_URING).
+#define vfs_fileno(file) ((file)->fd)
+#define vfs_dirfd(dir) dirfd(dir)
+
+static inline int vfs_rewind(vfs_file_t* file) {
+  if (lseek(file->fd, 0, SEEK_SET) != 0)
+    return 1;
+  file->eof = 0;
+  return 0;
+}
+
+static inline int vfs_seek(vfs_file_t* file, size_t offset) {
+  if (lseek(file->fd, (off_t)offset, SEEK_SET) != (off_t)offset)
+    return 1;
+  file->eof = 0;
+  return 0;
+}
+
+#if VFS_POSIX_MMAP
+// vfs_map returns the whole file as read-only memory. ftpd hands slices
+// of it to lwIP by reference and calls vfs_unmap once TCP no longer
+// references any of them. NULL means the file must be read normally.
+#define VFS_HAVE_MAP
+
+static inline const void* vfs_map(vfs_file_t* file, size_t* len) {
+  struct stat st;
+  void* addr;
+  int i;
+
+  if (fstat(file->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0
+      || (unsigned long long)st.st_size > SIZE_MAX)
+    return NULL;
+  for (i = 0; i < VFS_POSIX_MAX_MAPS && vfs_posix_maps[i].addr; i++)
+    ;
+  if (i == VFS_POSIX_MAX_MAPS)
+    return NULL;
+  addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, file->fd, 0);
+  if (addr == MAP_FAILED)
+    return NULL;
+  madvise(addr, st.st_size, MADV_SEQUENTIAL);
+  vfs_posix_maps[i].addr = addr;
+  vfs_posix_maps[i].dev = st.st_dev;
+  vfs_posix_maps[i].ino = st.st_ino;
+  *len = st.st_size;
+  return addr;
+}
+
+static inline void vfs_unmap(vfs_file_t* file, const void* addr, size_t len) {
+  int i;
+
+  for (i = 0; i < VFS_POSIX_MAX_MAPS; i++)
+    if (vfs_posix_maps[i].addr == addr)
+      vfs_posix_maps[i].addr = NULL;
+  munmap((void*)addr, len);
+}
+#endif
+
+static inline int vfs_stat(vfs_t* vfs, const char* path, vfs_stat_t* st) {
+  path = vfs_resolve(vfs, vfs->path1, path);
+  if (path && stat(path, st) == 0) {
+    return 0;
+  } else {
+    // The return value of vfs_stat isn't checked in many places so we need
+    // to put something sensible into st.
+    memset(st, 0, sizeof(vfs_stat_t));
+    return -1;
+  }
+}
+
+static inline int vfs_io_hints(vfs_t* vfs, const char* path, vfs_io_hints_t* hints) {
+  struct stat st;
+
+  hints->optimal_size = 4096;
+  hints->alignment = 1;
+  path = vfs_resolve(vfs, vfs->path1, path);
+  if (!path || (stat(path, &st) != 0 && stat(VFS_POSIX_ROOT, &st) != 0))
+    return 1;
+  if (st.st_blksize > 0) {
+    hints->optimal_size = st.st_blksize;
+    hints->alignment = st.st_blksize;
+  }
+  return 0;
+}
+
+static inline vfs_dir_t* vfs_opendir(vfs_t* vfs, const char* path) {
+  path = vfs_resolve(vfs, vfs->path1, path);
+  if (!path)
+    return NULL;
+  return opendir(path);
+}
+
+static inline int vfs_chdir(vfs_t* vfs, const char* path) {
+  struct stat st;
+  size_t rootlen = strlen(VFS_POSIX_ROOT);
+
+  path = vfs_resolve(vfs, vfs->path1, path);
+  if (!path || stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+    return 1;
+  strcpy(vfs->cwd, path + rootlen);
+  return 0;
+}
+
+static inline char* vfs_getcwd(vfs_t* vfs, void* dummy1, int dummy2) {
+  // ftpd will free the string.
+  return ftpd_strdup(ftpd_mem_owner, vfs->cwd);
+}
+
+static inline int vfs_mkdir(vfs_t* vfs, const char* path, int mode) {
+  path = vfs_resolve(vfs, vfs->path1, path);
+  return path && mkdir(path, mode) == 0 ? 0 : 1;
+}
+
+static inline int vfs_rmdir(vfs_t* vfs, const char* path) {
+  path = vfs_resolve(vfs, vfs->path1, path);
+  return path && rmdir(path) == 0 ? 0 : 1;
+}
+
+static inline int vfs_remove(vfs_t* vfs, const char* path) {
+  path = vfs_resolve(vfs, vfs->path1, path);
+  return path && unlink(path) == 0 ? 0 : 1;
+}
+
+static inline int vfs_rename(vfs_t* vfs, const char* from, const char* to) {
+  from = vfs_resolve(vfs, vfs->path1, from);
+  to   = vfs_resolve(vfs, vfs->path2, to);
+  return from && to && rename(from, to) == 0 ? 0 : 1;
+}
+
+// ftpd.c redefines some of the POSIX stuff so we undefine it here to avoid warnings.
+#undef EINVAL
+#undef ENOMEM
+#undef ENODEV
+
+// ftpd.c uses dirent->name, see vfs_esp32.h.
+#define name d_name
+
+#ifdef FTPD_DEBUG
+#define ftpd_logd(fmt, ...) fprintf(stderr, "ftpd: " fmt "\n", ## __VA_ARGS__)
+#define ftpd_logi(fmt, ...) fprintf(stderr, "ftpd: " fmt "\n", ## __VA_ARGS__)
+#define ftpd_logw(fmt, ...) fprintf(stderr, "ftpd: " fmt "\n", ## __VA_ARGS__)
+#define ftpd_loge(fmt, ...) fprintf(stderr, "ftpd: " fmt "\n", ## __VA_ARGS__)
+#endif
+
+#endif /* INCLUDE_VFS_H */
@@ -0,0 +1,582 @@
+/* Copyright (c) 2013, Philipp Tölke
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "vfs_ramfs.h"
+#include "ftpd.h"
+#include <stdlib.h>
+
+struct ramfs_block {
+	struct ramfs_block* next;
+	unsigned char data[VFS_RAMFS_BLOCK_SIZE];
+};
+
+struct ramfs_node {
+	char* name;
+	int mode;
+	time_t mtime;
+	struct ramfs_node* parent;	/* NULL once unlinked */
+	struct ramfs_node* children;
+	struct ramfs_node* next;
+	unsigned gen;			/* bumped whenever children change */
+	unsigned trunc;			/* bumped whenever the data is dropped */
+	int refs;			/* open file and directory handles */
+	size_t size;
+	struct ramfs_block* first;
+	struct ramfs_block* last;
+};
+
+static struct ramfs_node root = { "", VFS_RAMFS_DIR };
+static struct ramfs_block* free_blocks;
+static size_t used;
+
+size_t vfs_ramfs_used(void) {
+	return used;
+}
+
+/* Blocks are never handed back to the heap. They are kept on a free list
+ * for the next file, but count against the budget only while in use.
+ */
+static struct ramfs_block* block_alloc(void) {
+	struct ramfs_block* b;
+
+	if (used + sizeof(struct ramfs_block) > VFS_RAMFS_BUDGET)
+		return NULL;
+	if (free_blocks) {
+		b = free_blocks;
+		free_blocks = b->next;
+	} else {
+		b = VFS_RAMFS_MALLOC(sizeof(struct ramfs_block));
+		if (!b)
+			return NULL;
+	}
+	used += sizeof(struct ramfs_block);
+	b->next = NULL;
+	return b;
+}
+
+static void truncate_node(struct ramfs_node* n) {
+	size_t count = 0;
+	struct ramfs_block* b;
+
+	if (!n->first)
+		return;
+	for (b = n->first; b->next; b = b->next)
+		count++;
+	count++;
+	/* Splice the whole chain onto the free list in one go. */
+	b->next = free_blocks;
+	free_blocks = n->first;
+	used -= count * sizeof(struct ramfs_block);
+	n->first = n->last = NULL;
+	n->size = 0;
+	n->trunc++;
+	n->mtime = time(NULL);
+}
+
+static char* name_alloc(const char* name, size_t len) {
+	char* s;
+
+	if (used + len + 1 > VFS_RAMFS_BUDGET)
+		return NULL;
+	s = VFS_RAMFS_MALLOC(len + 1);
+	if (!s)
+		return NULL;
+	memcpy(s, name, len);
+	s[len] = '\0';
+	used += len + 1;
+	return s;
+}
+
+static void name_free(char* s) {
+	used -= strlen(s) + 1;
+	VFS_RAMFS_FREE(s);
+}
+
+static struct ramfs_node* node_alloc(const char* name, size_t len, int mode) {
+	struct ramfs_node* n;
+
+	if (used + sizeof(struct ramfs_node) > VFS_RAMFS_BUDGET)
+		return NULL;
+	n = VFS_RAMFS_MALLOC(sizeof(struct ramfs_node));
+	if (!n)
+		return NULL;
+	memset(n, 0, sizeof(*n));
+	n->name = name_alloc(name, len);
+	if (!n->name) {
+		VFS_RAMFS_FREE(n);
+		return NULL;
+	}
+	n->mode = mode;
+	n->mtime = time(NULL);
+	used += sizeof(struct ramfs_node);
+	return n;
+}
+
+static void node_free(struct ramfs_node* n) {
+	truncate_node(n);
+	name_free(n->name);
+	used -= sizeof(struct ramfs_node);
+	VFS_RAMFS_FREE(n);
+}
+
+/* Drop a handle. Unlinked nodes go away with their last handle. */
+static void node_release(struct ramfs_node* n) {
+	n->refs--;
+	if (n->refs == 0 && !n->parent && n != &root)
+		node_free(n);
+}
+
+static void detach_node(struct ramfs_node* n) {
+	struct ramfs_node** pp;
+
+	for (pp = &n->parent->children; *pp != n; pp = &(*pp)->next)
+		;
+	*pp = n->next;
+	n->parent->gen++;
+	n->parent->mtime = time(NULL);
+	n->parent = NULL;
+	n->next = NULL;
+}
+
+static void unlink_node(struct ramfs_node* n) {
+	detach_node(n);
+	if (n->refs == 0)
+		node_free(n);
+}
+
+static void link_node(struct ramfs_node* dir, struct ramfs_node* n) {
+	n->parent = dir;
+	n->next = dir->children;
+	dir->children = n;
+	dir->gen++;
+	dir->mtime = time(NULL);
+}
+
+static struct ramfs_node* find_child(struct ramfs_node* dir, const char* name, size_t len) {
+	struct ramfs_node* n;
+
+	for (n = dir->children; n; n = n->next) {
+		if (strncmp(n->name, name, len) == 0 && n->name[len] == '\0')
+			return n;
+	}
+	return NULL;
+}
+
+/* Turn path into a normalized path relative to the root (no leading
+ * slash, "" for the root) in vfs->path. ".." never goes above the root.
+ */
+static const char* ramfs_resolve(vfs_t* vfs, const char* path) {
+	char* out = vfs->path;
+	size_t len = 0;
+	const char* p;
+
+	if (*path != '/') {
+		len = strlen(vfs->cwd);
+		memcpy(out, vfs->cwd, len + 1);
+	}
+
+	for (p = path; *p; ) {
+		const char* end = strchr(p, '/');
+		size_t n = end ? (size_t)(end - p) : strlen(p);
+
+		if (n == 0 || (n == 1 && p[0] == '.')) {
+			/* skip */
+		} else if (n == 2 && p[0] == '.' && p[1] == '.') {
+			while (len > 0 && out[len-1] != '/')
+				len--;
+			if (len > 0)
+				len--;
+		} else {
+			if (len + 1 + n + 1 > VFS_RAMFS_PATH_MAX)
+				return NULL;
+			if (len > 0)
+				out[len++] = '/';
+			memcpy(out + len, p, n);
+			len += n;
+		}
+		p += n;
+		if (*p == '/')
+			p++;
+	}
+	out[len] = '\0';
+	return out;
+}
+
+/* Find the node for path. If leaf is not NULL, the last component doesn't
+ * have to exist: its parent directory is returned in *dir and the name in
+ * *leaf and *leaflen.
+ */
+static struct ramfs_node* lookup(vfs_t* vfs, const char* path,
+		struct ramfs_node** dir, const char** leaf, size_t* leaflen) {
+	struct ramfs_node* n = &root;
+	const char* p = ramfs_resolve(vfs, path);
+
+	if (!p)
+		return NULL;
+	if (dir)
+		*dir = NULL;
+	while (*p) {
+		const char* end = strchr(p, '/');
+		size_t len = end ? (size_t)(end - p) : strlen(p);
+
+		if (!(n->mode & VFS_RAMFS_DIR))
+			return NULL;
+		if (!end && dir) {
+			*dir = n;
+			*leaf = p;
+			*leaflen = len;
+		}
+		n = find_child(n, p, len);
+		if (!n)
+			return NULL;
+		p += len;
+		if (*p == '/')
+			p++;
+	}
+	return n;
+}
+
+vfs_t* vfs_openfs() {
+	vfs_t* vfs = ftpd_alloc(ftpd_mem_owner, sizeof(vfs_t));
+	if (!vfs)
+		return NULL;
+	vfs->cwd[0] = '\0';
+	return vfs;
+}
+
+void vfs_close(vfs_t* vfs) {
+	ftpd_free(ftpd_mem_owner, vfs);
+}
+
+vfs_file_t* vfs_open(vfs_t* vfs, const char* filename, const char* mode) {
+	struct ramfs_node* dir;
+	struct ramfs_node* n;
+	const char* leaf;
+	size_t leaflen;
+	vfs_file_t* f;
+	int writable = strchr(mode, 'w') || strchr(mode, 'a');
+
+	n = lookup(vfs, filename, &dir, &leaf, &leaflen);
+	if (n && (n->mode & VFS_RAMFS_DIR))
+		return NULL;
+	if (!n) {
+		if (!writable || !dir)
+			return NULL;
+		n = node_alloc(leaf, leaflen, 0);
+		if (!n)
+			return NULL;
+		link_node(dir, n);
+	}
+
+	f = ftpd_alloc(ftpd_mem_owner, sizeof(vfs_file_t));
+	if (!f)
+		return NULL;
+	if (strchr(mode, 'w'))
+		truncate_node(n);
+	n->refs++;
+	f->node = n;
+	f->trunc = n->trunc;
+	f->writable = writable;
+	f->eof = 0;
+	if (strchr(mode, 'a')) {
+		f->pos = n->size;
+		f->block = n->last;
+	} else {
+		f->pos = 0;
+		f->block = n->first;
+	}
+	return f;
+}
+
+void vfs_close_file(vfs_file_t* file) {
+	node_release(file->node);
+	ftpd_free(ftpd_mem_owner, file);
+}
+
+int vfs_read(void* buffer, int dummy, int len, vfs_file_t* file) {
+	struct ramfs_node* n = file->node;
+	unsigned char* out = buffer;
+	int total = 0;
+
+	/* Our block pointer is stale if the file was truncated meanwhile. */
+	if (file->trunc != n->trunc) {
+		file->eof = 1;
+		return 0;
+	}
+	if (!file->block)
+		file->block = n->first;
+
+	while (total < len && file->pos < n->size) {
+		size_t off = file->pos % VFS_RAMFS_BLOCK_SIZE;
+		size_t chunk = VFS_RAMFS_BLOCK_SIZE - off;
+
+		if (off == 0 && file->pos > 0)
+			file->block = file->block->next;
+		if (chunk > n->size - file->pos)
+			chunk = n->size - file->pos;
+		if (chunk > (size_t)(len - total))
+			chunk = len - total;
+		memcpy(out + total, file->block->data + off, chunk);
+		total += chunk;
+		file->pos += chunk;
+	}
+	if (total == 0)
+		file->eof = 1;
+	return total;
+}
+
+/* Writes always append, which is all that ftpd needs. */
+static int append(vfs_file_t* file, const unsigned char* buf, size_t len) {
+	struct ramfs_node* n = file->node;
+	size_t total = 0;
+
+	if (!file->writable)
+		return 0;
+	while (total < len) {
+		size_t off = n->size % VFS_RAMFS_BLOCK_SIZE;
+		size_t chunk = VFS_RAMFS_BLOCK_SIZE - off;
+
+		if (off == 0) {
+			struct ramfs_block* b = block_alloc();
+			if (!b)
+				break;
+			if (n->last)
+				n->last->next = b;
+			else
+				n->first = b;
+			n->last = b;
+		}
+		if (chunk > len - total)
+			chunk = len - total;
+		memcpy(n->last->data + off, buf + total, chunk);
+		total += chunk;
+		n->size += chunk;
+	}
+	file->pos = n->size;
+	file->block = n->last;
+	n->mtime = time(NULL);
+	return total;
+}
+
+int vfs_write(void* buffer, int dummy, int len, vfs_file_t* file) {
+	return append(file, buffer, len);
+}
+
+int vfs_writev(vfs_file_t* file, const vfs_iovec_t* iov, int iovcnt) {
+	int total = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		int len = append(file, iov[i].base, iov[i].len);
+		total += len;
+		if ((size_t)len != iov[i].len)
+			break;
+	}
+	return total;
+}
+
+int vfs_eof(vfs_file_t* file) {
+	return file->eof || file->pos >= file->node->size;
+}
+
+/* Start over with whatever the file holds now, even if it was truncated. */
+int vfs_rewind(vfs_file_t* file) {
+	file->block = NULL;
+	file->pos = 0;
+	file->trunc = file->node->trunc;
+	file->eof = 0;
+	return 0;
+}
+
+/* Find the block that vfs_read() expects for pos: the one holding the
+ * byte before it, so that it moves on at the block boundary itself.
+ */
+int vfs_seek(vfs_file_t* file, size_t offset) {
+	struct ramfs_node* n = file->node;
+	struct ramfs_block* b = n->first;
+	size_t end;
+
+	if (offset > n->size)
+		return 1;
+	for (end = VFS_RAMFS_BLOCK_SIZE; end < offset; end += VFS_RAMFS_BLOCK_SIZE)
+		b = b->next;
+	file->block = b;
+	file->pos = offset;
+	file->trunc = n->trunc;
+	file->eof = 0;
+	return 0;
+}
+
+int vfs_stat(vfs_t* vfs, const char* filename, vfs_stat_t* st) {
+	struct ramfs_node* n = lookup(vfs, filename, NULL, NULL, NULL);
+
+	if (!n) {
+		memset(st, 0, sizeof(vfs_stat_t));
+		return 1;
+	}
+	st->st_size = n->size;
+	st->st_mode = n->mode;
+	st->st_mtime = n->mtime;
+	return 0;
+}
+
+int vfs_io_hints(vfs_t* vfs, const char* path, vfs_io_hints_t* hints) {
+	hints->optimal_size = VFS_RAMFS_BLOCK_SIZE;
+	hints->alignment = VFS_RAMFS_BLOCK_SIZE;
+	return 0;
+}
+
+int vfs_chdir(vfs_t* vfs, const char* path) {
+	struct ramfs_node* n = lookup(vfs, path, NULL, NULL, NULL);
+
+	if (!n || !(n->mode & VFS_RAMFS_DIR))
+		return 1;
+	strcpy(vfs->cwd, vfs->path);
+	return 0;
+}
+
+char* vfs_getcwd(vfs_t* vfs, void* dummy1, int dummy2) {
+	char* cwd = ftpd_alloc(ftpd_mem_owner, strlen(vfs->cwd) + 2);
+	if (!cwd)
+		return NULL;
+	cwd[0] = '/';
+	strcpy(cwd + 1, vfs->cwd);
+	return cwd;
+}
+
+int vfs_mkdir(vfs_t* vfs, const char* name, int mode) {
+	struct ramfs_node* dir;
+	struct ramfs_node* n;
+	const char* leaf;
+	size_t leaflen;
+
+	if (lookup(vfs, name, &dir, &leaf, &leaflen) || !dir)
+		return 1;
+	n = node_alloc(leaf, leaflen, VFS_RAMFS_DIR);
+	if (!n)
+		return 1;
+	link_node(dir, n);
+	return 0;
+}
+
+int vfs_rmdir(vfs_t* vfs, const char* name) {
+	struct ramfs_node* n = lookup(vfs, name, NULL, NULL, NULL);
+
+	if (!n || n == &root || !(n->mode & VFS_RAMFS_DIR) || n->children)
+		return 1;
+	unlink_node(n);
+	return 0;
+}
+
+int vfs_remove(vfs_t* vfs, const char* name) {
+	struct ramfs_node* n = lookup(vfs, name, NULL, NULL, NULL);
+
+	if (!n || (n->mode & VFS_RAMFS_DIR))
+		return 1;
+	unlink_node(n);
+	return 0;
+}
+
+int vfs_rename(vfs_t* vfs, const char* from, const char* to) {
+	struct ramfs_node* n;
+	struct ramfs_node* old;
+	struct ramfs_node* dir;
+	struct ramfs_node* p;
+	const char* leaf;
+	size_t leaflen;
+	char* newname;
+
+	n = lookup(vfs, from, NULL, NULL, NULL);
+	if (!n || n == &root)
+		return 1;
+	old = lookup(vfs, to, &dir, &leaf, &leaflen);
+	if (!dir || old == n)
+		return 1;
+	if (old && ((old->mode & VFS_RAMFS_DIR) || (n->mode & VFS_RAMFS_DIR)))
+		return 1;
+	/* A directory can't be moved into itself. */
+	for (p = dir; p; p = p->parent) {
+		if (p == n)
+			return 1;
+	}
+
+	newname = name_alloc(leaf, leaflen);
+	if (!newname)
+		return 1;
+	if (old)
+		unlink_node(old);
+	detach_node(n);
+	name_free(n->name);
+	n->name = newname;
+	link_node(dir, n);
+	return 0;
+}
+
+vfs_dir_t* vfs_opendir(vfs_t* vfs, const char* path) {
+	struct ramfs_node* n = lookup(vfs, path, NULL, NULL, NULL);
+	vfs_dir_t* dir;
+
+	if (!n || !(n->mode & VFS_RAMFS_DIR))
+		return NULL;
+	dir = ftpd_alloc(ftpd_mem_owner, sizeof *dir);
+	if (!dir)
+		return NULL;
+	n->refs++;
+	dir->dir = n;
+	dir->next = n->children;
+	dir->gen = n->gen;
+	dir->index = 0;
+	return dir;
+}
+
+vfs_dirent_t* vfs_readdir(vfs_dir_t* dir) {
+	struct ramfs_node* n;
+
+	/* If the directory changed, our pointer may be stale. Find the
+	   entry at the same position again. */
+	if (dir->gen != dir->dir->gen) {
+		int i;
+
+		n = dir->dir->children;
+		for (i = 0; n && i < dir->index; i++)
+			n = n->next;
+		dir->next = n;
+		dir->gen = dir->dir->gen;
+	}
+
+	n = dir->next;
+	if (!n)
+		return NULL;
+	dir->next = n->next;
+	dir->index++;
+	dir->dirent.name = n->name;
+	return &dir->dirent;
+}
+
+void vfs_closedir(vfs_dir_t* dir) {
+	node_release(dir->dir);
+	ftpd_free(ftpd_mem_owner, dir);
+}
@@ -0,0 +1,131 @@
+/* Copyright (c) 2013, Philipp Tölke
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef INCLUDE_VFS_H
+#define INCLUDE_VFS_H
+
+/* Filesystem in RAM, e.g. as a fast staging area for uploads. File data
+ * is kept in fixed-size blocks that are recycled through a free list, and
+ * the total memory use is limited by VFS_RAMFS_BUDGET.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#define vfs_load_plugin(x)
+#define bcopy(src, dest, len) memmove(dest, src, len)
+
+/* Bytes of file data per block */
+#ifndef VFS_RAMFS_BLOCK_SIZE
+#define VFS_RAMFS_BLOCK_SIZE 512
+#endif
+
+/* Upper limit for blocks, nodes and names, in bytes */
+#ifndef VFS_RAMFS_BUDGET
+#define VFS_RAMFS_BUDGET (256 * 1024)
+#endif
+
+/* Allocator for blocks and nodes; may be pointed at PSRAM */
+#ifndef VFS_RAMFS_MALLOC
+#define VFS_RAMFS_MALLOC malloc
+#define VFS_RAMFS_FREE free
+#endif
+
+#define VFS_RAMFS_PATH_MAX 256
+#define VFS_RAMFS_DIR 1
+
+struct ramfs_node;
+struct ramfs_block;
+
+typedef struct {
+	struct ramfs_node* node;
+	struct ramfs_block* block;	/* block that contains pos */
+	size_t pos;
+	unsigned trunc;			/* node->trunc when block was taken */
+	int writable;
+	int eof;
+} vfs_file_t;
+typedef struct {
+	const char* name;
+} vfs_dirent_t;
+typedef struct {
+	struct ramfs_node* dir;
+	struct ramfs_node* next;
+	unsigned gen;			/* dir->gen when next was taken */
+	int index;			/* position of next in the directory */
+	vfs_dirent_t dirent;
+} vfs_dir_t;
+typedef struct {
+	long st_size;
+	int st_mode;
+	time_t st_mtime;
+} vfs_stat_t;
+typedef struct {
+	char cwd[VFS_RAMFS_PATH_MAX];
+	char path[VFS_RAMFS_PATH_MAX];
+} vfs_t;
+typedef struct {
+	void* base;
+	size_t len;
+} vfs_iovec_t;
+typedef struct {
+	size_t optimal_size;
+	size_t alignment;
+} vfs_io_hints_t;
+
+#define VFS_ISDIR(st_mode) ((st_mode) & VFS_RAMFS_DIR)
+#define VFS_ISREG(st_mode) !((st_mode) & VFS_RAMFS_DIR)
+#define VFS_IRWXU 0
+#define VFS_IRWXG 0
+#define VFS_IRWXO 0
+
+int vfs_read(void* buffer, int dummy, int len, vfs_file_t* file);
+int vfs_write(void* buffer, int dummy, int len, vfs_file_t* file);
+int vfs_writev(vfs_file_t* file, const vfs_iovec_t* iov, int iovcnt);
+int vfs_eof(vfs_file_t* file);
+int vfs_rewind(vfs_file_t* file);
+int vfs_seek(vfs_file_t* file, size_t offset);
+vfs_dirent_t* vfs_readdir(vfs_dir_t* dir);
+vfs_file_t* vfs_open(vfs_t* vfs, const char* filename, const char* mode);
+void vfs_close_file(vfs_file_t* file);
+vfs_t* vfs_openfs();
+void vfs_close(vfs_t* vfs);
+int vfs_chdir(vfs_t* vfs, const char* path);
+char* vfs_getcwd(vfs_t* vfs, void* dummy1, int dummy2);
+int vfs_stat(vfs_t* vfs, const char* filename, vfs_stat_t* st);
+int vfs_io_hints(vfs_t* vfs, const char* path, vfs_io_hints_t* hints);
+int vfs_mkdir(vfs_t* vfs, const char* name, int mode);
+int vfs_rmdir(vfs_t* vfs, const char* name);
+int vfs_remove(vfs_t* vfs, const char* name);
+int vfs_rename(vfs_t* vfs, const char* from, const char* to);
+vfs_dir_t* vfs_opendir(vfs_t* vfs, const char* path);
+void vfs_closedir(vfs_dir_t* dir);
+
+/* Bytes of the budget that are currently in use */
+size_t vfs_ramfs_used(void);
+
+#endif /* INCLUDE_VFS_H */
@@ -0,0 +1,223 @@
+/* Copyright (c) 2013, Philipp Tölke
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "vfs_romfs.h"
+#include "ftpd.h"
+#include <stdlib.h>
+
+/* Turn path into a normalized path relative to the root (no leading
+ * slash, "" for the root) in vfs->path. ".." never goes above the root.
+ */
+static const char* romfs_resolve(vfs_t* vfs, const char* path) {
+	char* out = vfs->path;
+	size_t len = 0;
+	const char* p;
+
+	if (*path != '/') {
+		len = strlen(vfs->cwd);
+		memcpy(out, vfs->cwd, len + 1);
+	}
+
+	for (p = path; *p; ) {
+		const char* end = strchr(p, '/');
+		size_t n = end ? (size_t)(end - p) : strlen(p);
+
+		if (n == 0 || (n == 1 && p[0] == '.')) {
+			/* skip */
+		} else if (n == 2 && p[0] == '.' && p[1] == '.') {
+			while (len > 0 && out[len-1] != '/')
+				len--;
+			if (len > 0)
+				len--;
+		} else {
+			if (len + 1 + n + 1 > VFS_ROMFS_PATH_MAX)
+				return NULL;
+			if (len > 0)
+				out[len++] = '/';
+			memcpy(out + len, p, n);
+			len += n;
+		}
+		p += n;
+		if (*p == '/')
+			p++;
+	}
+	out[len] = '\0';
+	return out;
+}
+
+static int romfs_cmp(const void* key, const void* elem) {
+	return strcmp((const char*)key, ((const vfs_romfs_entry_t*)elem)->path);
+}
+
+static const vfs_romfs_entry_t* romfs_lookup(vfs_t* vfs, const char* path) {
+	path = romfs_resolve(vfs, path);
+	if (!path)
+		return NULL;
+	return bsearch(path, vfs_romfs_entries, vfs_romfs_count,
+		sizeof(vfs_romfs_entry_t), romfs_cmp);
+}
+
+vfs_t* vfs_openfs() {
+	vfs_t* vfs = ftpd_alloc(ftpd_mem_owner, sizeof(vfs_t));
+	if (!vfs)
+		return NULL;
+	vfs->cwd[0] = '\0';
+	return vfs;
+}
+
+void vfs_close(vfs_t* vfs) {
+	ftpd_free(ftpd_mem_owner, vfs);
+}
+
+vfs_file_t* vfs_open(vfs_t* vfs, const char* filename, const char* mode) {
+	const vfs_romfs_entry_t* e;
+	vfs_file_t* f;
+
+	if (strchr(mode, 'w'))
+		return NULL;
+	e = romfs_lookup(vfs, filename);
+	if (!e || (e->mode & VFS_ROMFS_DIR))
+		return NULL;
+	f = ftpd_alloc(ftpd_mem_owner, sizeof(vfs_file_t));
+	if (!f)
+		return NULL;
+	f->entry = e;
+	f->pos = 0;
+	return f;
+}
+
+void vfs_close_file(vfs_file_t* file) {
+	ftpd_free(ftpd_mem_owner, file);
+}
+
+int vfs_read(void* buffer, int dummy, int len, vfs_file_t* file) {
+	unsigned long left = file->entry->size - file->pos;
+	if ((unsigned long)len > left)
+		len = left;
+	memcpy(buffer, file->entry->data + file->pos, len);
+	file->pos += len;
+	return len;
+}
+
+int vfs_write(void* buffer, int dummy, int len, vfs_file_t* file) {
+	return 0;
+}
+
+int vfs_writev(vfs_file_t* file, const vfs_iovec_t* iov, int iovcnt) {
+	return 0;
+}
+
+int vfs_eof(vfs_file_t* file) {
+	return file->pos >= file->entry->size;
+}
+
+int vfs_rewind(vfs_file_t* file) {
+	file->pos = 0;
+	return 0;
+}
+
+int vfs_seek(vfs_file_t* file, size_t offset) {
+	if (offset > file->entry->size)
+		return 1;
+	file->pos = offset;
+	return 0;
+}
+
+const void* vfs_map(vfs_file_t* file, size_t* len) {
+	if (file->entry->size == 0)
+		return NULL;
+	*len = file->entry->size;
+	return file->entry->data;
+}
+
+void vfs_unmap(vfs_file_t* file, const void* addr, size_t len) {
+}
+
+int vfs_stat(vfs_t* vfs, const char* filename, vfs_stat_t* st) {
+	const vfs_romfs_entry_t* e = romfs_lookup(vfs, filename);
+	if (!e) {
+		memset(st, 0, sizeof(vfs_stat_t));
+		return 1;
+	}
+	st->st_size = e->size;
+	st->st_mode = e->mode;
+	st->st_mtime = e->mtime;
+	return 0;
+}
+
+int vfs_io_hints(vfs_t* vfs, const char* path, vfs_io_hints_t* hints) {
+	/* Reading flash has no preferred size, so just keep calls few. */
+	hints->optimal_size = 4096;
+	hints->alignment = 1;
+	return 0;
+}
+
+int vfs_chdir(vfs_t* vfs, const char* path) {
+	const vfs_romfs_entry_t* e = romfs_lookup(vfs, path);
+	if (!e || !(e->mode & VFS_ROMFS_DIR))
+		return 1;
+	strcpy(vfs->cwd, e->path);
+	return 0;
+}
+
+char* vfs_getcwd(vfs_t* vfs, void* dummy1, int dummy2) {
+	char* cwd = ftpd_alloc(ftpd_mem_owner, strlen(vfs->cwd) + 2);
+	if (!cwd)
+		return NULL;
+	cwd[0] = '/';
+	strcpy(cwd + 1, vfs->cwd);
+	return cwd;
+}
+
+vfs_dir_t* vfs_opendir(vfs_t* vfs, const char* path) {
+	const vfs_romfs_entry_t* e = romfs_lookup(vfs, path);
+	vfs_dir_t* dir;
+
+	if (!e || !(e->mode & VFS_ROMFS_DIR))
+		return NULL;
+	dir = ftpd_alloc(ftpd_mem_owner, sizeof *dir);
+	if (!dir)
+		return NULL;
+	dir->next = e->first_child;
+	return dir;
+}
+
+vfs_dirent_t* vfs_readdir(vfs_dir_t* dir) {
+	const vfs_romfs_entry_t* e;
+	const char* slash;
+
+	if (dir->next < 0)
+		return NULL;
+	e = &vfs_romfs_entries[dir->next];
+	dir->next = e->next_sibling;
+	slash = strrchr(e->path, '/');
+	dir->dirent.name = slash ? slash + 1 : e->path;
+	return &dir->dirent;
+}
+
+void vfs_closedir(vfs_dir_t* dir) {
+	ftpd_free(ftpd_mem_owner, dir);
+}
@@ -0,0 +1,122 @@
+/* Copyright (c) 2013, Philipp Tölke
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef INCLUDE_VFS_H
+#define INCLUDE_VFS_H
+
+/* Read-only filesystem compiled into flash. The image is generated by
+ * tools/mkromfs.py and consists of a table of entries sorted by path.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#define vfs_load_plugin(x)
+#define bcopy(src, dest, len) memmove(dest, src, len)
+
+#define VFS_ROMFS_PATH_MAX 256
+#define VFS_ROMFS_DIR 1
+
+typedef struct {
+	const char* path;		/* without leading slash, "" is the root */
+	const unsigned char* data;
+	unsigned long size;
+	unsigned long mtime;
+	unsigned char mode;		/* VFS_ROMFS_DIR or 0 */
+	int first_child;		/* index of first entry in this directory or -1 */
+	int next_sibling;		/* index of next entry in the same directory or -1 */
+} vfs_romfs_entry_t;
+
+/* Provided by the generated image */
+extern const vfs_romfs_entry_t vfs_romfs_entries[];
+extern const int vfs_romfs_count;
+
+typedef struct {
+	const vfs_romfs_entry_t* entry;
+	unsigned long pos;
+} vfs_file_t;
+typedef struct {
+	const char* name;
+} vfs_dirent_t;
+typedef struct {
+	int next;
+	vfs_dirent_t dirent;
+} vfs_dir_t;
+typedef struct {
+	long st_size;
+	int st_mode;
+	time_t st_mtime;
+} vfs_stat_t;
+typedef struct {
+	char cwd[VFS_ROMFS_PATH_MAX];
+	char path[VFS_ROMFS_PATH_MAX];
+} vfs_t;
+typedef struct {
+	void* base;
+	size_t len;
+} vfs_iovec_t;
+typedef struct {
+	size_t optimal_size;
+	size_t alignment;
+} vfs_io_hints_t;
+
+#define VFS_ISDIR(st_mode) ((st_mode) & VFS_ROMFS_DIR)
+#define VFS_ISREG(st_mode) !((st_mode) & VFS_ROMFS_DIR)
+#define VFS_IRWXU 0
+#define VFS_IRWXG 0
+#define VFS_IRWXO 0
+
+/* Files live in flash, so RETR can pass them to lwIP by reference. */
+#define VFS_HAVE_MAP
+
+/* The image is read-only */
+#define vfs_mkdir(vfs, name, mode) 1
+#define vfs_rmdir(vfs, name) 1
+#define vfs_remove(vfs, name) 1
+#define vfs_rename(vfs, from, to) 1
+
+int vfs_read(void* buffer, int dummy, int len, vfs_file_t* file);
+int vfs_write(void* buffer, int dummy, int len, vfs_file_t* file);
+int vfs_writev(vfs_file_t* file, const vfs_iovec_t* iov, int iovcnt);
+int vfs_eof(vfs_file_t* file);
+int vfs_rewind(vfs_file_t* file);
+int vfs_seek(vfs_file_t* file, size_t offset);
+const void* vfs_map(vfs_file_t* file, size_t* len);
+void vfs_unmap(vfs_file_t* file, const void* addr, size_t len);
+vfs_dirent_t* vfs_readdir(vfs_dir_t* dir);
+vfs_file_t* vfs_open(vfs_t* vfs, const char* filename, const char* mode);
+void vfs_close_file(vfs_file_t* file);
+vfs_t* vfs_openfs();
+void vfs_close(vfs_t* vfs);
+int vfs_chdir(vfs_t* vfs, const char* path);
+char* vfs_getcwd(vfs_t* vfs, void* dummy1, int dummy2);
+int vfs_stat(vfs_t* vfs, const char* filename, vfs_stat_t* st);
+int vfs_io_hints(vfs_t* vfs, const char* path, vfs_io_hints_t* hints);
+vfs_dir_t* vfs_opendir(vfs_t* vfs, const char* path);
+void vfs_closedir(vfs_dir_t* dir);
+
+#endif /* INCLUDE_VFS_H */
@@ -0,0 +1,237 @@
+/* Copyright (c) 2013, Philipp Tölke
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "vfs_uring.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+struct uring_sq {
+	unsigned* head;
+	unsigned* tail;
+	unsigned mask;
+	unsigned entries;
+	unsigned* array;
+	struct io_uring_sqe* sqes;
+	unsigned queued;	/* filled in, not yet submitted */
+};
+
+struct uring_cq {
+	unsigned* head;
+	unsigned* tail;
+	unsigned mask;
+	unsigned entries;
+	struct io_uring_cqe* cqes;
+};
+
+static int ring_fd = -1;
+static struct uring_sq sq;
+static struct uring_cq cq;
+static void *sqring, *cqring;
+static size_t sqlen, cqlen;
+/* Requests the kernel hasn't completed yet. Kept below the size of the
+ * completion queue, so that completions are never dropped. */
+static unsigned inflight;
+
+int vfs_uring_init(unsigned entries) {
+	struct io_uring_params p;
+	void* sqes;
+	int fd;
+
+	if (ring_fd >= 0)
+		return 0;
+	memset(&p, 0, sizeof(p));
+	fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return -errno;
+
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqlen > sqlen)
+		sqlen = cqlen;
+	sqring = mmap(NULL, sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sqring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cqring = sqring;
+	} else {
+		cqring = mmap(NULL, cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cqring == MAP_FAILED) {
+			munmap(sqring, sqlen);
+			goto fail;
+		}
+	}
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		if (cqring != sqring)
+			munmap(cqring, cqlen);
+		munmap(sqring, sqlen);
+		goto fail;
+	}
+
+	sq.head = (unsigned*)((char*)sqring + p.sq_off.head);
+	sq.tail = (unsigned*)((char*)sqring + p.sq_off.tail);
+	sq.mask = *(unsigned*)((char*)sqring + p.sq_off.ring_mask);
+	sq.entries = p.sq_entries;
+	sq.array = (unsigned*)((char*)sqring + p.sq_off.array);
+	sq.sqes = sqes;
+	sq.queued = 0;
+	cq.head = (unsigned*)((char*)cqring + p.cq_off.head);
+	cq.tail = (unsigned*)((char*)cqring + p.cq_off.tail);
+	cq.mask = *(unsigned*)((char*)cqring + p.cq_off.ring_mask);
+	cq.entries = p.cq_entries;
+	cq.cqes = (struct io_uring_cqe*)((char*)cqring + p.cq_off.cqes);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	ring_fd = fd;
+	return 0;
+
+fail:
+	close(fd);
+	return -ENOMEM;
+}
+
+void vfs_uring_exit(void) {
+	if (ring_fd < 0)
+		return;
+	munmap(sq.sqes, sq.entries * sizeof(struct io_uring_sqe));
+	if (cqring != sqring)
+		munmap(cqring, cqlen);
+	munmap(sqring, sqlen);
+	close(ring_fd);
+	ring_fd = -1;
+}
+
+int vfs_uring_fd(void) {
+	return ring_fd;
+}
+
+/* The next free submission entry, or NULL if there is no room. */
+static struct io_uring_sqe* get_sqe(struct vfs_uring_req* req) {
+	struct io_uring_sqe* sqe;
+	unsigned tail;
+
+	if (ring_fd < 0 || inflight + sq.queued >= cq.entries)
+		return NULL;
+	if (sq.queued == sq.entries)
+		vfs_uring_submit();
+	if (sq.queued == sq.entries)
+		return NULL;
+	tail = *sq.tail + sq.queued;
+	sqe = &sq.sqes[tail & sq.mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uint64_t)(uintptr_t)req;
+	sq.array[tail & sq.mask] = tail & sq.mask;
+	sq.queued++;
+	return sqe;
+}
+
+int vfs_uring_read(struct vfs_uring_req* req, int fd, void* buf, unsigned len, uint64_t offset) {
+	struct io_uring_sqe* sqe = get_sqe(req);
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	return 0;
+}
+
+int vfs_uring_writev(struct vfs_uring_req* req, int fd, const struct iovec* iov, int iovcnt, uint64_t offset) {
+	struct io_uring_sqe* sqe = get_sqe(req);
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)iov;
+	sqe->len = iovcnt;
+	sqe->off = offset;
+	return 0;
+}
+
+int vfs_uring_statx(struct vfs_uring_req* req, int dirfd, const char* path, struct statx* stx) {
+	struct io_uring_sqe* sqe = get_sqe(req);
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (uint64_t)(uintptr_t)path;
+	sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+	sqe->off = (uint64_t)(uintptr_t)stx;
+	return 0;
+}
+
+void vfs_uring_submit(void) {
+	unsigned pending;
+
+	if (sq.queued == 0)
+		return;
+	/* Publish the entries before the kernel looks at the tail. */
+	__atomic_store_n(sq.tail, *sq.tail + sq.queued, __ATOMIC_RELEASE);
+	inflight += sq.queued;
+	sq.queued = 0;
+	/* Callers may close files as soon as this returns, so don't leave
+	 * anything behind. Completions can't overflow (see inflight), so
+	 * EAGAIN and EBUSY only last until the kernel has caught up. */
+	while ((pending = *sq.tail - __atomic_load_n(sq.head, __ATOMIC_ACQUIRE)) > 0) {
+		if (syscall(__NR_io_uring_enter, ring_fd, pending, 0, 0, NULL, 0) < 0
+		    && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			break;
+	}
+}
+
+int vfs_uring_complete(void) {
+	unsigned head = *cq.head;
+	int count = 0;
+
+	if (ring_fd < 0)
+		return 0;
+	while (head != __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe* cqe = &cq.cqes[head & cq.mask];
+		struct vfs_uring_req* req = (struct vfs_uring_req*)(uintptr_t)cqe->user_data;
+		int res = cqe->res;
+
+		head++;
+		/* Give the slot back first: done may queue new requests. */
+		__atomic_store_n(cq.head, head, __ATOMIC_RELEASE);
+		inflight--;
+		req->done(req, res);
+		count++;
+	}
+	return count;
+}
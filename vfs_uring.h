@@ -0,0 +1,80 @@
+/* Copyright (c) 2013, Philipp Tölke
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef INCLUDE_VFS_URING_H
+#define INCLUDE_VFS_URING_H
+
+/* Asynchronous storage I/O through io_uring, for the Linux build with
+ * vfs_posix.h and tcp_epoll.c. Requests are queued by the vfs_uring_*()
+ * calls, handed to the kernel together by vfs_uring_submit() and
+ * completed by vfs_uring_complete(), which calls each request's done
+ * function with the result of the system call (a byte count, or a
+ * negative errno). Everything runs on the thread of the event loop.
+ *
+ * The ring is set up with raw system calls, so liburing isn't needed.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/stat.h>
+
+struct vfs_uring_req;
+
+typedef void (*vfs_uring_done_fn)(struct vfs_uring_req* req, int res);
+
+/* Embedded in the caller's request. It must stay valid, like the buffers
+ * and the iovec array of a write, until done has been called. */
+struct vfs_uring_req {
+	vfs_uring_done_fn done;
+};
+
+/* Set up a ring with room for entries queued requests. Returns 0, or
+ * a negative errno if io_uring isn't available. */
+int vfs_uring_init(unsigned entries);
+
+/* Tear the ring down. Nothing may be in flight. */
+void vfs_uring_exit(void);
+
+/* Readable when completions are waiting */
+int vfs_uring_fd(void);
+
+/* Queue a read or a vectored write at offset. Returns 0,
+ * or -1 if the ring is full; the caller then does the I/O itself. */
+int vfs_uring_read(struct vfs_uring_req* req, int fd, void* buf, unsigned len, uint64_t offset);
+int vfs_uring_writev(struct vfs_uring_req* req, int fd, const struct iovec* iov, int iovcnt, uint64_t offset);
+
+/* Queue a statx() of path relative to the directory dirfd. */
+int vfs_uring_statx(struct vfs_uring_req* req, int dirfd, const char* path, struct statx* stx);
+
+/* Hand everything queued to the kernel. Once this returns, the files
+ * of the requests may be closed. */
+void vfs_uring_submit(void);
+
+/* Call done for every finished request. Returns how many there were. */
+int vfs_uring_complete(void);
+
+#endif /* INCLUDE_VFS_URING_H */